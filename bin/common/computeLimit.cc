@@ -9,7 +9,9 @@
 #include "UserCode/bsmhiggs_fwk/interface/RootUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/MacroUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/HxswgUtils.h"
-#include "UserCode/bsmhiggs_fwk/interface/th1fmorph.h"
+#include "UserCode/bsmhiggs_fwk/interface/HistoMorpher.h"
+#include "UserCode/bsmhiggs_fwk/interface/AsymptoticLimits.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
 
 #include "TSystem.h"
 #include "TFile.h"
@@ -34,14 +36,23 @@
 #include "Math/QuantFuncMathCore.h"
 #include "TMath.h"
 #include "TGraphAsymmErrors.h"
+#include "RVersion.h"
 
 #include<iostream>
 #include<fstream>
 #include<map>
+#include<unordered_map>
 #include<algorithm>
 #include<vector>
 #include<set>
+#include<sstream>
 #include <regex>
+#include <thread>
+#include <mutex>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cerrno>
 
 
 using namespace std;
@@ -103,6 +114,7 @@ std::map<string, int> indexcutML;
 std::map<string, int> indexcutMR;
 
 std::vector<string> keywords;
+string profile = "";
 
 
 int indexvbf = -1;
@@ -110,6 +122,75 @@ int massL=-1, massR=-1;
 
 
 double dropBckgBelow=0.01;
+string batchFile = "";
+bool asymptoticLimits = false;
+bool asymptoticObserved = false;
+int nThreads = 1;
+int batchWorkers = 1;
+string optimFile = "";
+bool optimSignificance = false;
+
+//in batch mode the input file stays open for all the points and the objects read from it are kept in memory
+bool cacheInput = false;
+std::map<string, TObject*> inputCache;
+TObject* getInputObject(TDirectory* dir, const string& path){
+  if(!cacheInput)return dir->Get(path.c_str());
+  string key = string(dir->GetPath())+"/"+path;
+  std::map<string, TObject*>::iterator it = inputCache.find(key);
+  if(it!=inputCache.end())return it->second;
+  TObject* obj = dir->Get(path.c_str());
+  inputCache[key] = obj;  //missing objects are cached as well
+  return obj;
+}
+
+//one point (mass and cut indices) of a batch
+struct BatchPoint_t{
+  string outDir;
+  int mass, massL, massR, indexvbf;
+  std::vector<int> indexcutV, indexcutVL, indexcutVR;
+};
+
+std::vector<int> parseIntList(const string& list){
+  std::vector<int> values;
+  std::stringstream ss(list);
+  string item;
+  while(std::getline(ss, item, ',')){ int C; if(sscanf(item.c_str(), "%i", &C)==1)values.push_back(C); }
+  return values;
+}
+
+//one line per point: the output directory followed by the options of the point (--m, --mL, --mR, --index, --indexL, --indexR, --indexvbf)
+bool readBatchFile(const string& url, std::vector<BatchPoint_t>& points){
+  std::ifstream in(url.c_str());
+  if(!in.good()){ printf("Can not open batch file %s\n", url.c_str()); return false; }
+  string line;
+  while(std::getline(in, line)){
+    if(line.find('#')!=string::npos)line = line.substr(0, line.find('#'));
+    std::stringstream ss(line);
+    std::vector<string> tokens; string token;
+    while(ss >> token)tokens.push_back(token);
+    if(tokens.size()==0)continue;
+
+    BatchPoint_t point;
+    point.outDir = tokens[0];
+    point.mass = -1; point.massL = -1; point.massR = -1; point.indexvbf = indexvbf;
+    for(unsigned int i=1;i<tokens.size();i++){
+      string arg = tokens[i];
+      if(i+1>=tokens.size()){ printf("Missing value for %s in batch line: %s\n", arg.c_str(), line.c_str()); return false; }
+      if(arg.find("--indexvbf")!=string::npos)    { sscanf(tokens[i+1].c_str(),"%i",&point.indexvbf); i++; }
+      else if(arg.find("--indexL")!=string::npos) { point.indexcutVL = parseIntList(tokens[i+1]); i++; }
+      else if(arg.find("--indexR")!=string::npos) { point.indexcutVR = parseIntList(tokens[i+1]); i++; }
+      else if(arg.find("--index" )!=string::npos) { point.indexcutV  = parseIntList(tokens[i+1]); i++; }
+      else if(arg.find("--mL")!=string::npos)     { sscanf(tokens[i+1].c_str(),"%i",&point.massL); i++; }
+      else if(arg.find("--mR")!=string::npos)     { sscanf(tokens[i+1].c_str(),"%i",&point.massR); i++; }
+      else if(arg.find("--m" )!=string::npos)     { sscanf(tokens[i+1].c_str(),"%i",&point.mass ); i++; }
+      else { printf("Unknown option %s in batch line: %s\n", arg.c_str(), line.c_str()); return false; }
+    }
+    if(point.mass==-1 || point.indexcutV.size()==0){ printf("Missing --m or --index in batch line: %s\n", line.c_str()); return false; }
+    points.push_back(point);
+  }
+  printf("%i points to be processed from %s\n", (int)points.size(), url.c_str());
+  return points.size()>0;
+}
 
 bool matchKeyword(JSONWrapper::Object& process, std::vector<string>& keywords){
   if(keywords.size()<=0)return true;
@@ -135,33 +216,318 @@ void filterBinContent(TH1* histo){
 }
 
 
+//interned names of the shape systematics: the dense shapes refer to their variations by index and the
+//up/down classification is done once per name instead of once per bin and per call
+class SystNameTable_t
+{
+  public:
+    std::vector<string> names;
+    std::vector<bool>   isUp;
+    std::vector<bool>   isDown;
+
+    int id(const string& name){
+      std::unordered_map<string, int>::iterator it = ids.find(name);
+      if(it!=ids.end())return it->second;
+      ids[name] = names.size();
+      names.push_back(name);
+      isUp  .push_back(name.find("Up"  )!=string::npos);
+      isDown.push_back(name.find("Down")!=string::npos);
+      return names.size()-1;
+    }
+
+  private:
+    std::unordered_map<string, int> ids;
+};
+SystNameTable_t SystNames;
+
+//bin-by-bin statistical variation: it differs from the nominal shape in a single bin only
+struct StatBin_t
+{
+  int    bin;
+  double up;
+  double down;
+  double error;  //bin error of the variated shapes
+};
+
+//the InstrMET gamma stat uncertainties are read once from the external file and kept for all the channels
+std::pair<TH1*, TH1*> getInstrMETGammaStats(const string& channel_and_bin){
+  static TFile* file = NULL;
+  static bool opened = false;
+  static std::map<string, std::pair<TH1*, TH1*> > cache;
+  std::map<string, std::pair<TH1*, TH1*> >::iterator it = cache.find(channel_and_bin);
+  if(it!=cache.end())return it->second;
+  if(!opened){
+    opened = true;
+    TString url(string(std::getenv("CMSSW_BASE"))+"/src/UserCode/bsmhiggs_fwk/data/InstrMET_systematics/InstrMET_systematics_GAMMASTATS.root");
+    file = TFile::Open(url);
+    if(!file || file->IsZombie()){ printf("Can not open %s, no InstrMET gamma stat uncertainties\n", url.Data()); file = NULL; }
+  }
+  std::pair<TH1*, TH1*> stats(NULL, NULL);
+  if(file){
+    stats.first  = (TH1*)utils::root::GetObjectFromPath(file, (channel_and_bin+"_mt_InstrMET_absolute_shape_up"  ).c_str() );
+    stats.second = (TH1*)utils::root::GetObjectFromPath(file, (channel_and_bin+"_mt_InstrMET_absolute_shape_down").c_str() );
+    if(!stats.first || !stats.second){ printf("No InstrMET gamma stat uncertainties for %s\n", channel_and_bin.c_str()); stats.first = stats.second = NULL; }
+  }
+  cache[channel_and_bin] = stats;
+  return stats;
+}
+
+//dense copy of a shape and of all its variations: the bin contents and errors (under/overflow included) are
+//stored contiguously, one row of nBins+2 values per variation, row 0 being the nominal shape
+struct DenseShape_t
+{
+  int nBins;
+  std::vector<int>    syst;      //interned name of the variation of each row
+  std::vector<double> content;
+  std::vector<double> error;
+  std::vector<double> integral;  //sum of the bins 1..nBins of each row
+
+  //bin-by-bin stat variations, kept sparse
+  std::vector<int>    statBin;
+  std::vector<double> statUp, statDown;
+  std::vector<int>    statSystUp, statSystDown;
+
+  DenseShape_t():nBins(0){}
+  int nRows() const { return syst.size(); }
+  const double* row(int r) const { return &content[r*(nBins+2)]; }
+  const double* rowError(int r) const { return &error[r*(nBins+2)]; }
+
+  void addRow(int systId, TH1* h){
+    syst.push_back(systId);
+    double sum = 0;
+    for(int b=0;b<=nBins+1;b++){
+      content.push_back(h->GetBinContent(b));
+      error  .push_back(h->GetBinError(b));
+      if(b>=1 && b<=nBins)sum += content.back();
+    }
+    integral.push_back(sum);
+  }
+
+  void addStat(const string& name, const StatBin_t& stat){
+    if(stat.bin<0 || stat.bin>nBins+1)return;
+    statBin     .push_back(stat.bin);
+    statUp      .push_back(stat.up);
+    statDown    .push_back(stat.down);
+    statSystUp  .push_back(SystNames.id(name+"Up"  ));
+    statSystDown.push_back(SystNames.id(name+"Down"));
+  }
+};
+
+//map of the shapes of a process (variation name -> histogram) whose sums are evaluated lazily: the clones and additions
+//recorded by addChannel (totals, merged bins, data-driven processes) are only done when the map is read, and the ones
+//whose result is overwritten before (e.g. a variation of the total background set by several processes, or a total
+//recomputed before being used) are skipped. The results are the same as doing the operations immediately: a map whose
+//pending operations read the histograms of another map is evaluated before that one is read, modified or destroyed,
+//so the histograms of the sources can still be modified in place through the map afterwards.
+class ShapeMap_t
+{
+  public:
+    typedef std::map<string, TH1*>::iterator iterator;
+
+    ShapeMap_t(){}
+    ShapeMap_t(const ShapeMap_t& other){ other.touch(); shapes = other.shapes; }
+    ShapeMap_t& operator=(const ShapeMap_t& other){
+      if(this==&other)return *this;
+      other.touch();
+      flushDependents();
+      dropPending();
+      shapes = other.shapes;
+      return *this;
+    }
+    ~ShapeMap_t(){ flushDependents(); dropPending(); }
+
+    iterator begin(){ touch(); return shapes.begin(); }
+    iterator end(){ touch(); return shapes.end(); }
+    iterator find(const string& name){ touch(); return shapes.find(name); }
+    iterator erase(iterator it){ touch(); return shapes.erase(it); }
+    size_t size(){ touch(); return shapes.size(); }
+    TH1*& operator[](const string& name){ touch(); return shapes[name]; }
+    void clear(){ flushDependents(); dropPending(); shapes.clear(); }
+
+    //read-only access: the pending operations of this map are evaluated, the maps reading it are left pending
+    const std::map<string, TH1*>& read() const { if(!ops.empty())touch(); return shapes; }
+
+    //the entry exists or will be created by a pending operation, without evaluating anything
+    bool contains(const string& name) const {
+      if(shapes.find(name)!=shapes.end())return true;
+      for(size_t o=0;o<ops.size();o++){ if(ops[o].name==name)return true; }
+      return false;
+    }
+
+    //entry name = clone of h (histogram of the map src), named after h and suffix
+    void setLazy(const string& name, const ShapeMap_t& src, TH1* h, const string& suffix){ record(name, &src, h, "", h, suffix, 1.0, true); }
+    //entry name = clone of the entry from of this map at this point, named after nameFrom and suffix
+    void setLazyFromEntry(const string& name, const string& from, TH1* nameFrom, const string& suffix){ record(name, NULL, NULL, from, nameFrom, suffix, 1.0, true); }
+    //entry name += coef * h (histogram of the map src)
+    void addLazy(const string& name, const ShapeMap_t& src, TH1* h, double coef){ record(name, &src, h, "", NULL, "", coef, false); }
+
+  private:
+    struct LazyOp_t
+    {
+      string name;
+      TH1*   h;         //NULL: clone of the entry from
+      string from;
+      TH1*   nameFrom;
+      string suffix;
+      double coef;
+      bool   assign;
+    };
+
+    void record(const string& name, const ShapeMap_t* src, TH1* h, const string& from, TH1* nameFrom, const string& suffix, double coef, bool assign){
+      flushDependents();  //they must see the histograms of this map as they are now
+      LazyOp_t op; op.name = name; op.h = h; op.from = from; op.nameFrom = nameFrom; op.suffix = suffix; op.coef = coef; op.assign = assign;
+      ops.push_back(op);
+      if(src && src!=this && sources.insert(src).second)src->dependents.insert(this);
+    }
+
+    //evaluates the pending operations of this map (and first of the maps reading it)
+    void touch() const {
+      if(!dependents.empty())flushDependents();
+      if(ops.empty())return;
+      std::vector<LazyOp_t> todo; todo.swap(ops);
+      dropSources();
+
+      //an assignment makes the previous operations on the same entry useless, unless the entry is cloned in between
+      std::vector<bool> live(todo.size(), false);
+      std::set<string> overwritten;
+      for(int o=todo.size()-1;o>=0;o--){
+        if(overwritten.find(todo[o].name)!=overwritten.end())continue;
+        live[o] = true;
+        if(todo[o].assign)overwritten.insert(todo[o].name);
+        if(todo[o].assign && !todo[o].h)overwritten.erase(todo[o].from);
+      }
+
+      for(size_t o=0;o<todo.size();o++){
+        if(!live[o])continue;
+        const LazyOp_t& op = todo[o];
+        if(op.assign){
+          TH1* h = op.h;
+          if(!h){
+            std::map<string, TH1*>::iterator from = shapes.find(op.from);
+            if(from==shapes.end() || !from->second){ printf("Shape %s is missing, %s is not computed\n", op.from.c_str(), op.name.c_str()); continue; }
+            h = from->second;
+          }
+          TH1* clone = (TH1*)h->Clone(TString(op.nameFrom->GetName() + op.suffix));
+          clone->SetDirectory(0);
+          shapes[op.name] = clone;
+        }else{
+          std::map<string, TH1*>::iterator to = shapes.find(op.name);
+          if(to==shapes.end() || !to->second){ printf("Shape %s is missing, can not add %s to it\n", op.name.c_str(), op.h->GetName()); continue; }
+          to->second->Add(op.h, op.coef);
+        }
+      }
+    }
+
+    void flushDependents() const {
+      while(!dependents.empty()){ (*dependents.begin())->touch(); }
+    }
+
+    void dropSources() const {
+      for(std::set<const ShapeMap_t*>::iterator s=sources.begin(); s!=sources.end(); s++){ (*s)->dependents.erase(this); }
+      sources.clear();
+    }
+
+    void dropPending(){ ops.clear(); dropSources(); }
+
+    mutable std::map<string, TH1*> shapes;
+    mutable std::vector<LazyOp_t> ops;
+    mutable std::set<const ShapeMap_t*> sources;     //maps read by the pending operations
+    mutable std::set<const ShapeMap_t*> dependents;  //maps whose pending operations read this one
+};
+
+//yields and uncertainties of a shape used by the tables and the plots, computed in one pass over its dense copy
+//(the scale uncertainties are not included: uncScale is modified directly by many steps and is cheap to sum)
+struct YieldSummary_t
+{
+  double yield;                              //sum of the bins 1..nBins
+  double yieldError;                         //stat uncertainty of the yield
+  double shapeUncUp, shapeUncDown;           //quadratic sum of the yield differences of the Up (Down) variations, -1 if none
+  std::vector<double> binUncUp, binUncDown;  //same bin by bin, under/overflow included (-1 for the bins without variation)
+
+  YieldSummary_t():yield(0), yieldError(0), shapeUncUp(-1), shapeUncDown(-1){}
+};
+
 //wrapper for a projected shape for a given proc
 class ShapeData_t
 {
   public:
   	std::map<string, double> uncScale;
-  	std::map<string, TH1*  > uncShape;
+  	ShapeMap_t uncShape;
+  	//bin-by-bin stat uncertainties (name without Up/Down), only turned into histograms for the plots and the shapes file;
+  	//code summing or rebinning the shapes after makeStatUnc must call expandStatUnc() first
+  	std::map<string, StatBin_t> uncStatBin;
   	TH1* fit;
 
   	ShapeData_t(){
 	  	fit=NULL;
+	  	denseValid=false;
+	  	summaryValid=false;
   	}
   	~ShapeData_t(){}
 
+  	//the dense copy and the yield summary are built at the first use and rebuilt after a change of the uncertainty map
+  	//made through this class, code modifying the histograms of uncShape in place must call invalidateDense()
+  	void invalidateDense(){ denseValid=false; summaryValid=false; }
+
+  	const DenseShape_t& dense(){
+     	if(denseValid)return denseShape;
+     	denseShape = DenseShape_t();
+     	denseValid = true;
+     	TH1* h = histo();
+     	if(!h)return denseShape;
+     	denseShape.nBins = h->GetXaxis()->GetNbins();
+     	denseShape.content.reserve(uncShape.size()*(denseShape.nBins+2));
+     	denseShape.error  .reserve(uncShape.size()*(denseShape.nBins+2));
+     	denseShape.addRow(SystNames.id(""), h);
+     	for(std::map<string, TH1*>::iterator var = uncShape.begin(); var!=uncShape.end(); var++){
+        if(var->first=="" || !var->second)continue;
+        if(var->second->GetXaxis()->GetNbins()!=denseShape.nBins){ printf("Variation %s of %s has a different binning, it is ignored\n", var->first.c_str(), h->GetName()); continue; }
+        denseShape.addRow(SystNames.id(var->first), var->second);
+     	}
+     	for(std::map<string, StatBin_t>::iterator stat = uncStatBin.begin(); stat!=uncStatBin.end(); stat++){
+        denseShape.addStat(stat->first, stat->second);
+     	}
+     	return denseShape;
+  	}
+
+  	//histogram of one side of a bin-by-bin stat variation
+  	TH1* makeStatBinHisto(const StatBin_t& stat, bool up, const TString& name){
+     	TH1* h = (TH1*)histo()->Clone(name);
+     	h->SetDirectory(0);
+     	h->SetBinContent(stat.bin, up ? stat.up : stat.down);
+     	h->SetBinError(stat.bin, stat.error);
+     	return h;
+  	}
+
+  	//turn the bin-by-bin stat variations into histograms of the uncertainty map
+  	void expandStatUnc(){
+     	if(uncStatBin.empty())return;
+     	invalidateDense();
+     	for(std::map<string, StatBin_t>::iterator stat = uncStatBin.begin(); stat!=uncStatBin.end(); stat++){
+        uncShape[stat->first+"Up"  ] = makeStatBinHisto(stat->second, true , TString(histo()->GetName())+stat->first+"Up"  );
+        uncShape[stat->first+"Down"] = makeStatBinHisto(stat->second, false, TString(histo()->GetName())+stat->first+"Down");
+     	}
+     	uncStatBin.clear();
+  	}
+
   	TH1* histo(){
      	if(uncShape.find("")==uncShape.end())return NULL;
      	return uncShape[""];
   	}
 
   	void clearSyst(){
+     	invalidateDense();
      	TH1* nominal = histo();
      	uncScale.clear();
      	uncShape.clear();
+     	uncStatBin.clear();
      	uncShape[""] = nominal;
   	}
 
 
   	void removeStatUnc(){
+     	invalidateDense();
+     	uncStatBin.clear();
      	for(auto unc = uncShape.begin(); unc!= uncShape.end(); unc++){
         TString name = unc->first.c_str();
         if(name.Contains("stat") && (name.Contains("Up") || name.Contains("Down"))){
@@ -173,31 +539,31 @@ class ShapeData_t
 
   	void makeStatUnc(string prefix="", string suffix="", string suffix2="", bool noBinByBin=false){
      	if(!histo() || histo()->Integral()<=0)return;
+     	invalidateDense();
      	string delimiter = "_";
      	unsigned firstDelimiter = suffix.find(delimiter);
      	unsigned lastDelimiter = suffix.find_last_of(delimiter);
      	unsigned endPosOfFirstDelimiter = firstDelimiter + delimiter.length();
      	string channel_and_bin = suffix.substr(endPosOfFirstDelimiter, lastDelimiter-endPosOfFirstDelimiter);
      	if(suffix.find("instrmet") != std::string::npos){
+        std::pair<TH1*, TH1*> gammaStats = getInstrMETGammaStats(channel_and_bin);
+        TH1* h_InstrMET_Up_gammaStats = gammaStats.first;
+        TH1* h_InstrMET_Down_gammaStats = gammaStats.second;
+        if(!h_InstrMET_Up_gammaStats || !h_InstrMET_Down_gammaStats)return;
         TH1* h = (TH1*) histo()->Clone("TMPFORSTAT");
         int BIN=0;
 	std::vector<unsigned int > v_lowStatBin;
 	v_lowStatBin.clear();
-	TString InstrMET_gammaStats_Url(string(std::getenv("CMSSW_BASE"))+"/src/UserCode/bsmhiggs_fwk/data/InstrMET_systematics/InstrMET_systematics_GAMMASTATS.root");
-	TFile* f_InstrMET_gammaStats = TFile::Open(InstrMET_gammaStats_Url);
-	TH1* h_InstrMET_Up_gammaStats = (TH1*)utils::root::GetObjectFromPath(f_InstrMET_gammaStats, (channel_and_bin+"_mt_InstrMET_absolute_shape_up").c_str() );
-	TH1* h_InstrMET_Down_gammaStats = (TH1*)utils::root::GetObjectFromPath(f_InstrMET_gammaStats, (channel_and_bin+"_mt_InstrMET_absolute_shape_down").c_str() );   			
 	for(int ibin=1; ibin<=h->GetXaxis()->GetNbins(); ibin++){           
           if( true /*h->GetBinContent(ibin)/h->Integral()>0.01*/){ //This condition is removed for the moment, we may put it back in the future. 
 
 	    char ibintxt[255]; sprintf(ibintxt, "_b%i", BIN);BIN++;
-	    TH1* statU=(TH1 *)h->Clone(TString(h->GetName())+"StatU"+ibintxt);//  statU->Reset();
-	    TH1* statD=(TH1 *)h->Clone(TString(h->GetName())+"StatD"+ibintxt);//  statD->Reset();           
-
-	    statU->SetBinContent(ibin, std::max(0.0, h_InstrMET_Up_gammaStats->GetBinContent(ibin))>0 ? h_InstrMET_Up_gammaStats->GetBinContent(ibin) : 0.115);
-	    statD->SetBinContent(ibin, std::max(0.0, h_InstrMET_Down_gammaStats->GetBinContent(ibin))); 
-	    uncShape[prefix+"stat"+suffix+ibintxt+suffix2+"Up"  ] = statU;
-	    uncShape[prefix+"stat"+suffix+ibintxt+suffix2+"Down"] = statD;
+	    StatBin_t stat;
+	    stat.bin   = ibin;
+	    stat.up    = std::max(0.0, h_InstrMET_Up_gammaStats->GetBinContent(ibin))>0 ? h_InstrMET_Up_gammaStats->GetBinContent(ibin) : 0.115;
+	    stat.down  = std::max(0.0, h_InstrMET_Down_gammaStats->GetBinContent(ibin));
+	    stat.error = h->GetBinError(ibin);
+	    uncStatBin[prefix+"stat"+suffix+ibintxt+suffix2] = stat;
 
 					}
           else{
@@ -205,10 +571,9 @@ class ShapeData_t
           }
         }
 
+				if(v_lowStatBin.size()>0){
      		TH1* statU=(TH1 *)h->Clone(TString(h->GetName())+"StatU");
      		TH1* statD=(TH1 *)h->Clone(TString(h->GetName())+"StatD");
-
-				if(v_lowStatBin.size()>0){
         	for(unsigned int j=0; j < v_lowStatBin.size(); j++){
             statU->SetBinContent(v_lowStatBin[j], std::max(0.0, h_InstrMET_Up_gammaStats->GetBinContent(v_lowStatBin[j])));   
             statD->SetBinContent(v_lowStatBin[j], std::max(0.0, h_InstrMET_Down_gammaStats->GetBinContent(v_lowStatBin[j])));   
@@ -217,7 +582,6 @@ class ShapeData_t
      			uncShape[prefix+"stat"+suffix+"Down"] = statD;
         }	
 
-				//f_InstrMET_gammaStats->Close();
      		delete h; //all done with this copy
 
 			}
@@ -232,27 +596,28 @@ class ShapeData_t
           if( !(h->GetBinContent(ibin)<=0 && h->GetBinError(ibin)>0) &&  (h->GetBinContent(ibin)<=0 || h->GetBinContent(ibin)/h->Integral()<0.01 || h->GetBinError(ibin)/h->GetBinContent(ibin)<statBinByBin))continue;
 					//           if(h->GetBinContent(ibin)<=0)continue;
           char ibintxt[255]; sprintf(ibintxt, "_b%i", BIN);BIN++;
-          TH1* statU=(TH1 *)h->Clone(TString(h->GetName())+"StatU"+ibintxt);//  statU->Reset();
-          TH1* statD=(TH1 *)h->Clone(TString(h->GetName())+"StatD"+ibintxt);//  statD->Reset();           
+          StatBin_t stat;
+          stat.bin = ibin;
           if(h->GetBinContent(ibin)>0){
-            statU->SetBinContent(ibin,std::min(2*h->GetBinContent(ibin), std::max(0.01*h->GetBinContent(ibin), h->GetBinContent(ibin) + h->GetBinError(ibin))));   statU->SetBinError(ibin, 0.0);
-            statD->SetBinContent(ibin,std::min(2*h->GetBinContent(ibin), std::max(0.01*h->GetBinContent(ibin), h->GetBinContent(ibin) - h->GetBinError(ibin))));   statD->SetBinError(ibin, 0.0);
-						//            statU->SetBinContent(ibin,std::min(2*h->GetBinContent(ibin), std::max(0.0, h->GetBinContent(ibin) + h->GetBinError(ibin))));   statU->SetBinError(ibin, 0);
-						//            statD->SetBinContent(ibin,std::min(2*h->GetBinContent(ibin), std::max(0.0, h->GetBinContent(ibin) - h->GetBinError(ibin))));   statD->SetBinError(ibin, 0);
+            stat.up    = std::min(2*h->GetBinContent(ibin), std::max(0.01*h->GetBinContent(ibin), h->GetBinContent(ibin) + h->GetBinError(ibin)));
+            stat.down  = std::min(2*h->GetBinContent(ibin), std::max(0.01*h->GetBinContent(ibin), h->GetBinContent(ibin) - h->GetBinError(ibin)));
+            stat.error = 0.0;
+						//            stat.up   = std::min(2*h->GetBinContent(ibin), std::max(0.0, h->GetBinContent(ibin) + h->GetBinError(ibin)));
+						//            stat.down = std::min(2*h->GetBinContent(ibin), std::max(0.0, h->GetBinContent(ibin) - h->GetBinError(ibin)));
           }else{
-            statU->SetBinContent(ibin,              statU->GetBinContent(ibin) + statU->GetBinError(ibin));
-            statD->SetBinContent(ibin,std::max(0.0, statD->GetBinContent(ibin) - statD->GetBinError(ibin)));
+            stat.up    =               h->GetBinContent(ibin) + h->GetBinError(ibin);
+            stat.down  = std::max(0.0, h->GetBinContent(ibin) - h->GetBinError(ibin));
+            stat.error = h->GetBinError(ibin);
           }
-          uncShape[prefix+"stat"+suffix+ibintxt+suffix2+"Up"  ] = statU;
-          uncShape[prefix+"stat"+suffix+ibintxt+suffix2+"Down"] = statD;
+          uncStatBin[prefix+"stat"+suffix+ibintxt+suffix2] = stat;
           /*h->SetBinContent(ibin, 0);*/  h->SetBinError(ibin, 0);  //remove this bin from shape variation for the other ones
-          //printf("%s --> %f - %f - %f\n", (prefix+"stat"+suffix+ibintxt+suffix2+"Up").c_str(), statD->Integral(), h->GetBinContent(ibin), statU->Integral() );
+          //printf("%s --> %f - %f - %f\n", (prefix+"stat"+suffix+ibintxt+suffix2).c_str(), stat.down, h->GetBinContent(ibin), stat.up );
         }
      	}
 
      	//after this line, all bins with large stat uncertainty have been considered separately
      	//so now it remains to consider all the other bins for which we assume a total correlation bin by bin
-     	if(h->Integral()<=0)return; //all non empty bins have already bin variated
+     	if(h->Integral()<=0){ delete h; return; } //all non empty bins have already bin variated
      	TH1* statU=(TH1 *)h->Clone(TString(h->GetName())+"StatU");
      	TH1* statD=(TH1 *)h->Clone(TString(h->GetName())+"StatD");
      	for(int ibin=1; ibin<=statU->GetXaxis()->GetNbins(); ibin++){
@@ -280,40 +645,76 @@ class ShapeData_t
      	return Total>0?sqrt(Total):-1;
   	}
 
-		double getIntegratedShapeUncertainty(string name, string upORdown){
-     	double Total=0;
-     	//this = ch->second.shapes[histoName.Data()]
-     	for(std::map<string, TH1*>::iterator var = uncShape.begin(); var!=uncShape.end(); var++){
-       	TString systName = var->first.c_str();
-       	if(var->first=="")continue; //Skip Nominal shape
-       	if(!systName.Contains(upORdown))continue; //only look for syst up or down at a time (upORdown should be either "Up" or "Down"
-       	TH1* hvar = (TH1*)(var->second->Clone((name+var->first).c_str()));
-
- 			 	double varYield = hvar->Integral();
-			 	TH1* h = (TH1*)(this->histo()->Clone((name+"Nominal").c_str()));
-		   	double yield = h->Integral();
-       	Total+=pow(varYield-yield,2); //the total shape unc is the sqrt of the quadratical sum of the difference between the nominal and the variated yields.
-     	}     
-     	return Total>0?sqrt(Total):-1;
+  	//yield summary of the shape: the yields tables and the plots of several channel selections share it
+  	const YieldSummary_t& summary(){
+     	if(summaryValid)return yieldSummary;
+     	const DenseShape_t& d = dense();
+     	yieldSummary = YieldSummary_t();
+     	summaryValid = true;
+     	if(d.nRows()==0)return yieldSummary;
+     	const double* nominal = d.row(0);
+     	const double* nominalError = d.rowError(0);
+     	double error2 = 0;
+     	for(int b=1;b<=d.nBins;b++)error2 += nominalError[b]*nominalError[b];
+     	yieldSummary.yield = d.integral[0];
+     	yieldSummary.yieldError = sqrt(error2);
+
+     	//the total shape uncertainty is the quadratic sum of the differences between the variated and the nominal yields,
+     	//the Up (Down) one with the variations whose name contains "Up" ("Down")
+     	double totalUp=0, totalDown=0;
+     	std::vector<double>& binUp   = yieldSummary.binUncUp;
+     	std::vector<double>& binDown = yieldSummary.binUncDown;
+     	binUp.assign(d.nBins+2, 0.0);
+     	binDown.assign(d.nBins+2, 0.0);
+     	for(int r=1;r<d.nRows();r++){
+        bool isUp = SystNames.isUp[d.syst[r]], isDown = SystNames.isDown[d.syst[r]];
+        if(!isUp && !isDown)continue;
+        double diff = d.integral[r]-d.integral[0];
+        if(isUp  )totalUp   += diff*diff;
+        if(isDown)totalDown += diff*diff;
+        const double* var = d.row(r);
+        for(int b=0;b<=d.nBins+1;b++){
+          double binDiff = var[b]-nominal[b];
+          if(isUp  )binUp  [b] += binDiff*binDiff;
+          if(isDown)binDown[b] += binDiff*binDiff;
+        }
+     	}
+     	for(unsigned int i=0;i<d.statBin.size();i++){
+        int b = d.statBin[i];
+        double diffs[2] = {d.statUp[i]-nominal[b], d.statDown[i]-nominal[b]};
+        int ids[2] = {d.statSystUp[i], d.statSystDown[i]};
+        for(int v=0;v<2;v++){
+          double diff2 = diffs[v]*diffs[v];
+          if(SystNames.isUp  [ids[v]]){ binUp  [b] += diff2; if(b>=1 && b<=d.nBins)totalUp   += diff2; }
+          if(SystNames.isDown[ids[v]]){ binDown[b] += diff2; if(b>=1 && b<=d.nBins)totalDown += diff2; }
+        }
+     	}
+     	yieldSummary.shapeUncUp   = totalUp  >0 ? sqrt(totalUp  ) : -1;
+     	yieldSummary.shapeUncDown = totalDown>0 ? sqrt(totalDown) : -1;
+     	for(int b=0;b<=d.nBins+1;b++){
+        binUp  [b] = binUp  [b]>0 ? sqrt(binUp  [b]) : -1;
+        binDown[b] = binDown[b]>0 ? sqrt(binDown[b]) : -1;
+     	}
+     	return yieldSummary;
   	}
 
-		double getBinShapeUncertainty(string name, int bin, string upORdown){
-     	double Total=0;
-     	//this = ch->second.shapes[histoName.Data()]
-     	for(std::map<string, TH1*>::iterator var = uncShape.begin(); var!=uncShape.end(); var++){
-       	TString systName = var->first.c_str();
-       	//if(var->first==""){
-       	//}
-       	if(var->first=="")continue; //Skip Nominal shape
-       	if(!systName.Contains(upORdown))continue; //only look for syst up or down at a time (upORdown should be either "Up" or "Down"
-       	TH1* hvar = (TH1*)(var->second->Clone((name+var->first).c_str()));
-
- 			 	double varYield = hvar->GetBinContent(bin);
-			 	TH1* h = (TH1*)(this->histo()->Clone((name+"Nominal").c_str()));
-		   	double yield = h->GetBinContent(bin);
-       	Total+=pow(varYield-yield,2); //the total shape unc is the sqrt of the quadratical sum of the difference between the nominal and the variated yields.
-     	}     
-     	return Total>0?sqrt(Total):-1;
+  	//only the variations whose name contains upORdown ("Up" or "Down") are considered
+  	double getIntegratedShapeUncertainty(string upORdown){
+     	const YieldSummary_t& sum = summary();
+     	return upORdown=="Up" ? sum.shapeUncUp : sum.shapeUncDown;
+  	}
+
+  	double getBinShapeUncertainty(int bin, string upORdown){
+     	const YieldSummary_t& sum = summary();
+     	const std::vector<double>& unc = upORdown=="Up" ? sum.binUncUp : sum.binUncDown;
+     	if(bin<0 || bin>=(int)unc.size())return -1;
+     	return unc[bin];
+  	}
+
+  	//same as getBinShapeUncertainty for all the bins at once (-1 for the bins without variation)
+  	void getBinShapeUncertainties(string upORdown, std::vector<double>& unc){
+     	const YieldSummary_t& sum = summary();
+     	unc = upORdown=="Up" ? sum.binUncUp : sum.binUncDown;
   	}
 
 
@@ -324,6 +725,11 @@ class ShapeData_t
      	}     
   	}
 
+  private:
+  	DenseShape_t denseShape;
+  	bool denseValid;
+  	YieldSummary_t yieldSummary;
+  	bool summaryValid;
 
 };
 
@@ -443,6 +849,12 @@ class AllInfo_t
     // Handle empty bins
     void HandleEmptyBins(string histoName);
 
+    // Delete all the histograms owned by the shapes
+    void deleteShapes();
+
+    // Compute the asymptotic CLs limits of the datacards from the shapes in memory (fast alternative to combine)
+    AsymptoticLimits::Result_t computeAsymptoticLimits(string histoName, bool observed, bool writeLog=true);
+
 };
 
 
@@ -493,8 +905,24 @@ void printHelp()
   printf("--dropBckgBelow --> drop all background processes that contributes for less than a threshold to the total background yields\n");
   printf("--scaleVBF    --> scale VBF signal by ggH/VBF\n");
   printf("--key        --> provide a key for sample filtering in the json\n");  
+  printf("--profile    --> write the time and memory used by each step to this JSON file\n");
+  printf("--batch      --> file with one point per line: output directory followed by --m, --mL, --mR, --index, --indexL, --indexR or --indexvbf\n");
+  printf("                 (the input file is read once and the shapes files and datacards of each point are produced in its directory)\n");
+  printf("--asymptotic --> compute the expected asymptotic CLs limits and significance of the datacards in process (AsymptoticLimits.log)\n");
+  printf("--asymptoticObs --> same as --asymptotic, with the observed limit\n");
+  printf("--nThreads   --> number of threads used to read the shapes from the input file (1 by default)\n");
+  printf("--batchWorkers --> number of forked processes sharing the points of the batch (1 by default)\n");
+  printf("--optim      --> cut optimisation over the points of the batch: they are only evaluated with the asymptotic limits (no plot,\n");
+  printf("                 shapes file or datacards) and ranked by mass in this file, then the shapes file and the datacards of the best\n");
+  printf("                 point of each mass are produced\n");
+  printf("--optimSignificance --> rank the points of --optim by expected significance instead of expected limit\n");
 }
 
+int runMassPoint(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, bool writeOutput=true, AsymptoticLimits::Result_t* limits=NULL);
+int runBatchPoint(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, std::vector<BatchPoint_t>& points, unsigned int p, bool writeOutput, AsymptoticLimits::Result_t* limits);
+void runBatchWorkers(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, std::vector<BatchPoint_t>& points, const std::vector<unsigned int>& todo, bool writeOutput, std::vector<int>& status, std::vector<AsymptoticLimits::Result_t>& limits);
+std::map<int, unsigned int> writeOptimTable(TFile* inF, std::vector<BatchPoint_t>& points, std::vector<int>& status, std::vector<AsymptoticLimits::Result_t>& limits);
+
 //
 int main(int argc, char* argv[])
 {
@@ -540,6 +968,7 @@ int main(int argc, char* argv[])
     else if(arg.find("--index" )   !=string::npos && i+1<argc)   { char* pch = strtok(argv[i+1],",");while (pch!=NULL){int C;  sscanf(pch,"%i",&C); indexcutV .push_back(C);  pch = strtok(NULL,",");} i++; printf("index  = "); for(unsigned int i=0;i<indexcutV .size();i++)printf(" %i ", indexcutV [i]);printf("\n");}
     else if(arg.find("--indexL")    !=string::npos && i+1<argc)  { char* pch = strtok(argv[i+1],",");while (pch!=NULL){int C;  sscanf(pch,"%i",&C); indexcutVL.push_back(C);  pch = strtok(NULL,",");} i++; printf("indexL = "); for(unsigned int i=0;i<indexcutVL.size();i++)printf(" %i ", indexcutVL[i]);printf("\n");}
     else if(arg.find("--indexR")    !=string::npos && i+1<argc)  { char* pch = strtok(argv[i+1],",");while (pch!=NULL){int C;  sscanf(pch,"%i",&C); indexcutVR.push_back(C);  pch = strtok(NULL,",");} i++; printf("indexR = "); for(unsigned int i=0;i<indexcutVR.size();i++)printf(" %i ", indexcutVR[i]);printf("\n");}
+    else if(arg.find("--profile")  !=string::npos && i+1<argc)  { profile = argv[i+1]; i++; printf("profile = %s\n", profile.c_str()); }
     else if(arg.find("--in")       !=string::npos && i+1<argc)  { inFileUrl = argv[i+1];  i++;  printf("in = %s\n", inFileUrl.Data());  }
     else if(arg.find("--json")     !=string::npos && i+1<argc)  { jsonFile  = argv[i+1];  i++;  printf("json = %s\n", jsonFile.Data()); }
     else if(arg.find("--histoVBF") !=string::npos && i+1<argc)  { histoVBF  = argv[i+1];  i++;  printf("histoVBF = %s\n", histoVBF.Data()); }
@@ -547,6 +976,13 @@ int main(int argc, char* argv[])
     else if(arg.find("--mL")       !=string::npos && i+1<argc)  { sscanf(argv[i+1],"%i",&massL ); i++; printf("massL = %i\n", massL);}
     else if(arg.find("--mR")       !=string::npos && i+1<argc)  { sscanf(argv[i+1],"%i",&massR ); i++; printf("massR = %i\n", massR);}
     else if(arg.find("--m")        !=string::npos && i+1<argc)  { sscanf(argv[i+1],"%i",&mass ); i++; printf("mass = %i\n", mass);}
+    else if(arg.find("--asymptoticObs")!=string::npos) { asymptoticLimits=true; asymptoticObserved=true; printf("asymptotic limits = True (with observed)\n");}
+    else if(arg.find("--asymptotic")!=string::npos) { asymptoticLimits=true; printf("asymptotic limits = True\n");}
+    else if(arg.find("--batchWorkers")!=string::npos && i+1<argc) { sscanf(argv[i+1],"%i",&batchWorkers); i++; printf("batchWorkers = %i\n", batchWorkers);}
+    else if(arg.find("--batch")    !=string::npos && i+1<argc)  { batchFile = argv[i+1]; i++; printf("batch = %s\n", batchFile.c_str()); }
+    else if(arg.find("--nThreads") !=string::npos && i+1<argc)  { sscanf(argv[i+1],"%i",&nThreads); i++; printf("nThreads = %i\n", nThreads);}
+    else if(arg.find("--optimSignificance")!=string::npos) { optimSignificance=true; printf("optimSignificance = True\n");}
+    else if(arg.find("--optim")    !=string::npos && i+1<argc)  { optimFile = argv[i+1]; i++; printf("optim = %s\n", optimFile.c_str()); }
     else if(arg.find("--bins")     !=string::npos && i+1<argc)  { char* pch = strtok(argv[i+1],",");printf("bins are : ");while (pch!=NULL){printf(" %s ",pch); AnalysisBins.push_back(pch);  pch = strtok(NULL,",");}printf("\n"); i++; }
     else if(arg.find("--channels") !=string::npos && i+1<argc)  { char* pch = strtok(argv[i+1],",");printf("channels are : ");while (pch!=NULL){printf(" %s ",pch); Channels.push_back(pch);  pch = strtok(NULL,",");}printf("\n"); i++; }
     else if(arg.find("--postfix")   !=string::npos && i+1<argc)  { postfix = argv[i+1]; systpostfix = argv[i+1]; i++;  printf("postfix '%s' will be used\n", postfix.Data());  }
@@ -567,55 +1003,289 @@ int main(int argc, char* argv[])
   if(jsonFile.IsNull()) { printf("No Json file provided\nrun with '--help' for more details\n"); return -1; }
   if(inFileUrl.IsNull()){ printf("No Inputfile provided\nrun with '--help' for more details\n"); return -1; }
   if(histo.IsNull())    { printf("No Histogram provided\nrun with '--help' for more details\n"); return -1; }
-  if(mass==-1)          { printf("No massPoint provided\nrun with '--help' for more details\n"); return -1; }
-  if(indexcutV.size()<=0){printf("INDEX CUT SIZE IS NULL\n"); printHelp(); return -1; }
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+  if(nThreads>1)ROOT::EnableThreadSafety();
+#else
+  if(nThreads>1){ printf("Concurrent shape reading requires ROOT>=6.06, using a single thread\n"); nThreads=1; }
+#endif
+  if(optimFile!="" && batchFile==""){ printf("--optim requires --batch\nrun with '--help' for more details\n"); return -1; }
+  if(optimFile!="")asymptoticLimits = true;
+  std::vector<BatchPoint_t> batchPoints;
+  if(batchFile!=""){
+    if(!readBatchFile(batchFile, batchPoints))return -1;
+  }else{
+    if(mass==-1)          { printf("No massPoint provided\nrun with '--help' for more details\n"); return -1; }
+    if(indexcutV.size()<=0){printf("INDEX CUT SIZE IS NULL\n"); printHelp(); return -1; }
+  }
   if(AnalysisBins.size()==0)AnalysisBins.push_back("all");
   if(Channels.size()==0){Channels.push_back("ee");Channels.push_back("mumu");}
 
-  //make sure that the index vector are well filled
-  if(indexcutVL.size()==0) indexcutVL.push_back(indexcutV [0]);
-  if(indexcutVR.size()==0) indexcutVR.push_back(indexcutV [0]);
-  while(indexcutV .size()<AnalysisBins.size()){indexcutV .push_back(indexcutV [0]);}
-  while(indexcutVL.size()<AnalysisBins.size()){indexcutVL.push_back(indexcutVL[0]);}
-  while(indexcutVR.size()<AnalysisBins.size()){indexcutVR.push_back(indexcutVR[0]);}
-  if(indexvbf>=0){for(unsigned int i=0;i<AnalysisBins.size();i++){if(AnalysisBins[i].find("vbf")!=string::npos){indexcutV[i]=indexvbf; indexcutVL[i]=indexvbf; indexcutVR[i]=indexvbf;} }}
-
-
-
-  //handle merged bins
+  //handle merged bins, binOrigin keeps the position of each bin in the list given in argument (for the cut indices)
+  std::vector<string> requestedBins = AnalysisBins;
+  std::vector<int> binOrigin;
+  for(unsigned int b=0;b<AnalysisBins.size();b++)binOrigin.push_back(b);
   std::vector<std::vector<string> > binsToMerge;
   for(unsigned int b=0;b<AnalysisBins.size();b++){
     if(AnalysisBins[b].find('+')!=std::string::npos){
       std::vector<string> subBins;
       char* pch = strtok(&AnalysisBins[b][0],"+"); 
       while (pch!=NULL){
-        indexcutV.push_back(indexcutV[b]);
-        indexcutVL.push_back(indexcutVL[b]);
-        indexcutVR.push_back(indexcutVR[b]);
+        binOrigin.push_back(binOrigin[b]);
         AnalysisBins.push_back(pch);
         subBins.push_back(pch);
         pch = strtok(NULL,"+");
       }
       binsToMerge.push_back(subBins);
       AnalysisBins.erase(AnalysisBins.begin()+b);
-      indexcutV .erase(indexcutV .begin()+b);
-      indexcutVL.erase(indexcutVL.begin()+b);
-      indexcutVR.erase(indexcutVR.begin()+b);
+      binOrigin.erase(binOrigin.begin()+b);
       b--;
     }
   }
 
 
-  //fill the index map
-  for(unsigned int i=0;i<AnalysisBins.size();i++){indexcutM[AnalysisBins[i]] = indexcutV[i]; indexcutML[AnalysisBins[i]] = indexcutVL[i]; indexcutMR[AnalysisBins[i]] = indexcutVR[i];}
-
-
 	///////////////////////////////////////////////
 
 
+  if(profile!="")profUtils::enable(("computeLimit "+histo+(batchFile!="" ? TString(" batch=")+batchFile.c_str() : " m="+TString::Itoa(mass,10))).Data());
+
   //init the json wrapper
+  profUtils::mark(profUtils::stage("load shapes"));
   JSONWrapper::Object Root(jsonFile.Data(), true);
 
+  //open input file
+  TFile* inF = TFile::Open(inFileUrl);
+  if( !inF || inF->IsZombie() ){ printf("Invalid file name : %s\n", inFileUrl.Data()); return -1;}
+  gROOT->cd();  //THIS LINE IS NEEDED TO MAKE SURE THAT HISTOGRAM INTERNALLY PRODUCED IN LumiReWeighting ARE NOT DESTROYED WHEN CLOSING THE FILE
+
+  int status = 0;
+  if(batchFile==""){
+    status = runMassPoint(Root, inF, requestedBins, binOrigin, binsToMerge);
+  }else{
+    //the input file and the json are read once for all the points
+    cacheInput = true;
+    bool writeOutput = optimFile=="";
+    std::vector<int> pointStatus(batchPoints.size(), -1);
+    std::vector<AsymptoticLimits::Result_t> pointLimits(batchPoints.size());
+    std::vector<unsigned int> todo;
+    std::set<int> cachedMasses;
+    for(unsigned int p=0;p<batchPoints.size();p++){
+      pointLimits[p].valid = false;
+      //with workers, the first point of each mass is done here so that they all share the shapes it cached
+      if(batchWorkers>1 && cachedMasses.insert(batchPoints[p].mass).second){
+        pointStatus[p] = runBatchPoint(Root, inF, requestedBins, binOrigin, binsToMerge, batchPoints, p, writeOutput, &pointLimits[p]);
+      }else{
+        todo.push_back(p);
+      }
+    }
+    if(batchWorkers>1 && todo.size()>0){
+      runBatchWorkers(Root, inF, requestedBins, binOrigin, binsToMerge, batchPoints, todo, writeOutput, pointStatus, pointLimits);
+    }else{
+      for(unsigned int t=0;t<todo.size();t++){ pointStatus[todo[t]] = runBatchPoint(Root, inF, requestedBins, binOrigin, binsToMerge, batchPoints, todo[t], writeOutput, &pointLimits[todo[t]]); }
+    }
+    for(unsigned int p=0;p<batchPoints.size();p++){ if(pointStatus[p]!=0)status = -1; }
+
+    //only the best point of each mass gets its shapes file and datacards
+    if(optimFile!=""){
+      std::map<int, unsigned int> best = writeOptimTable(inF, batchPoints, pointStatus, pointLimits);
+      for(std::map<int, unsigned int>::iterator b=best.begin(); b!=best.end(); b++){
+        printf("Best point for m=%i is in %s, producing its shapes file and datacards\n", b->first, batchPoints[b->second].outDir.c_str());
+        if(runBatchPoint(Root, inF, requestedBins, binOrigin, binsToMerge, batchPoints, b->second, true, NULL)!=0)status = -1;
+      }
+    }
+  }
+
+  if(cacheInput)inF->Close();
+  if(profile!="")profUtils::writeSummary(profile);
+  return status;
+}
+
+
+//
+// Run one point of a batch in its directory
+//
+int runBatchPoint(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, std::vector<BatchPoint_t>& points, unsigned int p, bool writeOutput, AsymptoticLimits::Result_t* limits)
+{
+  BatchPoint_t& point = points[p];
+  mass = point.mass; massL = point.massL; massR = point.massR; indexvbf = point.indexvbf;
+  indexcutV = point.indexcutV; indexcutVL = point.indexcutVL; indexcutVR = point.indexcutVR;
+  printf("Batch point %i/%i: m=%i in %s\n", p+1, (int)points.size(), mass, point.outDir.c_str());
+
+  //without output (cut optimisation) nothing is written, the directory is only created for the points that are kept
+  if(!writeOutput)return runMassPoint(Root, inF, requestedBins, binOrigin, binsToMerge, writeOutput, limits);
+
+  TString cwd = gSystem->WorkingDirectory();
+  gSystem->mkdir(point.outDir.c_str(), true);
+  if(!gSystem->ChangeDirectory(point.outDir.c_str())){ printf("Can not enter directory %s, point skipped\n", point.outDir.c_str()); return -1; }
+  int status = runMassPoint(Root, inF, requestedBins, binOrigin, binsToMerge, writeOutput, limits);
+  gSystem->ChangeDirectory(cwd);
+  return status;
+}
+
+
+//
+// Run the points todo of a batch in --batchWorkers forked processes (ROOT and the options of the point are not thread
+// safe). The workers share the json and the input objects already cached, and open their own handle of the input file
+// for the others as the offset of the inherited one is shared. The status and limits of each point are sent back
+// through a pipe, one line per point (shorter than PIPE_BUF, so the lines of the workers are not mixed).
+//
+void runBatchWorkers(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, std::vector<BatchPoint_t>& points, const std::vector<unsigned int>& todo, bool writeOutput, std::vector<int>& status, std::vector<AsymptoticLimits::Result_t>& limits)
+{
+  int nWorkers = std::min(batchWorkers, (int)todo.size());
+  const int nShards = nWorkers;  //worker w does the points w, w+nShards, ...
+  std::vector<int> localShards;
+  int results[2];
+  if(pipe(results)!=0){
+    printf("Can not create the pipe for the batch workers, the points are run in this process\n");
+    for(int w=0;w<nWorkers;w++)localShards.push_back(w);
+    nWorkers = 0;
+  }
+  fflush(stdout);
+
+  std::vector<pid_t> workers;
+  for(int w=0;w<nWorkers;w++){
+    pid_t pid = fork();
+    if(pid==0){
+      close(results[0]);
+      int exitCode = 0;
+      TFile* workerF = TFile::Open(inFileUrl);
+      if(!workerF || workerF->IsZombie()){ printf("Batch worker %i can not open %s\n", w, inFileUrl.Data()); exitCode = 1; }
+      else{
+        gROOT->cd();
+        for(unsigned int t=w;t<todo.size();t+=nShards){
+          unsigned int p = todo[t];
+          AsymptoticLimits::Result_t result; result.valid = false;
+          int pointStatus = runBatchPoint(Root, workerF, requestedBins, binOrigin, binsToMerge, points, p, writeOutput, &result);
+          if(!result.valid){ result.observed = -1; result.significance = -1; for(int q=0;q<5;q++)result.expected[q] = -1; }
+          char line[512];
+          int n = snprintf(line, sizeof(line), "%u %i %i %.10g %.10g %.10g %.10g %.10g %.10g %.10g\n", p, pointStatus, result.valid?1:0, result.observed,
+                           result.expected[0], result.expected[1], result.expected[2], result.expected[3], result.expected[4], result.significance);
+          fflush(stdout);
+          if(write(results[1], line, n)!=n)exitCode = 1;
+        }
+        workerF->Close();
+      }
+      close(results[1]);
+      fflush(stdout);
+      _exit(exitCode);
+    }
+    if(pid<0){ printf("Can not fork batch worker %i, its points are run in this process\n", w); localShards.push_back(w); continue; }
+    workers.push_back(pid);
+  }
+
+  if(nWorkers>0){
+    close(results[1]);
+    string buffer;
+    char buf[4096];
+    ssize_t n;
+    while((n = read(results[0], buf, sizeof(buf)))!=0){
+      if(n<0){ if(errno==EINTR)continue; break; }
+      buffer.append(buf, n);
+      size_t eol;
+      while((eol = buffer.find('\n'))!=string::npos){
+        unsigned int p; int pointStatus, valid;
+        AsymptoticLimits::Result_t result;
+        if(sscanf(buffer.substr(0, eol).c_str(), "%u %i %i %lf %lf %lf %lf %lf %lf %lf", &p, &pointStatus, &valid, &result.observed,
+                  &result.expected[0], &result.expected[1], &result.expected[2], &result.expected[3], &result.expected[4], &result.significance)==10 && p<points.size()){
+          result.valid = valid!=0; result.nFits = 0;
+          status[p] = pointStatus; limits[p] = result;
+        }
+        buffer.erase(0, eol+1);
+      }
+    }
+    close(results[0]);
+
+    for(unsigned int w=0;w<workers.size();w++){
+      int workerStatus = 0;
+      waitpid(workers[w], &workerStatus, 0);
+      if(!WIFEXITED(workerStatus) || WEXITSTATUS(workerStatus)!=0)printf("Batch worker %i failed, some points may be missing\n", (int)w);
+    }
+    struct rusage usage; getrusage(RUSAGE_CHILDREN, &usage);
+    printf("Batch workers: peak memory %8.1f MB per worker\n", usage.ru_maxrss/1024.);
+    if(profile!="")profUtils::count("batch worker peak memory (MB)", usage.ru_maxrss/1024.);
+  }
+
+  for(unsigned int s=0;s<localShards.size();s++){
+    for(unsigned int t=localShards[s];t<todo.size();t+=nShards){
+      status[todo[t]] = runBatchPoint(Root, inF, requestedBins, binOrigin, binsToMerge, points, todo[t], writeOutput, &limits[todo[t]]);
+    }
+  }
+}
+
+
+//
+// Rank the points of an optimisation batch by mass with the expected limit (or significance) and write them in
+// optimFile with the same lines as the wrap-up of optimize.py; returns the best point of each mass
+//
+std::map<int, unsigned int> writeOptimTable(TFile* inF, std::vector<BatchPoint_t>& points, std::vector<int>& status, std::vector<AsymptoticLimits::Result_t>& limits)
+{
+  //cuts of each index, from the first directory of the input file having them
+  TH1* cutsH = NULL;
+  TList* keys = inF->GetListOfKeys();
+  for(int k=0; keys && k<keys->GetSize() && !cutsH; k++){
+    TDirectory* dir = dynamic_cast<TDirectory*>(inF->Get(keys->At(k)->GetName()));
+    if(dir)cutsH = dynamic_cast<TH1*>(dir->Get("all_optim_cut"));
+  }
+  if(!cutsH)printf("No all_optim_cut histogram found in %s, the cuts are not listed in %s\n", inFileUrl.Data(), optimFile.c_str());
+
+  std::map<int, std::vector<std::pair<double, unsigned int> > > ranking;
+  int nInvalid = 0;
+  for(unsigned int p=0;p<points.size();p++){
+    if(status[p]!=0 || !limits[p].valid){ nInvalid++; continue; }
+    double fom = optimSignificance ? limits[p].significance : limits[p].expected[2];
+    if(!(fom>0) || (optimSignificance && fom>1000)){ nInvalid++; continue; }  //a significance that high means something went wrong
+    ranking[points[p].mass].push_back(std::make_pair(optimSignificance ? -fom : fom, p));
+  }
+
+  std::map<int, unsigned int> best;
+  FILE* pFile = fopen(optimFile.c_str(), "w");
+  if(!pFile){ printf("Can not open %s\n", optimFile.c_str()); return best; }
+  for(std::map<int, std::vector<std::pair<double, unsigned int> > >::iterator M=ranking.begin(); M!=ranking.end(); M++){
+    std::sort(M->second.begin(), M->second.end());
+    best[M->first] = M->second[0].second;
+    fprintf(pFile, "------------------------------------------------------------------------------------\n");
+    for(unsigned int r=0;r<M->second.size();r++){
+      BatchPoint_t& point = points[M->second[r].second];
+      TString index = ""; for(unsigned int i=0;i<point.indexcutV.size();i++){ if(i)index += ","; index += point.indexcutV[i]; }
+      TString cuts = "";
+      for(int c=1; cutsH && c<=cutsH->GetYaxis()->GetNbins(); c++){ cuts += Form("%7g (%s)   ", cutsH->GetBinContent(point.indexcutV[0], c), cutsH->GetYaxis()->GetBinLabel(c)); }
+      fprintf(pFile, "mH=%i --> Limit/Significance=%010.6f  Index: %s  Cuts: %s   CutsOnShape: %5g %5g   Dir: %s\n", M->first, fabs(M->second[r].first), index.Data(), cuts.Data(), shapeMin, shapeMax, point.outDir.c_str());
+    }
+  }
+  fclose(pFile);
+  printf("%s is written: %i masses, points ordered by expected %s (%i points without valid result)\n", optimFile.c_str(), (int)ranking.size(), optimSignificance ? "significance" : "limit", nInvalid);
+  return best;
+}
+
+
+//
+// Produce the shapes file and the datacards of the current mass point and cut indices in the current directory (with writeOutput=false
+// nothing is written, only the asymptotic limits are computed, for the cut optimisation)
+//
+int runMassPoint(JSONWrapper::Object& Root, TFile* inF, std::vector<string>& requestedBins, std::vector<int>& binOrigin, std::vector<std::vector<string> >& binsToMerge, bool writeOutput, AsymptoticLimits::Result_t* limits)
+{
+  //make sure that the index vector are well filled
+  if(indexcutVL.size()==0) indexcutVL.push_back(indexcutV [0]);
+  if(indexcutVR.size()==0) indexcutVR.push_back(indexcutV [0]);
+  while(indexcutV .size()<requestedBins.size()){indexcutV .push_back(indexcutV [0]);}
+  while(indexcutVL.size()<requestedBins.size()){indexcutVL.push_back(indexcutVL[0]);}
+  while(indexcutVR.size()<requestedBins.size()){indexcutVR.push_back(indexcutVR[0]);}
+  if(indexvbf>=0){for(unsigned int i=0;i<requestedBins.size();i++){if(requestedBins[i].find("vbf")!=string::npos){indexcutV[i]=indexvbf; indexcutVL[i]=indexvbf; indexcutVR[i]=indexvbf;} }}
+
+  //fill the index map
+  indexcutM.clear(); indexcutML.clear(); indexcutMR.clear();
+  for(unsigned int i=0;i<AnalysisBins.size();i++){indexcutM[AnalysisBins[i]] = indexcutV[binOrigin[i]]; indexcutML[AnalysisBins[i]] = indexcutVL[binOrigin[i]]; indexcutMR[AnalysisBins[i]] = indexcutVR[binOrigin[i]];}
+
+  const int loadStage          = profUtils::stage("load shapes");
+  const int backgroundStage    = profUtils::stage("background estimation");
+  const int interpolationStage = profUtils::stage("signal interpolation");
+  const int processingStage    = profUtils::stage("shape processing");
+  const int yieldsStage        = profUtils::stage("yields");
+  const int plotsStage         = profUtils::stage("plots");
+  const int datacardsStage     = profUtils::stage("datacards");
+  const int limitsStage        = profUtils::stage("asymptotic limits");
+
+  profUtils::mark(loadStage);
+
 
   //init globalVariables
   TString massStr(""); if(mass>0)massStr += mass;
@@ -632,13 +1302,6 @@ int main(int argc, char* argv[])
   AllInfo_t allInfo;
 
 
-
-  //open input file
-  TFile* inF = TFile::Open(inFileUrl);
-  if( !inF || inF->IsZombie() ){ printf("Invalid file name : %s\n", inFileUrl.Data());}
-  gROOT->cd();  //THIS LINE IS NEEDED TO MAKE SURE THAT HISTOGRAM INTERNALLY PRODUCED IN LumiReWeighting ARE NOT DESTROYED WHEN CLOSING THE FILE
-
-
   //LOAD shapes
   const size_t nsh=sh.size();
   for(size_t b=0; b<AnalysisBins.size(); b++){
@@ -654,8 +1317,9 @@ int main(int argc, char* argv[])
   }
 
 
-  inF->Close();
+  if(!cacheInput)inF->Close();  //kept open for the next points of a batch
   printf("Loading all shapes... Done\n");
+  profUtils::sampleMemory("load shapes");
 
 
   allInfo.computeTotalBackground();
@@ -666,9 +1330,10 @@ int main(int argc, char* argv[])
 
   //define vector for search
   std::vector<TString>& selCh = Channels;
+  profUtils::mark(backgroundStage);
   //remove the non-resonant background from data
   if(subNRB){
-  	pFile = fopen("NonResonnant.tex","w");
+  	pFile = fopen(writeOutput ? "NonResonnant.tex" : "/dev/null","w");
   	allInfo.doBackgroundSubtraction(pFile, selCh,"emu",histo,histo+"_NRBctrl");
   	fclose(pFile);
   }
@@ -679,7 +1344,7 @@ int main(int argc, char* argv[])
 
   //replace Z+Jet background by Gamma+Jet estimates
   if(subDY){//Hugo: This is something completely outdated... the way to choose for datadriven DY or mc-based, is just by giving the good key
-  	pFile = fopen("GammaJets.tex","w");
+  	pFile = fopen(writeOutput ? "GammaJets.tex" : "/dev/null","w");
   	allInfo.doDYReplacement(pFile, selCh,"gamma",histo);
   	fclose(pFile);
   }
@@ -687,7 +1352,7 @@ int main(int argc, char* argv[])
 
   //replace Z+Jet background by Gamma+Jet estimates
   if(subFake){
-  	pFile = fopen("FakeRateEstimate.tex","w");
+  	pFile = fopen(writeOutput ? "FakeRateEstimate.tex" : "/dev/null","w");
   	allInfo.doFakeLeptonEstimation(pFile, selCh,"gamma",histo, !shape);
   	fclose(pFile);
   }
@@ -696,7 +1361,9 @@ int main(int argc, char* argv[])
   if(blindData)allInfo.blind();
 
   //interpollate signal sample if desired mass point is not available
+  profUtils::mark(interpolationStage);
   allInfo.SignalInterpolation(histo.Data());
+  profUtils::mark(processingStage);
 
   if(scaleVBF)  allInfo.scaleVBF(histo.Data());
 
@@ -730,34 +1397,58 @@ int main(int argc, char* argv[])
   if(blindData)allInfo.blind();
 
   //print event yields from the mt shapes
-  pFile = fopen("Yields.tex","w");  FILE* pFileInc = fopen("YieldsInc.tex","w");
-  allInfo.getYieldsFromShape(pFile, selCh, histo.Data(), pFileInc);
-  fclose(pFile); fclose(pFileInc);
-
-  //print signal efficiency
-  pFile = fopen("Efficiency.tex","w");
-  allInfo.getEffFromShape(pFile, selCh, histo.Data());
-  fclose(pFile);
+  profUtils::mark(yieldsStage);
+  if(writeOutput){
+    pFile = fopen("Yields.tex","w");  FILE* pFileInc = fopen("YieldsInc.tex","w");
+    allInfo.getYieldsFromShape(pFile, selCh, histo.Data(), pFileInc);
+    fclose(pFile); fclose(pFileInc);
+
+    //print signal efficiency
+    pFile = fopen("Efficiency.tex","w");
+    allInfo.getEffFromShape(pFile, selCh, histo.Data());
+    fclose(pFile);
+  }else{
+    allInfo.sortProc(); //done by getYieldsFromShape otherwise
+  }
 
   //add by hand the hard coded uncertainties
   allInfo.addHardCodedUncertainties(histo.Data());
 
-  //produce a plot
-  allInfo.showShape(selCh,histo,"plot"); //this produce the final global shape
+  if(writeOutput){
+    //produce a plot
+    profUtils::mark(plotsStage);
+    allInfo.showShape(selCh,histo,"plot"); //this produce the final global shape
 
-  //produce a plot
-  allInfo.showUncertainty(selCh,histo,"plot"); //this produces all the plots with the syst
+    //produce a plot
+    allInfo.showUncertainty(selCh,histo,"plot"); //this produces all the plots with the syst
 
-  //prepare the output
-  string limitFile=("haa4b_"+massStr+systpostfix+".root").Data();
-  TFile *fout=TFile::Open(limitFile.c_str(),"recreate");
+    //prepare the output
+    profUtils::mark(datacardsStage);
+    string limitFile=("haa4b_"+massStr+systpostfix+".root").Data();
+    TFile *fout=TFile::Open(limitFile.c_str(),"recreate");
 
-  allInfo.saveHistoForLimit(histo.Data(), fout);
+    allInfo.saveHistoForLimit(histo.Data(), fout);
 
-  allInfo.buildDataCards(histo.Data(), limitFile);
+    allInfo.buildDataCards(histo.Data(), limitFile);
+
+    //all done
+    fout->Close();
+  }else{
+    //only the normalization effects of the variations used by the datacards
+    profUtils::mark(datacardsStage);
+    allInfo.saveHistoForLimit(histo.Data(), NULL);
+  }
 
-  //all done
-  fout->Close();
+  //fast limits from the shapes in memory, the datacards are kept for combine
+  if(asymptoticLimits){
+    profUtils::mark(limitsStage);
+    AsymptoticLimits::Result_t result = allInfo.computeAsymptoticLimits(histo.Data(), asymptoticObserved, writeOutput);
+    if(limits)*limits = result;
+  }
+
+  //the next points of a batch start from a fresh structure
+  if(cacheInput)allInfo.deleteShapes();
+  return 0;
 }
 
 //
@@ -783,6 +1474,26 @@ void AllInfo_t::sortProc(){
   sorted_procs.insert(sorted_procs.end(), sign_procs.begin(), sign_procs.end());
 }
 
+//
+// Delete all the histograms owned by the shapes (some may be shared, each one is deleted once)
+//
+void AllInfo_t::deleteShapes(){
+  std::set<TH1*> histos;
+  for(std::map<string, ProcessInfo_t>::iterator it=procs.begin(); it!=procs.end();it++){
+    for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){
+      for(std::map<string, ShapeData_t>::iterator sh = ch->second.shapes.begin(); sh!=ch->second.shapes.end(); sh++){
+        for(std::map<string, TH1*>::iterator unc = sh->second.uncShape.begin(); unc!=sh->second.uncShape.end(); unc++){ if(unc->second)histos.insert(unc->second); }
+        sh->second.uncShape.clear();
+        sh->second.uncStatBin.clear();
+        sh->second.invalidateDense();
+      }
+    }
+  }
+  for(std::set<TH1*>::iterator h=histos.begin(); h!=histos.end(); h++)delete *h;
+  procs.clear();
+  sorted_procs.clear();
+}
+
 //
 // Sum up all shapes from one src channel to a total shapes in the dest channel
 //
@@ -790,26 +1501,30 @@ void AllInfo_t::addChannel(ChannelInfo_t& dest, ChannelInfo_t& src, bool compute
   std::map<string, ShapeData_t>& shapesInfoDest = dest.shapes;
   std::map<string, ShapeData_t>& shapesInfoSrc  = src.shapes;
 
+  //the sums are only recorded here, they are computed when the shapes of dest are read (see ShapeMap_t)
 	if(!computeSyst){
 	for(std::map<string, ShapeData_t>::iterator sh = shapesInfoSrc.begin(); sh!=shapesInfoSrc.end(); sh++){
     if(shapesInfoDest.find(sh->first)==shapesInfoDest.end())shapesInfoDest[sh->first] = ShapeData_t();
+    ShapeData_t& shapeDest = shapesInfoDest[sh->first];
+    shapeDest.invalidateDense();
 
     //Loop on all shape systematics (including also the central value shape)
-    for(std::map<string, TH1*>::iterator uncS = sh->second.uncShape.begin();uncS!= sh->second.uncShape.end();uncS++){
+    const std::map<string, TH1*>& shapesSrc = sh->second.uncShape.read();
+    for(std::map<string, TH1*>::const_iterator uncS = shapesSrc.begin();uncS!= shapesSrc.end();uncS++){
       if(uncS->first!="") continue; //We only take nominal shapes
-      if(shapesInfoDest[sh->first].uncShape.find(uncS->first)==shapesInfoDest[sh->first].uncShape.end()){
-        shapesInfoDest[sh->first].uncShape[uncS->first] = (TH1*) uncS->second->Clone(TString(uncS->second->GetName() + dest.channel + dest.bin ) );
+      if(!shapeDest.uncShape.contains(uncS->first)){
+        shapeDest.uncShape.setLazy(uncS->first, sh->second.uncShape, uncS->second, dest.channel + dest.bin);
       }else{
-        shapesInfoDest[sh->first].uncShape[uncS->first]->Add(uncS->second);
+        shapeDest.uncShape.addLazy(uncS->first, sh->second.uncShape, uncS->second, 1.0);
       }
     }
 
     //take care of the scale uncertainty 
     for(std::map<string, double>::iterator unc = sh->second.uncScale.begin();unc!= sh->second.uncScale.end();unc++){
-      if(shapesInfoDest[sh->first].uncScale.find(unc->first)==shapesInfoDest[sh->first].uncScale.end()){
-        shapesInfoDest[sh->first].uncScale[unc->first] = unc->second;
+      if(shapeDest.uncScale.find(unc->first)==shapeDest.uncScale.end()){
+        shapeDest.uncScale[unc->first] = unc->second;
       }else{
-        shapesInfoDest[sh->first].uncScale[unc->first] = sqrt( pow(shapesInfoDest[sh->first].uncScale[unc->first],2) + pow(unc->second,2) );
+        shapeDest.uncScale[unc->first] = sqrt( pow(shapeDest.uncScale[unc->first],2) + pow(unc->second,2) );
       }
     }
   }  
@@ -820,16 +1535,20 @@ void AllInfo_t::addChannel(ChannelInfo_t& dest, ChannelInfo_t& src, bool compute
 
  for(std::map<string, ShapeData_t>::iterator sh = shapesInfoSrc.begin(); sh!=shapesInfoSrc.end(); sh++){
     if(shapesInfoDest.find(sh->first)==shapesInfoDest.end())shapesInfoDest[sh->first] = ShapeData_t();
+    ShapeData_t& shapeDest = shapesInfoDest[sh->first];
+    const std::map<string, TH1*>& shapesSrc = sh->second.uncShape.read();
+    std::map<string, TH1*>::const_iterator nominalSrc = shapesSrc.find("");
+    if(nominalSrc==shapesSrc.end()) continue;
+    shapeDest.invalidateDense();
  		//Loop on all shape systematics (including also the central value shape)
-    for(std::map<string, TH1*>::iterator uncS = sh->second.uncShape.begin();uncS!= sh->second.uncShape.end();uncS++){
+    for(std::map<string, TH1*>::const_iterator uncS = shapesSrc.begin();uncS!= shapesSrc.end();uncS++){
       if(uncS->first=="") continue; //We only take systematic (i.e non-nominal) shapes
-      if(shapesInfoSrc[sh->first].uncShape.find("")==shapesInfoSrc[sh->first].uncShape.end()) continue;
       //1. Copy the nominal shape
-      shapesInfoDest[sh->first].uncShape[uncS->first] = (TH1*) shapesInfoDest[sh->first].uncShape[""]->Clone(TString(uncS->second->GetName() + dest.channel + dest.bin ) );
+      shapeDest.uncShape.setLazyFromEntry(uncS->first, "", uncS->second, dest.channel + dest.bin);
       //2. we remove the nominal value of the process we are running on
-      shapesInfoDest[sh->first].uncShape[uncS->first]->Add(shapesInfoSrc[sh->first].uncShape[""], -1);
+      shapeDest.uncShape.addLazy(uncS->first, sh->second.uncShape, nominalSrc->second, -1);
       //3. and add the variation up/down
-			shapesInfoDest[sh->first].uncShape[uncS->first]->Add(uncS->second); 
+			shapeDest.uncShape.addLazy(uncS->first, sh->second.uncShape, uncS->second, 1); 
 		}
   }
 
@@ -998,11 +1717,6 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
   std::map<string, bool> MapChannelBin;
   std::map<string, std::map<string, string> > MapProcChYieldsBin;         
 
-  std::map<string, string> rows;
-  std::map<string, string> rowsBin;
-  string rows_header = "\\begin{tabular}{|c|";
-  string rows_title  = "channel";
-
   //order the proc first
   sortProc();
 
@@ -1010,8 +1724,6 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
     string procName = sorted_procs[p];
     std::map<string, ProcessInfo_t>::iterator it=procs.find(procName);
     if(it==procs.end())continue;
-    rows_header += "c|";
-    rows_title  += "& " + it->second.shortName;
     std::map<string, double> bin_valerr;
     std::map<string, double> bin_val;
     std::map<string, double> bin_systUp;
@@ -1021,13 +1733,14 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
     for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){
       if(std::find(selCh.begin(), selCh.end(), ch->second.channel)==selCh.end())continue;
       if(ch->second.shapes.find(histoName)==(ch->second.shapes).end())continue;
-      TH1* h = ch->second.shapes[histoName].histo();
-      double valerr;
-      double val  = h->IntegralAndError(1,h->GetXaxis()->GetNbins(),valerr);
+      ShapeData_t& shapeInfo = ch->second.shapes[histoName];
+      const YieldSummary_t& yields = shapeInfo.summary();
+      double valerr = yields.yieldError;
+      double val  = yields.yield;
       if(procName.find("Instr. MET")!=std::string::npos) valerr =0.0; //Our systematics on the Instr. MET already includes stat unc. We would want to change that in the future
-      double syst_scale = std::max(0.0, ch->second.shapes[histoName].getScaleUncertainty());
-      double syst_shapeUp = std::max(0.0, ch->second.shapes[histoName].getIntegratedShapeUncertainty((it->first+ch->first).c_str(), "Up"));
-      double syst_shapeDown = std::max(0.0, ch->second.shapes[histoName].getIntegratedShapeUncertainty((it->first+ch->first).c_str(), "Down"));
+      double syst_scale = std::max(0.0, shapeInfo.getScaleUncertainty());
+      double syst_shapeUp = std::max(0.0, yields.shapeUncUp);
+      double syst_shapeDown = std::max(0.0, yields.shapeUncDown);
       double systUp = sqrt(pow(syst_scale,2)+pow(syst_shapeUp,2));
       double systDown = sqrt(pow(syst_scale,2)+pow(syst_shapeDown,2));
       systUp= (systUp >0)?systUp: -1; //Set to -1 if no syst, to be coherent with other convention in this file
@@ -1037,16 +1750,14 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
       else if(val<1E-6){val=0.0; valerr=0.0; systUp=-1;systDown=-1;}
       if(it->first=="data"){valerr=-1.0; systUp=-1;systDown=-1;}
       string YieldText = "";
+      string LatexYield = utils::toLatexRounded(val,valerr, systUp, true, systDown);
 
       if(it->first=="data" || it->first=="total")YieldText += "\\boldmath ";
       if(it->first=="data"){char tmp[256];sprintf(tmp, "$%.0f$", val); YieldText += tmp;
-      }else{                YieldText += utils::toLatexRounded(val,valerr, systUp, true, systDown);     }
-
+      }else{                YieldText += LatexYield;     }
 
-      printf("%f %f %f %f --> %s\n", val, valerr, systUp, systDown, utils::toLatexRounded(val,valerr, systUp, true, systDown).c_str());
 
-      if(rows.find(ch->first)==rows.end())rows[ch->first] = string("$ ")+ch->first+" $";
-      rows[ch->first] += string("&") + YieldText;
+      printf("%f %f %f %f --> %s\n", val, valerr, systUp, systDown, LatexYield.c_str());
 
       TString LabelText = TString("$") + ch->second.channel+ " " +ch->second.bin + TString("$");
       LabelText.ReplaceAll("eq"," ="); LabelText.ReplaceAll("g =","\\geq"); LabelText.ReplaceAll("l =","\\leq"); 
@@ -1082,9 +1793,6 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
 				//                 if(it->first=="data"){char tmp[256];sprintf(tmp, "-"); rowsBin[bin->first] += tmp;  //blinded
       }else{                YieldText += utils::toLatexRounded(bin_val[bin->first],sqrt(bin_valerr[bin->first]), bin_systUp[bin->first]<0?-1:sqrt(bin_systUp[bin->first]), true, bin_systDown[bin->first]<0?-1:sqrt(bin_systDown[bin->first]));   }
 
-      if(rowsBin.find(bin->first)==rowsBin.end())rowsBin[bin->first] = string("$ ")+bin->first+" $";
-      rowsBin[bin->first] += string("&") + YieldText;
-
       MapChannelBin[bin->first] = true;
       MapProcChYieldsBin[it->first][bin->first] = YieldText;                
 
@@ -1177,9 +1885,9 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
       for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){
         if(std::find(selCh.begin(), selCh.end(), ch->second.channel)==selCh.end())continue;
         if(ch->second.shapes.find(histoName)==(ch->second.shapes).end())continue;
-        TH1* h = ch->second.shapes[histoName].histo();
-        double valerr;
-        double val  = h->IntegralAndError(1,h->GetXaxis()->GetNbins(),valerr);
+        const YieldSummary_t& yields = ch->second.shapes[histoName].summary();
+        double valerr = yields.yieldError;
+        double val  = yields.yield;
         fprintf(pFile,"%30s %30s %4.0f %6.2E %6.2E %6.2E %6.2E\n",ch->first.c_str(), it->first.c_str(), it->second.mass, it->second.xsec, it->second.br, val/(it->second.xsec*it->second.br), valerr/(it->second.xsec*it->second.br));
       }
     }
@@ -1286,12 +1994,15 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
           errors->SetLineStyle(1);
           errors->SetLineColor(1);
           int icutg=0;
+          const YieldSummary_t& yields = ch->second.shapes[histoName.Data()].summary();
+          const std::vector<double>& shapeUncUp   = yields.binUncUp;
+          const std::vector<double>& shapeUncDown = yields.binUncDown;
           for(int ibin=1; ibin<=h->GetXaxis()->GetNbins(); ibin++){
             if(h->GetBinContent(ibin)>0)
               errors->SetPoint(icutg,h->GetXaxis()->GetBinCenter(ibin), h->GetBinContent(ibin));
             //This is the part where we define which errors will be shown on the shape plot
-            double syst_shape_binUp = std::max(0.0, ch->second.shapes[histoName.Data()].getBinShapeUncertainty((it->first+ch->first).c_str(), ibin, "Up"));
-            double syst_shape_binDown = std::max(0.0, ch->second.shapes[histoName.Data()].getBinShapeUncertainty((it->first+ch->first).c_str(), ibin, "Down"));
+            double syst_shape_binUp = std::max(0.0, shapeUncUp[ibin]);
+            double syst_shape_binDown = std::max(0.0, shapeUncDown[ibin]);
 		        double syst_binUp = sqrt(pow(Uncertainty_scale*h->GetBinContent(ibin), 2) + pow(syst_shape_binUp,2));
 		        double syst_binDown = sqrt(pow(Uncertainty_scale*h->GetBinContent(ibin), 2) + pow(syst_shape_binDown,2));
 		        double Uncertainty_binUp = syst_binUp / h->GetBinContent(ibin);
@@ -1584,8 +2295,8 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
 
         //draw scale uncertainties
         for(std::map<string, double>::iterator var = ch->second.shapes[histoName.Data()].uncScale.begin(); var!=ch->second.shapes[histoName.Data()].uncScale.end(); var++){
-          if(h->Integral()<=0)continue;
-          double ScaleChange   = var->second/h->Integral();
+          if(yield<=0)continue;
+          double ScaleChange   = var->second/yield;
           double ScaleUp   = 1 + ScaleChange;
           double ScaleDn   = 1 - ScaleChange;
 
@@ -1622,8 +2333,8 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
           }
 
           if(mapYieldInc.find(systName.Data())==mapYieldInc.end()){ mapYieldInc[systName.Data()].first = 0; mapYieldInc[systName.Data()].second = 0;  }
-          mapYieldInc[systName.Data()].first += ScaleChange*h->Integral();
-          mapYieldInc[systName.Data()].second += h->Integral();
+          mapYieldInc[systName.Data()].first += ScaleChange*yield;
+          mapYieldInc[systName.Data()].second += yield;
 
           lineUp->SetLineWidth(2);  lineUp->SetLineColor(color); lineUp->Draw("same");
           lineDn->SetLineWidth(2);  lineDn->SetLineColor(color); lineDn->Draw("same");
@@ -1631,15 +2342,23 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
 
         //draw shape uncertainties
         //double syst_shape = std::max(0.0, ch->second.shapes[histoName.Data()].getShapeUncertainty((it->first+ch->first).c_str()));
-        for(std::map<string, TH1*>::iterator var = ch->second.shapes[histoName.Data()].uncShape.begin(); var!=ch->second.shapes[histoName.Data()].uncShape.end(); var++){
+        ShapeData_t& shapeInfo = ch->second.shapes[histoName.Data()];
+        std::vector<std::pair<string, TH1*> > variations;
+        for(std::map<string, TH1*>::iterator var = shapeInfo.uncShape.begin(); var!=shapeInfo.uncShape.end(); var++){
           if(var->first=="")continue;
-
-          TH1* hvar = (TH1*)(var->second->Clone((it->first+ch->first+var->first).c_str())); 
+          variations.push_back(std::make_pair(var->first, (TH1*)(var->second->Clone((it->first+ch->first+var->first).c_str()))));
+        }
+        for(std::map<string, StatBin_t>::iterator stat = shapeInfo.uncStatBin.begin(); stat!=shapeInfo.uncStatBin.end(); stat++){
+          variations.push_back(std::make_pair(stat->first+"Up"  , shapeInfo.makeStatBinHisto(stat->second, true , (it->first+ch->first+stat->first+"Up"  ).c_str())));
+          variations.push_back(std::make_pair(stat->first+"Down", shapeInfo.makeStatBinHisto(stat->second, false, (it->first+ch->first+stat->first+"Down").c_str())));
+        }
+        for(unsigned int v=0; v<variations.size(); v++){
+          TH1* hvar = variations[v].second;
           double varYield = hvar->Integral();
           hvar->Divide(h);
           toDelete.push_back(hvar);
 
-          TString systName = var->first.c_str();
+          TString systName = variations[v].first.c_str();
           systName.ToLower();
           systName.ReplaceAll("cms","");
           systName.ReplaceAll("haa4b","");
@@ -1750,6 +2469,7 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
         TString chbin = ch->first;
         if(ch->second.shapes.find(histoName)==(ch->second.shapes).end())continue;
         ShapeData_t& shapeInfo = ch->second.shapes[histoName];      
+        shapeInfo.expandStatUnc();
         TH1* h = shapeInfo.histo();
 
         TString proc = it->second.shortName.c_str();
@@ -1766,25 +2486,72 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
           hshape->SetBinContent(1,bin);            hshape->SetBinError  (1,bine);
           hshape->SetBinContent(2,0);              hshape->SetBinError  (2,0);
         }
+        shapeInfo.invalidateDense();
+      }
+    }
+  }
+
+  //
+  // name of a systematic in the datacards from the name of one of its variations
+  //
+  TString datacardSystName(TString syst){
+    TString systName(syst); 
+    systName.ReplaceAll("Up",""); systName.ReplaceAll("Down","");//  systName.ReplaceAll("_","");
+    if(systName.First("_")==0)systName.Remove(0,1);
+    return systName;
+  }
+
+  //
+  // Record the normalization effect of a variation (difference between the variated and the nominal yields)
+  //
+  void addScaleFromVariation(ShapeData_t& shapeInfo, TString syst, double diff){
+    TString systName = datacardSystName(syst);
+
+    if(diff==0)return;
+    if(shape){
+      shapeInfo.uncScale[systName.Data()]=-1.0;
+    }else{
+      double Unc = fabs(diff);
+      if(shapeInfo.uncScale.find(systName.Data())==shapeInfo.uncScale.end()){
+        shapeInfo.uncScale[systName.Data()]=Unc;
+      }else{
+        shapeInfo.uncScale[systName.Data()]=(shapeInfo.uncScale[systName.Data()] + Unc)/2.0;
       }
     }
   }
 
   //
   // Make a summary plot
+  // The keys are written channel by channel (one directory per datacard, the processes in a row) and the variations
+  // that the datacards can not use are not written: those of the systematics without entry for the process (equal to
+  // the nominal yield, or empty and replaced by the nominal shape), which are written as '-' in the datacards.
+  // With fout=NULL nothing is written, only the normalization effects used by the datacards are computed
   //
   void AllInfo_t::saveHistoForLimit(string histoName, TFile* fout){
     //order the proc first
     sortProc();
 
-    //Loop on processes and channels
+    std::set<string> channels;
     for(unsigned int p=0;p<sorted_procs.size();p++){
-      string procName = sorted_procs[p];
-      std::map<string, ProcessInfo_t>::iterator it=procs.find(procName);
+      std::map<string, ProcessInfo_t>::iterator it=procs.find(sorted_procs[p]);
       if(it==procs.end())continue;
-      for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){
-        TString chbin = ch->first;
-        if(!fout->GetDirectory(chbin)){fout->mkdir(chbin);}fout->cd(chbin);
+      for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){ channels.insert(ch->first); }
+    }
+
+    int nWritten=0, nSkipped=0;
+    double bytesWritten=0, bytesSaved=0;
+
+    //Loop on channels and processes
+    for(std::set<string>::iterator C=channels.begin(); C!=channels.end(); C++){
+      TString chbin = C->c_str();
+      if(fout && !fout->GetDirectory(chbin)){fout->mkdir(chbin);}
+
+      for(unsigned int p=0;p<sorted_procs.size();p++){
+        string procName = sorted_procs[p];
+        std::map<string, ProcessInfo_t>::iterator it=procs.find(procName);
+        if(it==procs.end())continue;
+        std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.find(*C);
+        if(ch==it->second.channels.end())continue;
 
         if(ch->second.shapes.find(histoName)==(ch->second.shapes).end())continue;
         ShapeData_t& shapeInfo = ch->second.shapes[histoName];      
@@ -1796,33 +2563,61 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
         if((it->second.shortName).find("ggH")!=std::string::npos)shapeInfo.makeStatUnc("_CMS_haa4b_", (TString("_")+ch->first+TString("_ggH")).Data(),systpostfix.Data(), false );// attention
 	else if((it->second.shortName).find("qqH")!=std::string::npos)shapeInfo.makeStatUnc("_CMS_haa4b_", (TString("_")+ch->first+TString("_qqH")).Data(),systpostfix.Data(), false );
         else shapeInfo.makeStatUnc("_CMS_haa4b_", (TString("_")+ch->first+"_"+it->second.shortName).Data(),systpostfix.Data(), false );
-				fout->cd(chbin);
+				if(fout)fout->cd(chbin);
 
+        //first the normalization effects of the variations, which decide which ones are used by the datacards
         TString proc = it->second.shortName.c_str();
         for(std::map<string, TH1*  >::iterator unc=shapeInfo.uncShape.begin();unc!=shapeInfo.uncShape.end();unc++){
           TString syst   = unc->first.c_str();
           TH1*    hshape = unc->second;
           hshape->SetDirectory(0);
 
+          if(runSystematics && syst!="" && proc!="data" && (syst.Contains("Up") || syst.Contains("Down"))){
+            //if empty histogram --> no variation is applied except for stat
+            if(!syst.Contains("stat") && (hshape->Integral()<h->Integral()*0.01 || isnan((float)hshape->Integral()))){hshape->Reset(); hshape->Add(h,1); shapeInfo.invalidateDense(); }
+          }
+
+          if(runSystematics && syst!=""){
+            addScaleFromVariation(shapeInfo, syst, hshape->Integral() - h->Integral());
+          }else if(syst==""){
+            shapeInfo.uncScale[syst.Data()]=hshape->Integral();
+          }
+        }
+        for(std::map<string, StatBin_t>::iterator stat=shapeInfo.uncStatBin.begin();stat!=shapeInfo.uncStatBin.end() && runSystematics;stat++){
+          TString syst = stat->first.c_str();
+          addScaleFromVariation(shapeInfo, syst+"Down", stat->second.down - h->GetBinContent(stat->second.bin));
+          addScaleFromVariation(shapeInfo, syst+"Up"  , stat->second.up   - h->GetBinContent(stat->second.bin));
+        }
+
+        //then the histograms
+        if(!fout)continue;
+        double nominalBytes = 0;
+        for(std::map<string, TH1*  >::iterator unc=shapeInfo.uncShape.begin();unc!=shapeInfo.uncShape.end();unc++){
+          TString syst   = unc->first.c_str();
+          TH1*    hshape = unc->second;
+          bool used = syst=="" || shapeInfo.uncScale.find(datacardSystName(syst).Data())!=shapeInfo.uncScale.end();
+
           if(syst==""){
             //central shape (for data call it data_obs)
             hshape->SetName(proc); 
             if(it->first=="data"){
-              hshape->Write("data_obs");
+              nominalBytes = hshape->Write("data_obs");
             }else{
-              hshape->Write(proc+postfix);
+              nominalBytes = hshape->Write(proc+postfix);
             }
+            bytesWritten += nominalBytes; nWritten++;
+          }else if(runSystematics && !used){
+            //not in the datacards
+            int nTemplates = (proc!="data" && (syst.Contains("Up") || syst.Contains("Down"))) ? 1 : 2;
+            nSkipped += nTemplates; bytesSaved += nTemplates*nominalBytes;
           }else if(runSystematics && proc!="data" && (syst.Contains("Up") || syst.Contains("Down"))){
-            //if empty histogram --> no variation is applied except for stat
-            if(!syst.Contains("stat") && (hshape->Integral()<h->Integral()*0.01 || isnan((float)hshape->Integral()))){hshape->Reset(); hshape->Add(h,1); }
-
             //write variation to file
             hshape->SetName(proc+syst);
-            hshape->Write(proc+postfix+syst);
+            bytesWritten += hshape->Write(proc+postfix+syst); nWritten++;
           }else if(runSystematics){
             //for one sided systematics the down variation mirrors the difference bin by bin
             hshape->SetName(proc+syst);
-            hshape->Write(proc+postfix+syst+"Up");
+            bytesWritten += hshape->Write(proc+postfix+syst+"Up");
             TH1 *hmirrorshape=(TH1 *)hshape->Clone(proc+syst+"Down");
             for(int ibin=1; ibin<=hmirrorshape->GetXaxis()->GetNbins(); ibin++){
               double bin = 2*h->GetBinContent(ibin)-hmirrorshape->GetBinContent(ibin);
@@ -1830,36 +2625,28 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
               hmirrorshape->SetBinContent(ibin,bin);
             }
             if(hmirrorshape->Integral()<=0)hmirrorshape->SetBinContent(1, 1E-10);
-            hmirrorshape->Write(proc+postfix+syst+"Down");
+            bytesWritten += hmirrorshape->Write(proc+postfix+syst+"Down"); nWritten+=2;
+            delete hmirrorshape;
           }
+        }
 
-          if(runSystematics && syst!=""){
-            TString systName(syst); 
-            systName.ReplaceAll("Up",""); systName.ReplaceAll("Down","");//  systName.ReplaceAll("_","");
-            if(systName.First("_")==0)systName.Remove(0,1);
-
-            TH1 *temp=(TH1*) hshape->Clone();
-            temp->Add(h,-1);
-            if(temp->Integral()!=0){
-              if(shape){
-                shapeInfo.uncScale[systName.Data()]=-1.0;
-              }else{
-                double Unc = fabs(temp->Integral());
-                if(shapeInfo.uncScale.find(systName.Data())==shapeInfo.uncScale.end()){
-                  shapeInfo.uncScale[systName.Data()]=Unc;
-                }else{
-                  shapeInfo.uncScale[systName.Data()]=(shapeInfo.uncScale[systName.Data()] + Unc)/2.0;
-                }
-              }
-            }
-            delete temp;
-          }else if(syst==""){
-            shapeInfo.uncScale[syst.Data()]=hshape->Integral();
-          }
+        //bin-by-bin stat uncertainties: the histograms only exist for the time of the writing
+        for(std::map<string, StatBin_t>::iterator stat=shapeInfo.uncStatBin.begin();stat!=shapeInfo.uncStatBin.end() && runSystematics;stat++){
+          TString syst = stat->first.c_str();
+          if(proc=="data")continue;
+          if(shapeInfo.uncScale.find(datacardSystName(syst).Data())==shapeInfo.uncScale.end()){ nSkipped += 2; bytesSaved += 2*nominalBytes; continue; }
+          TH1* hstat = shapeInfo.makeStatBinHisto(stat->second, true, proc+syst+"Up");
+          bytesWritten += hstat->Write(proc+postfix+syst+"Up");
+          delete hstat;
+          hstat = shapeInfo.makeStatBinHisto(stat->second, false, proc+syst+"Down");
+          bytesWritten += hstat->Write(proc+postfix+syst+"Down");
+          delete hstat;
+          nWritten += 2;
         }
       }
-      fout->cd("..");
+      if(fout)fout->cd();
     }
+    if(fout)printf("Shapes file: %i histograms written (%.1f kB), %i variations not used by the datacards skipped (about %.1f kB saved)\n", nWritten, bytesWritten/1024., nSkipped, bytesSaved/1024.);
   }
 
 
@@ -2036,11 +2823,264 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
   }
 
 
+  //
+  // compute the asymptotic CLs limits of the datacards from the shapes in memory: same channels, processes and
+  // systematics as buildDataCards, with the shape variations of the shapes file (must be called after saveHistoForLimit)
+  //
+  AsymptoticLimits::Result_t AllInfo_t::computeAsymptoticLimits(string histoName, bool observed, bool writeLog)
+  {
+    std::vector<string>clean_procs;
+    std::vector<string>sign_procs;
+    std::map<string, bool> allChannels;
+    std::map<string, bool> allSysts;
+    for(unsigned int p=0;p<sorted_procs.size();p++){
+      string procName = sorted_procs[p];
+      std::map<string, ProcessInfo_t>::iterator it=procs.find(procName);
+      if(it==procs.end() || it->first=="total")continue;
+      if(it->second.isSign)sign_procs.push_back(procName);
+      if(it->second.isBckg)clean_procs.push_back(procName);
+      for(std::map<string, ChannelInfo_t>::iterator ch = it->second.channels.begin(); ch!=it->second.channels.end(); ch++){
+        if(ch->second.shapes.find(histoName)==(ch->second.shapes).end())continue;
+        allChannels[ch->first] = true;
+        ShapeData_t& shapeInfo = ch->second.shapes[histoName];
+        for(std::map<string, double>::iterator unc=shapeInfo.uncScale.begin();unc!=shapeInfo.uncScale.end();unc++){
+          if(unc->first=="")continue;
+          allSysts[unc->first] = unc->second==-1?true:false;
+        }
+      }
+    }
+    clean_procs.insert(clean_procs.begin(), sign_procs.begin(), sign_procs.end());
+
+    AsymptoticLimits model;
+    for(std::map<string, bool>::iterator C=allChannels.begin(); C!=allChannels.end();C++){
+      TH1* hData = procs["data"].channels[C->first].shapes[histoName].histo();
+      if(!hData){printf("No data in %s, the channel is not used for the asymptotic limits\n", C->first.c_str()); continue;}
+      int nBins = hData->GetXaxis()->GetNbins();
+      int firstBin = model.nBins();
+      for(int b=1;b<=nBins;b++)model.addBin(hData->GetBinContent(b));
+
+      for(unsigned int j=0; j<clean_procs.size(); j++){
+        ShapeData_t& shapeInfo = procs[clean_procs[j]].channels[C->first].shapes[histoName];
+        TH1* h = shapeInfo.histo();
+        if(!h || h->GetXaxis()->GetNbins()!=nBins)continue;
+        double integral = h->Integral();
+        std::vector<int> yields(nBins+1, -1);
+        for(int b=1;b<=nBins;b++)yields[b] = model.addYield(firstBin+b-1, h->GetBinContent(b), procs[clean_procs[j]].isSign);
+
+        //up and down variations by datacard name (no down variation for the one sided ones, mirrored as in the shapes file)
+        std::map<string, std::pair<TH1*, TH1*> > variations;
+        for(std::map<string, TH1*>::iterator unc=shapeInfo.uncShape.begin();unc!=shapeInfo.uncShape.end();unc++){
+          if(unc->first=="" || !unc->second || unc->second->GetXaxis()->GetNbins()!=nBins)continue;
+          TString syst = unc->first.c_str();
+          std::pair<TH1*, TH1*>& var = variations[datacardSystName(syst).Data()];
+          if(syst.Contains("Down"))var.second = unc->second; else var.first = unc->second;
+        }
+
+        for(std::map<string, bool>::iterator U=allSysts.begin(); U!=allSysts.end();U++){
+          if(mass==125 && U->first=="CMS_haa4b_lshape")continue;//skip lineshape uncertainty for 125GeV Higgs
+          if(shapeInfo.uncScale.find(U->first)==shapeInfo.uncScale.end())continue;
+          if(!U->second){
+            double kappa = integral>0 ? 1+shapeInfo.uncScale[U->first]/integral : 1+shapeInfo.uncScale[U->first];
+            for(int b=1;b<=nBins;b++)model.addEffect(yields[b], U->first, kappa, 1/kappa);
+            continue;
+          }
+
+          std::map<string, std::pair<TH1*, TH1*> >::iterator var = variations.find(U->first);
+          std::map<string, StatBin_t>::iterator stat = shapeInfo.uncStatBin.find("_"+U->first);
+          if(stat==shapeInfo.uncStatBin.end())stat = shapeInfo.uncStatBin.find(U->first);
+          if(var!=variations.end() && var->second.first){
+            for(int b=1;b<=nBins;b++){
+              double nominal = h->GetBinContent(b);
+              if(nominal<=0)continue;
+              double up   = var->second.first->GetBinContent(b);
+              double down = var->second.second ? var->second.second->GetBinContent(b) : std::max(0.0, 2*nominal-up);
+              model.addEffect(yields[b], U->first, up/nominal, down/nominal);
+            }
+          }else if(stat!=shapeInfo.uncStatBin.end()){
+            int b = stat->second.bin;
+            if(b<1 || b>nBins || h->GetBinContent(b)<=0)continue;
+            model.addEffect(yields[b], U->first, stat->second.up/h->GetBinContent(b), stat->second.down/h->GetBinContent(b));
+          }else{
+            printf("No variation found for the shape systematic %s of %s in %s, it is ignored in the asymptotic limits\n", U->first.c_str(), clean_procs[j].c_str(), C->first.c_str());
+          }
+        }
+      }
+    }
+
+    printf("Asymptotic limits: %i bins and %i nuisances\n", model.nBins(), model.nNuisances());
+    AsymptoticLimits::Result_t result;
+    model.compute(result, observed, true);
+    AsymptoticLimits::print(stdout, result);
+    FILE* pFile = writeLog ? fopen("AsymptoticLimits.log","w") : NULL;
+    if(pFile){ AsymptoticLimits::print(pFile, result); fclose(pFile); }
+    return result;
+  }
+
+
+  //
+  // Names derived from the json processes by getShapeFromFile, memoised as they are the same for all the analysis
+  // bins and all the points of a batch
+  //
+  double signalMassFromName(const TString& proc){
+    static std::map<string, double> cache;
+    std::map<string, double>::iterator it = cache.find(proc.Data());
+    if(it!=cache.end())return it->second;
+    double procMass=0;
+    if(proc.Contains("H(") && proc.Contains("A(")){sscanf(proc.Data()+proc.First("A")+2,"%lf",&procMass);
+    }else if(proc.Contains("H(")){sscanf(proc.Data()+proc.First("H")+2,"%lf",&procMass);
+    }else if(proc.Contains("A(")){sscanf(proc.Data()+proc.First("A")+2,"%lf",&procMass);
+    }else if(proc.Contains("h(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
+    }else if(proc.Contains("Rad(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
+    }else if(proc.Contains("RsGrav(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
+    }else if(proc.Contains("BulkGrav(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);}
+    cache[proc.Data()] = procMass;
+    return procMass;
+  }
+
+  double xhMassFromName(const TString& proc){
+    static std::map<string, double> cache;
+    std::map<string, double>::iterator it = cache.find(proc.Data());
+    if(it!=cache.end())return it->second;
+    double procMass=0;
+    sscanf(proc.Data()+proc.First("H(")+2,"%lf",&procMass);
+    cache[proc.Data()] = procMass;
+    return procMass;
+  }
+
+  string shortNameFromProc(const TString& proc, const char* procMassStr){
+    static std::map<string, string> cache;
+    string key = string(proc.Data())+"\n"+procMassStr;
+    std::map<string, string>::iterator it = cache.find(key);
+    if(it!=cache.end())return it->second;
+    TString shortName = proc;
+    shortName.ToLower();
+    shortName.ReplaceAll(procMassStr,"");
+    shortName.ReplaceAll("#bar{t}","tbar");
+    shortName.ReplaceAll("z-#gamma^{*}+jets#rightarrow ll","dy");
+    shortName.ReplaceAll("#rightarrow","");
+    shortName.ReplaceAll("(",""); shortName.ReplaceAll(")","");    shortName.ReplaceAll("+","");    shortName.ReplaceAll(" ","");   shortName.ReplaceAll("/","");  shortName.ReplaceAll("#","");
+    shortName.ReplaceAll("=",""); shortName.ReplaceAll(".","");    shortName.ReplaceAll("^","");    shortName.ReplaceAll("}","");   shortName.ReplaceAll("{","");  shortName.ReplaceAll(",","");
+    shortName.ReplaceAll("ggh", "ggH");
+    shortName.ReplaceAll("qqh", "qqH");
+    if(shortName.Length()>8)shortName.Resize(8);
+    cache[key] = shortName.Data();
+    return cache[key];
+  }
+
+
+  //
+  // One shape read by getShapeFromFile: projection of the cut-index TH2 of a process on one cut bin
+  //
+  struct ShapeRead_t{
+    string dirName;            //directory of the process in the input file
+    string cacheDir;           //path of this directory in the main input file, key of the input cache
+    string histoName, fallbackName, projName;
+    int cutBin;
+    bool isCutShape, isSignal;
+    bool sharedHisto, sharedFallback;  //objects of the input cache also used by other reads
+    TString title;
+    int color, lcolor, mcolor, lwidth, lstyle, fill, marker;
+    ShapeData_t* shapeInfo;    //destination of the shape
+    string varName;            //name of the variation in the datacards
+    bool done;
+    TH1D* hshape;              //NULL if the histogram is not in the file
+    std::vector<std::pair<string, TObject*> > fetched;  //objects read for the input cache
+  };
+
+  //histogram of a process directory; in batch mode the histograms already in the input cache are used and the ones
+  //read are detached from the file, to be added to the cache by the main thread
+  TH2* getShapeHisto(TFile* file, ShapeRead_t& read, const string& name, bool& fromCache){
+    fromCache = false;
+    if(cacheInput){
+      std::map<string, TObject*>::iterator it = inputCache.find(read.cacheDir+"/"+name);
+      if(it!=inputCache.end()){ fromCache = true; return (TH2*)it->second; }
+    }
+    TObject* obj = file->Get((read.dirName+"/"+name).c_str());
+    TH2* h = (obj && obj->InheritsFrom(TH2::Class())) ? (TH2*)obj : NULL;
+    if(cacheInput){
+      if(h)h->SetDirectory(0);
+      read.fetched.push_back(std::make_pair(read.cacheDir+"/"+name, (TObject*)h));
+    }
+    return h;
+  }
+
+  //the projections change the axis range of the TH2 while they run
+  std::mutex sharedProjectionMutex;
+
+  //projects, filters, cuts and rescales one shape; only touches the objects of this read (and reads the input cache)
+  void extractShape(TFile* file, ShapeRead_t& read, double minCut, double maxCut){
+    read.done = true;
+    read.hshape = NULL;
+    bool isEmpty = false, fromCache = false;
+    TH2* hshape2D = getShapeHisto(file, read, read.histoName, fromCache);
+    bool shared = fromCache && read.sharedHisto;
+    if(!hshape2D){
+      hshape2D = getShapeHisto(file, read, read.fallbackName, fromCache);
+      if(!hshape2D)return;  //if still no histo, skip this proc...
+      isEmpty = true;       //the shape of all the channels is used as an empty template
+      shared = fromCache && read.sharedFallback;
+    }
+
+    TH1D* hshape = NULL;
+    if(shared){
+      std::unique_lock<std::mutex> lock(sharedProjectionMutex);
+      hshape = hshape2D->ProjectionY(read.projName.c_str(),read.cutBin,read.cutBin);
+    }else{
+      hshape = hshape2D->ProjectionY(read.projName.c_str(),read.cutBin,read.cutBin);
+    }
+    if(isEmpty)hshape->Reset();
+    filterBinContent(hshape);
+    //if(hshape->Integral()<=0 && varName=="" && !isData){hshape->Reset(); hshape->SetBinContent(1, 1E-10);} //TEST FOR HIGGS WIDTH MEASUREMENTS, MUST BE UNCOMMENTED ASAP
+
+    if(isnan((float)hshape->Integral())){hshape->Reset();}
+    hshape->SetDirectory(0);
+    hshape->SetTitle(read.title);
+    utils::root::fixExtremities(hshape,false,true);
+    hshape->SetFillColor(read.color); hshape->SetLineColor(read.lcolor); hshape->SetMarkerColor(read.mcolor);
+    hshape->SetFillStyle(read.fill);  hshape->SetLineWidth(read.lwidth); hshape->SetMarkerStyle(read.marker); hshape->SetLineStyle(read.lstyle);
+
+    //if current shape is the one to cut on, then apply the cuts
+    if(read.isCutShape){
+      for(int x=0;x<=hshape->GetXaxis()->GetNbins()+1;x++){
+        if(hshape->GetXaxis()->GetBinCenter(x)<=minCut || hshape->GetXaxis()->GetBinCenter(x)>=maxCut){ hshape->SetBinContent(x,0); hshape->SetBinError(x,0); }
+      }
+
+      if(rebinVal>1){ hshape->Rebin(rebinVal); }
+      hshape->GetYaxis()->SetTitle("Entries");// (/25GeV)");
+    }
+    hshape->Scale(MCRescale);
+    if(read.isSignal)hshape->Scale(SignalRescale);
+    hshape->SetTitle(read.title+read.varName.c_str());
+    read.hshape = hshape;
+  }
+
+  //worker of the pool: takes the next shape of the list until the list is exhausted
+  void extractShapesWorker(string fileName, std::vector<ShapeRead_t>* reads, size_t* next, std::mutex* mutex, double minCut, double maxCut){
+    TFile* file = TFile::Open(fileName.c_str());
+    if(!file || file->IsZombie()){ printf("Can not open %s in a worker, its shapes are read by the main thread\n", fileName.c_str()); delete file; return; }
+    while(true){
+      size_t r;
+      {
+        std::unique_lock<std::mutex> lock(*mutex);
+        if(*next>=reads->size())break;
+        r = (*next)++;
+      }
+      file->cd();  //the projections are created in the directory of this thread
+      extractShape(file, (*reads)[r], minCut, maxCut);
+    }
+    file->Close();
+    delete file;
+  }
+
+
   //
   // Load histograms from root file and json to memory
+  // The shapes to read are listed first, then read and projected with --nThreads threads, each one reading its own
+  // copy of the input file, and finally filled in the order of the list, so that the sums do not depend on the scheduling
   //
   void AllInfo_t::getShapeFromFile(TFile* inF, std::vector<string> channelsAndShapes, int cutBin, JSONWrapper::Object &Root,  double minCut, double maxCut, bool onlyData){
     std::vector<TString> BackgroundsInSignal;
+    std::vector<ShapeRead_t> reads;
 
     //iterate over the processes required
     std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
@@ -2052,14 +3092,14 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
       TString procCtr(""); procCtr+=i;
       TString proc=Process[i].getString("tag", "noTagFound");
 
-      string dirName = proc.Data(); 
+      string dirName = proc.Data();
 	    //std::<TString> keys = Process[i].getString("keys", "noKeysFound");
       if(Process[i].isTagFromKeyword(matchingKeyword, "mctruthmode") ) { char buf[255]; sprintf(buf,"_filt%d",(int)Process[i].getIntFromKeyword(matchingKeyword, "mctruthmode", 0)); dirName += buf; }
       string procSuffix = Process[i].getStringFromKeyword(matchingKeyword, "suffix", "");
       if(procSuffix!=""){dirName += "_" + procSuffix;}
-      while(dirName.find("/")!=std::string::npos)dirName.replace(dirName.find("/"),1,"-");         
+      while(dirName.find("/")!=std::string::npos)dirName.replace(dirName.find("/"),1,"-");
 
-      TDirectory *pdir = (TDirectory *)inF->Get(dirName.c_str());         
+      TDirectory *pdir = (TDirectory *)getInputObject(inF, dirName);
       if(!pdir){printf("Directory (%s) for proc=%s is not in the file!\n", dirName.c_str(), proc.Data()); continue;}
 
       bool isData = Process[i].getBool("isdata", false);
@@ -2083,19 +3123,13 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
 
       double procMass=0;  char procMassStr[128] = "";
       if(isSignal &&  mass>0 && (proc.Contains("H(") || proc.Contains("h(") || proc.Contains("A(") || proc.Contains("Rad(") || proc.Contains("RsGrav(") || proc.Contains("BulkGrav(") )){
-        if(proc.Contains("H(") && proc.Contains("A(")){sscanf(proc.Data()+proc.First("A")+2,"%lf",&procMass);
-        }else if(proc.Contains("H(")){sscanf(proc.Data()+proc.First("H")+2,"%lf",&procMass);
-        }else if(proc.Contains("A(")){sscanf(proc.Data()+proc.First("A")+2,"%lf",&procMass);
-        }else if(proc.Contains("h(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
-        }else if(proc.Contains("Rad(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
-		  	}else if(proc.Contains("RsGrav(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);
-        }else if(proc.Contains("BulkGrav(")){sscanf(proc.Data()+proc.First("(")+1,"%lf",&procMass);}
+        procMass = signalMassFromName(proc);
 
         //printf("%s --> %f\n",  proc.Data(), procMass);
 
         //skip signal sample not needed
         if(massL!=-1 && massR!=-1){
-          if(procMass!=massL && procMass!=massR)continue; 
+          if(procMass!=massL && procMass!=massR)continue;
         }else{
           if(procMass!=mass)continue;
         }
@@ -2104,7 +3138,7 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
       }
 
       if(!isSignal &&  mass>0 && proc.Contains("XH(") && proc.Contains(")#rightarrow WW")){
-        sscanf(proc.Data()+proc.First("H(")+2,"%lf",&procMass);
+        procMass = xhMassFromName(proc);
         if(!(procMass==mass || procMass==massL || procMass==massR))continue; //skip XH-->WW background sample not concerned
       }
 
@@ -2121,39 +3155,29 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
       if(skipGGH && isSignal && mass>0 && proc.Contains("ggH") )continue;
       if(skipQQH && isSignal && mass>0 && (proc.Contains("qqH") || proc.Contains("VBF")) )continue;
 
-      TString shortName = proc;
-      shortName.ToLower();
-      shortName.ReplaceAll(procMassStr,"");
-      shortName.ReplaceAll("#bar{t}","tbar");
-      shortName.ReplaceAll("z-#gamma^{*}+jets#rightarrow ll","dy");
-      shortName.ReplaceAll("#rightarrow","");
-      shortName.ReplaceAll("(",""); shortName.ReplaceAll(")","");    shortName.ReplaceAll("+","");    shortName.ReplaceAll(" ","");   shortName.ReplaceAll("/","");  shortName.ReplaceAll("#",""); 
-      shortName.ReplaceAll("=",""); shortName.ReplaceAll(".","");    shortName.ReplaceAll("^","");    shortName.ReplaceAll("}","");   shortName.ReplaceAll("{","");  shortName.ReplaceAll(",","");
-      shortName.ReplaceAll("ggh", "ggH");
-      shortName.ReplaceAll("qqh", "qqH");
-      if(shortName.Length()>8)shortName.Resize(8);
+      string shortName = shortNameFromProc(proc, procMassStr);
 
 
       if(procs.find(proc.Data())==procs.end()){sorted_procs.push_back(proc.Data());}
       ProcessInfo_t& procInfo = procs[proc.Data()];
-      procInfo.jsonObj = Process[i]; 
+      procInfo.jsonObj = Process[i];
       procInfo.isData = isData;
       procInfo.isSign = isSignal;
       procInfo.isBckg = !procInfo.isData && !procInfo.isSign;
       procInfo.mass   = procMass;
-      procInfo.shortName = shortName.Data();
+      procInfo.shortName = shortName;
 
       if(procInfo.isSign){
         procInfo.xsec = procInfo.jsonObj["data"].daughters()[0].getDouble("xsec", 1);
         if(procInfo.jsonObj["data"].daughters()[0].isTag("br")){
           std::vector<JSONWrapper::Object> BRs = procInfo.jsonObj["data"].daughters()[0]["br"].daughters();
-          double totalBR=1.0; for(size_t ipbr=0; ipbr<BRs.size(); ipbr++){totalBR*=BRs[ipbr].toDouble();}   
+          double totalBR=1.0; for(size_t ipbr=0; ipbr<BRs.size(); ipbr++){totalBR*=BRs[ipbr].toDouble();}
           procInfo.br = totalBR;
         }
       }
 
-      //Loop on all channels, bins and shape to load and store them in memory structure
-      TH1* syst = (TH1*)pdir->Get("all_optim_systs");
+      //Loop on all channels, bins and shape to list the histograms to read
+      TH1* syst = (TH1*)getInputObject(pdir, "all_optim_systs");
       if(syst==NULL){syst=new TH1F("all_optim_systs","all_optim_systs",1,0,1);syst->GetXaxis()->SetBinLabel(1,"");}
       for(unsigned int c=0;c<channelsAndShapes.size();c++){
         TString chName    = (channelsAndShapes[c].substr(0,channelsAndShapes[c].find(";"))).c_str();
@@ -2167,62 +3191,36 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
         ShapeData_t& shapeInfo = channelInfo.shapes[shapeName.Data()];
 
         //printf("%s SYST SIZE=%i\n", (ch+"_"+shapeName).Data(), syst->GetNbinsX() );
-        for(int ivar = 1; ivar<=syst->GetNbinsX();ivar++){                
-          TH1D* hshape   = NULL;
+        for(int ivar = 1; ivar<=syst->GetNbinsX();ivar++){
           TString varName   = syst->GetXaxis()->GetBinLabel(ivar);
           TString histoName = ch+"_"+shapeName+(isSignal?signalSufix:"")+varName ;
-          if(shapeName==histo && histoVBF!="" && ch.Contains("vbf"))histoName = ch+"_"+histoVBF+(isSignal?signalSufix:"")+varName ;
-          //if(isSignal && ivar==1)printf("Syst %i = %s\n", ivar, varName.Data()); 
-
-          TH2* hshape2D = (TH2*)pdir->Get(histoName );
-          if(!hshape2D){
-            if(shapeName==histo && histoVBF!="" && ch.Contains("vbf")){   hshape2D = (TH2*)pdir->Get(TString("all_")+histoVBF+(isSignal?signalSufix:"")+varName);
-            }else{                                                        hshape2D = (TH2*)pdir->Get(TString("all_")+shapeName+varName);
-            }
-
-            if(hshape2D){
-              hshape2D->Reset();
-            }else{  //if still no histo, skip this proc...
-              //printf("Histo %s does not exist for syst:%s\n", histoName.Data(), varName.Data());
-              continue;
-            }
+          TString fallbackName = TString("all_")+shapeName+varName;
+          if(shapeName==histo && histoVBF!="" && ch.Contains("vbf")){
+            histoName = ch+"_"+histoVBF+(isSignal?signalSufix:"")+varName ;
+            fallbackName = TString("all_")+histoVBF+(isSignal?signalSufix:"")+varName;
           }
+          //if(isSignal && ivar==1)printf("Syst %i = %s\n", ivar, varName.Data());
 
-          //special treatment for side mass points
-          int cutBinUsed = cutBin;
-          if(shapeName == histo && !ch.Contains("vbf") && procMass==massL)cutBinUsed = indexcutML[channelInfo.bin];
-          if(shapeName == histo && !ch.Contains("vbf") && procMass==massR)cutBinUsed = indexcutMR[channelInfo.bin];
-
+          ShapeRead_t read;
+          read.dirName      = dirName;
+          read.cacheDir     = pdir->GetPath();
+          read.histoName    = histoName.Data();
+          read.fallbackName = fallbackName.Data();
           histoName.ReplaceAll(ch,ch+"_proj"+procCtr);
-          hshape   = hshape2D->ProjectionY(histoName,cutBinUsed,cutBinUsed);
-          filterBinContent(hshape);
-          //printf("%s %s %s Integral = %f\n", ch.Data(), shortName.Data(), varName.Data(), hshape->Integral() );
-          //if(hshape->Integral()<=0 && varName=="" && !isData){hshape->Reset(); hshape->SetBinContent(1, 1E-10);} //TEST FOR HIGGS WIDTH MEASUREMENTS, MUST BE UNCOMMENTED ASAP
-
-          if(isnan((float)hshape->Integral())){hshape->Reset();}
-          hshape->SetDirectory(0);
-          hshape->SetTitle(proc);
-          utils::root::fixExtremities(hshape,false,true);
-          hshape->SetFillColor(color); hshape->SetLineColor(lcolor); hshape->SetMarkerColor(mcolor);
-          hshape->SetFillStyle(fill);  hshape->SetLineWidth(lwidth); hshape->SetMarkerStyle(marker); hshape->SetLineStyle(lstyle);
-
-          //if current shape is the one to cut on, then apply the cuts
-          if(shapeName == histo){
-            //if(ivar==1 && isSignal)printf("A %s %s Integral = %f\n", ch.Data(), shortName.Data(), hshape->Integral() );
+          read.projName     = histoName.Data();
 
-            for(int x=0;x<=hshape->GetXaxis()->GetNbins()+1;x++){
-              if(hshape->GetXaxis()->GetBinCenter(x)<=minCut || hshape->GetXaxis()->GetBinCenter(x)>=maxCut){ hshape->SetBinContent(x,0); hshape->SetBinError(x,0); }
-            }
-
-            if(rebinVal>1){ hshape->Rebin(rebinVal); }
-						//                     if(histoVBF!="" && ch.Contains("vbf")){    hshape->Rebin(30);
-						//                     }else{                                     hshape->Rebin(rebinVal);
-						//                     }
-            hshape->GetYaxis()->SetTitle("Entries");// (/25GeV)");
-
-          }
-          hshape->Scale(MCRescale);
-          if(isSignal)hshape->Scale(SignalRescale);
+          //special treatment for side mass points
+          read.cutBin = cutBin;
+          if(shapeName == histo && !ch.Contains("vbf") && procMass==massL)read.cutBin = indexcutML[channelInfo.bin];
+          if(shapeName == histo && !ch.Contains("vbf") && procMass==massR)read.cutBin = indexcutMR[channelInfo.bin];
+          read.isCutShape = (shapeName == histo);
+          read.isSignal   = isSignal;
+          read.title  = proc;
+          read.color  = color;  read.lcolor = lcolor; read.mcolor = mcolor; read.lwidth = lwidth;
+          read.lstyle = lstyle; read.fill   = fill;   read.marker = marker;
+          read.shapeInfo = &shapeInfo;
+          read.done   = false;
+          read.hshape = NULL;
 
           //Do Renaming and cleaning
           varName.ReplaceAll("down","Down");
@@ -2231,24 +3229,63 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
           if(varName==""){//does nothing
           }else if(varName.BeginsWith("_jes")){varName.ReplaceAll("_jes","_CMS_scale_j");
           }else if(varName.BeginsWith("_jer")){varName.ReplaceAll("_jer","_CMS_res_j"); // continue;//skip res for now
-          }else if(varName.BeginsWith("_les")){ 
+          }else if(varName.BeginsWith("_les")){
             if(ch.Contains("ee"  ))varName.ReplaceAll("_les","_CMS_scale_e");
             if(ch.Contains("mumu"))varName.ReplaceAll("_les","_CMS_scale_m");
-          }else if(varName.BeginsWith("_btag"  )){varName.ReplaceAll("_btag","_CMS_eff_b"); 
+          }else if(varName.BeginsWith("_btag"  )){varName.ReplaceAll("_btag","_CMS_eff_b");
           }else if(varName.BeginsWith("_pu"    )){varName.ReplaceAll("_pu", "_CMS_haa4b_pu");
           }else if(varName.BeginsWith("_ren"   )){continue;   //already accounted for in QCD scales
           }else if(varName.BeginsWith("_fact"  )){continue; //skip this one
             //}else if(varName.BeginsWith("_interf")){varName="_CMS_haa4b"+varName;  //commented out for the HighMass paper
-        }else{                               varName="_CMS_haa4b"+varName;
+          }else{                               varName="_CMS_haa4b"+varName;
+          }
+          read.varName = varName.Data();
+          reads.push_back(read);
         }
+      }
+    }
 
-        hshape->SetTitle(proc+varName);
-        if(shapeInfo.uncShape.find(varName.Data())==shapeInfo.uncShape.end()){
-          shapeInfo.uncShape[varName.Data()] = hshape;
-        }else{
-          shapeInfo.uncShape[varName.Data()]->Add(hshape);
-        }
-        }
+    //in batch mode the cached histograms requested by several reads (e.g. the all_ templates) are projected one at a time
+    std::map<string, int> requests;
+    if(cacheInput){
+      for(size_t r=0;r<reads.size();r++){ requests[reads[r].cacheDir+"/"+reads[r].histoName]++; requests[reads[r].cacheDir+"/"+reads[r].fallbackName]++; }
+    }
+    for(size_t r=0;r<reads.size();r++){
+      reads[r].sharedHisto    = cacheInput && requests[reads[r].cacheDir+"/"+reads[r].histoName]>1;
+      reads[r].sharedFallback = cacheInput && requests[reads[r].cacheDir+"/"+reads[r].fallbackName]>1;
+    }
+
+    //read and project the shapes, the ones left by the workers (e.g. if they could not open the file) are read here
+    int nWorkers = std::min(nThreads, (int)reads.size());
+    if(nWorkers>1){
+      size_t next = 0;
+      std::mutex mutex;
+      std::vector<std::thread> workers;
+      for(int w=0;w<nWorkers;w++){ workers.push_back(std::thread(extractShapesWorker, string(inF->GetName()), &reads, &next, &mutex, minCut, maxCut)); }
+      for(int w=0;w<nWorkers;w++){ workers[w].join(); }
+      gROOT->cd();
+    }
+    for(size_t r=0;r<reads.size();r++){
+      if(!reads[r].done)extractShape(inF, reads[r], minCut, maxCut);
+    }
+
+    //fill the shapes in the order of the list
+    for(size_t r=0;r<reads.size();r++){
+      ShapeRead_t& read = reads[r];
+      for(size_t o=0;o<read.fetched.size();o++){
+        std::map<string, TObject*>::iterator it = inputCache.find(read.fetched[o].first);
+        if(it==inputCache.end()){ inputCache[read.fetched[o].first] = read.fetched[o].second; //missing objects are cached as well
+        }else if(it->second!=read.fetched[o].second){ delete read.fetched[o].second; }      //also read by another worker
+      }
+
+      TH1D* hshape = read.hshape;
+      if(!hshape)continue;
+      ShapeData_t& shapeInfo = *read.shapeInfo;
+      if(shapeInfo.uncShape.find(read.varName)==shapeInfo.uncShape.end()){
+        shapeInfo.uncShape[read.varName] = hshape;
+      }else{
+        shapeInfo.uncShape[read.varName]->Add(hshape);
+        delete hshape;
       }
     }
   }
@@ -2822,6 +3859,28 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
     }
   }
 
+  //
+  // Morphers of the signal interpolation, kept for the following points of a batch: they are reused as long as the
+  // templates of the pair (binning and content, under/overflow included) and their masses are the same
+  //
+  struct CachedMorpher_t{
+    std::vector<double> inputs;
+    std::shared_ptr<HistoMorpher> morpher;
+  };
+  std::map<string, CachedMorpher_t> morpherCache;
+
+  void getMorphingInputs(TH1* hL, TH1* hR, double massL, double massR, std::vector<double>& inputs){
+    inputs.clear();
+    inputs.push_back(massL); inputs.push_back(massR);
+    TH1* h[2] = {hL, hR};
+    for(int i=0;i<2;i++){
+      int nbins = h[i]->GetNbinsX();
+      inputs.push_back(nbins);
+      for(int b=1;b<=nbins+1;b++)inputs.push_back(h[i]->GetXaxis()->GetBinLowEdge(b));
+      for(int b=0;b<=nbins+1;b++)inputs.push_back(h[i]->GetBinContent(b));
+    }
+  }
+
   //
   // Interpollate the signal sample between two mass points 
   //
@@ -2883,6 +3942,9 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
         shapeInfoL.makeStatUnc("", "", "", true );
         shapeInfoR.makeStatUnc("", "", "", true );
 
+        //the variations have the binning of the nominal shape (first in the map), the merged output binning is computed only once
+        std::shared_ptr<HistoMorpher> binningRef;
+        std::vector<double> inputs;
         for(std::map<string, TH1*  >::iterator unc=shapeInfoL.uncShape.begin();unc!=shapeInfoL.uncShape.end();unc++){
           if(shapeInfo.uncShape.find(unc->first)==shapeInfo.uncShape.end())shapeInfo.uncShape[unc->first] = (TH1*)shapeInfoL.uncShape[unc->first]->Clone(signProcName+ch->first+unc->first+"tmp");
           TH1D* hL = (TH1D*)shapeInfoL.uncShape[unc->first];
@@ -2893,7 +3955,15 @@ void AllInfo_t::getYieldsFromShape(FILE* pFile, std::vector<TString>& selCh, str
           hR->Scale(1.0/(procR.xsec*procR.br));
           h->Reset();
           if(hL->Integral()>0 && hR->Integral()>0){//interpolate only if the histograms are not null
-            h->Add(th1fmorph(signProcName+ch->first+unc->first,signProcName+ch->first+unc->first, hL, hR, procL.mass, procR.mass, proc.mass, (1-Ratio)*hL->Integral() + Ratio*hR->Integral(), 0), 1);
+            getMorphingInputs(hL, hR, procL.mass, procR.mass, inputs);
+            CachedMorpher_t& cached = morpherCache[procLR->second.first+"|"+procLR->second.second+"|"+ch->first+"|"+histoName+"|"+unc->first];
+            if(!cached.morpher || cached.inputs!=inputs){
+              cached.morpher.reset(new HistoMorpher(hL, hR, procL.mass, procR.mass, binningRef.get()));
+              cached.inputs.swap(inputs);
+            }
+            std::shared_ptr<HistoMorpher> morpher = cached.morpher;
+            morpher->addTo(h, proc.mass, (1-Ratio)*hL->Integral() + Ratio*hR->Integral());
+            if(!binningRef) binningRef = morpher;
           }
           //printf("EFF : syst%25s %f - %f -%f\n", unc->first.c_str(), hL->Integral(), h->Integral(), hR->Integral());
           h->Scale(proc.xsec*proc.br);
@@ -63,6 +63,9 @@
 #include "UserCode/bsmhiggs_fwk/interface/MacroUtils.h"
 //#include "UserCode/bsmhiggs_fwk/interface/HiggsUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryHandler.h"
+#include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryStream.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProgressMonitor.h"
 
 #include "UserCode/bsmhiggs_fwk/interface/SmartSelectionMonitor.h"
 #include "UserCode/bsmhiggs_fwk/interface/TMVAUtils.h"
@@ -189,15 +192,48 @@ int main(int argc, char* argv[])
      printf("  Will run over %d events.\n", maxevents ) ;
   }
 
+  //output tuning: compression preset (default/fast/archive/zlib/lzma), basket size and auto-flush of the summary tree
+  std::string compression = runProcess.getUntrackedParameter<std::string>("compression", "default");
+  int compressionLevel = runProcess.getUntrackedParameter<int>("compressionLevel", -1);
+  int basketSize = runProcess.getUntrackedParameter<int>("basketSize", 0);
+  long long autoFlush = runProcess.getUntrackedParameter<long long>("autoFlush", 0);
+  int compressionSettings = DataEvtSummaryHandler::getCompressionSettings(compression, compressionLevel);
+  printf("  Output compression '%s' (settings=%d), basket size %d, auto-flush %lld\n", compression.c_str(), compressionSettings, basketSize, autoFlush);
+
+  //optional streaming of the summary records to an analysis process on the same node (see DataEvtSummaryStream)
+  std::string outputStream = runProcess.getUntrackedParameter<std::string>("outputStream", "");
+  int streamSlots = runProcess.getUntrackedParameter<int>("streamSlots", 16);
+  int streamTimeout = runProcess.getUntrackedParameter<int>("streamTimeout", 600);
+  bool writeNtuple = runProcess.getUntrackedParameter<bool>("writeNtuple", true);
+  DataEvtSummaryStream summaryStream_;
+  if(outputStream!="" && !summaryStream_.create(outputStream, streamSlots, streamTimeout)) return -1;
+  if(outputStream=="" && !writeNtuple) {
+     printf("  writeNtuple=False requires an outputStream, the ntuple will be written.\n");
+     writeNtuple = true;
+  }
+
+  //optional per-stage timing and memory summary (JSON), see ProfilingUtils
+  std::string profile = runProcess.getUntrackedParameter<std::string>("profile", "");
+  if(profile!="") profUtils::enable(outUrl.Data());
+  const int inputStage   = profUtils::stage("input");
+  const int mcTruthStage = profUtils::stage("MC truth");
+  const int triggerStage = profUtils::stage("trigger and filters");
+  const int objectStage  = profUtils::stage("object selection");
+  const int fillStage    = profUtils::stage("tree fill");
+  const int streamStage  = profUtils::stage("stream push");
+  const int outputStage  = profUtils::stage("output");
+
 
   //##############################################
   //########    INITIATING TREE      #############
   //##############################################
 
   fwlite::TFileService fs = fwlite::TFileService("test.root");//outUrl.Data());
+  if(compressionSettings>=0) fs.file().SetCompressionSettings(compressionSettings);
 
   TFileDirectory baseDir=fs.mkdir(runProcess.getParameter<std::string>("dtag"));          
   summaryHandler_.initTree(  fs.make<TTree>("data","Event Summary") );   
+  summaryHandler_.configureOutput(compressionSettings, basketSize, autoFlush);
 
   //##############################################
   //########    INITIATING HISTOGRAMS     ########
@@ -257,20 +293,30 @@ int main(int argc, char* argv[])
   printf("\n\n") ;
   printf("  Number of input files: %lu\n", urls.size() ) ;
   printf("  First input file: %s\n", urls[0].c_str() ) ;
-  printf("Progressing Bar           :0%%       20%%       40%%       60%%       80%%       100%%\n");
+
+  //progress (rate, MB/s, ETA, memory) printed every heartbeat seconds and optionally written to a status file for the batch scripts,
+  //the total is estimated from the number of events of the files opened so far
+  std::string statusFile = runProcess.getUntrackedParameter<std::string>("statusFile", "");
+  double heartbeat = runProcess.getUntrackedParameter<double>("heartbeat", 30.);
+  ProgressMonitor progress(outUrl.Data(), -1, "events", statusFile, heartbeat);
+  progress.setCommand(argc, argv);
+  long long nPreviousEvents = 0;
 
   for(unsigned int f=0;f<urls.size();f++){
      if (verbose) printf("File: %s\n", urls[f].c_str() ) ;
+     profUtils::mark(inputStage);
      TFile* file = TFile::Open(urls[f].c_str() );
      fwlite::Event event(file);
      if (verbose) printf("Number of events: %llu\n", event.size() ) ;
-     printf("Scanning the ntuple %2i/%2i :", (int)f+1, (int)urls.size());
+     printf("Scanning the ntuple %2i/%2i : %llu events\n", (int)f+1, (int)urls.size(), event.size());
+     long long fileEvents = maxevents>0 ? std::min((long long)maxevents, (long long)event.size()) : (long long)event.size();
+     progress.setTotal(maxevents>0 ? fileEvents : (nPreviousEvents+fileEvents)*urls.size()/(f+1));
      int iev=0;
-     int treeStep(event.size()/50);
-     if(treeStep==0){ treeStep = 1;}
      for(event.toBegin(); !event.atEnd(); ++event){ 
+       profUtils::beginEvent();
+       profUtils::mark(inputStage);
        iev++;
-       if(iev%treeStep==0){printf(".");fflush(stdout);}
+       progress.update(nPreviousEvents+iev);
        
        mon_.fillHisto("nevents","all",1.0,0); //increment event count
 
@@ -292,6 +338,7 @@ int main(int argc, char* argv[])
        //Skip bad lumi
        if(!isMC && !goodLumiFilter.isGoodLumi(event.eventAuxiliary().run(),event.eventAuxiliary().luminosityBlock()))continue;
 
+       profUtils::mark(mcTruthStage);
        ev.mcbh = 0 ;
        std::vector<reco::GenParticle> b_hadrons ;
 
@@ -523,6 +570,7 @@ int main(int argc, char* argv[])
        //
        // Trigger
        //
+       profUtils::mark(triggerStage);
        fwlite::Handle<edm::TriggerResults> triggerBits; 
        fwlite::Handle<pat::TriggerObjectStandAloneCollection> triggerObjects; 
        fwlite::Handle<pat::PackedTriggerPrescales> triggerPrescales; 
@@ -601,6 +649,7 @@ int main(int argc, char* argv[])
        
        
        //load all the objects we will need to access
+       profUtils::mark(objectStage);
        reco::VertexCollection vtx;
        fwlite::Handle< reco::VertexCollection > vtxHandle;
        vtxHandle.getByLabel(event, "offlineSlimmedPrimaryVertices");
@@ -630,6 +679,14 @@ int main(int argc, char* argv[])
        fwlite::Handle< pat::MuonCollection > muonsHandle;
        muonsHandle.getByLabel(event, "slimmedMuons");
        if(muonsHandle.isValid()){ muons = *muonsHandle;}
+
+       //index the packed PF candidates once per event for the close-by safe (boosted) muon isolation (the collection of
+       //the event is bound, not copied)
+       static const pat::PackedCandidateCollection noPfCandidates;
+       fwlite::Handle< pat::PackedCandidateCollection > pfCandidatesHandle;
+       pfCandidatesHandle.getByLabel(event, "packedPFCandidates");
+       const pat::PackedCandidateCollection& pfCandidates = pfCandidatesHandle.isValid() ? *pfCandidatesHandle : noPfCandidates;
+       patUtils::PFCandidateIsolation pfIso(pfCandidates);
        
        ev.mn=0;
        //       for (std::vector<pat::Muon >::const_iterator mu = muons.begin(); mu!=muons.end(); mu++) 
@@ -673,6 +730,7 @@ int main(int argc, char* argv[])
 	 ev.mn_passIdLoose[ev.mn] = patUtils::passId(mu, vtx[0], patUtils::llvvMuonId::Loose, patUtils::CutVersion::ICHEP16Cut);
 	 ev.mn_passSoftMuon[ev.mn] = patUtils::passId(mu, vtx[0], patUtils::llvvMuonId::Soft, patUtils::CutVersion::ICHEP16Cut);
 	 ev.mn_passIso[ev.mn] = patUtils::passIso(mu, patUtils::llvvMuonIso::Tight, patUtils::CutVersion::ICHEP16Cut);
+	 ev.mn_passIsoBoosted[ev.mn] = patUtils::passIso(mu, patUtils::llvvMuonIso::TightAndTkRelatBoosted, patUtils::CutVersion::Moriond17Cut, pfIso, muons, vtx[0]);
 	 
 
 	 ev.mn_type[ev.mn]   = (mu.isMuon() << 0)
@@ -1212,7 +1270,17 @@ int main(int argc, char* argv[])
 
 
 
-       summaryHandler_.fillTree();
+       profUtils::mark(fillStage);
+       if(writeNtuple) summaryHandler_.fillTree();
+       profUtils::mark(streamStage);
+       if(outputStream!="" && !summaryStream_.push(ev)) {
+          //a consumer that stopped at its last event is fine, keep going and write our own output
+          if(!summaryStream_.consumerDetached()) {
+             printf("Lost the consumer of %s, stopping\n", outputStream.c_str());
+             return -1;
+          }
+          outputStream = "";
+       }
 
        if ( maxevents > 0 && iev == maxevents ) {
           printf("Reached maxevents (%d)\n", maxevents ) ;
@@ -1220,6 +1288,8 @@ int main(int argc, char* argv[])
        }
 
      } // loop over events.
+     profUtils::endEvent();
+     profUtils::sampleMemory(std::string("after ") + urls[f]);
 
      /*
        pat::METCollection puppimets;
@@ -1232,7 +1302,7 @@ int main(int argc, char* argv[])
        PFparticles.getByLabel(event, "packedPFCandidates");
      */
        
-     printf("\n");
+     nPreviousEvents += iev;
      delete file;
 
      if ( maxevents > 0 && iev == maxevents ) {
@@ -1247,7 +1317,10 @@ int main(int argc, char* argv[])
   //##############################################
   //
 
+  progress.finish();
   printf("\n\n Done with loop over input files.\n\n") ;
+  profUtils::mark(outputStage);
+  summaryStream_.close();
 
   //--- owen : Seems like trying to move the output file before the TFileService destructor
   //           is called, where Write and Close happen, sometimes results in a corrupt output file.
@@ -1263,6 +1336,7 @@ int main(int argc, char* argv[])
 
   //-- owen: explicitly call write and close before trying to move the output root file.
   fs.file().Write() ;
+  summaryHandler_.printBranchGroupSizes();
   fs.file().Close() ;
 
 
@@ -1287,6 +1361,8 @@ int main(int argc, char* argv[])
   }
 
   system(terminationCmd.Data());
+
+  if(profile!="") profUtils::writeSummary(profile);
        
 }
 
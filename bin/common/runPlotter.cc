@@ -3,14 +3,26 @@
 #include <iterator>
 #include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <cerrno>
 
  
 #include "TROOT.h"
+#include "RVersion.h"
 #include "TFile.h"
 #include "TDirectory.h"
+#include "TNamed.h"
 #include "TChain.h"
 #include "TObject.h"
 #include "TCanvas.h"
@@ -35,7 +47,9 @@
 #include "UserCode/bsmhiggs_fwk/interface/MacroUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/RootUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/JSONWrapper.h"
-#include "UserCode/bsmhiggs_fwk/interface/th1fmorph.h"
+#include "UserCode/bsmhiggs_fwk/interface/HistoMorpher.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProgressMonitor.h"
 //#include "UserCode/bsmhiggs_fwk/interface/th1fmorph.h"
 
 using namespace std;
@@ -75,11 +89,27 @@ string outFile = "/tmp/plotter.root";
 string cutflowhisto = "all_cutflow";
 string fileOption = "RECREATE";
 std::vector<string> keywords;
+int nThreads = 1;
+int plotWorkers = 1;
+string profile = "";
+string statusFile = "";
+double heartbeat = 30;
 
 //std::unordered_map<string, stSampleInfo> sampleInfoMap;
 std::unordered_map<string, std::vector<string> > MissingFiles;
 std::unordered_map<string, std::vector<string> > DSetFiles;
 
+//incremental mode: each process directory keeps a record of the inputs (size, mtime, UUID) and of the list
+//of objects it was merged from, and is only merged again when this record changes
+bool incremental = false;
+string histlistStamp = "";
+std::unordered_map<string, string> FileStamps;
+int nChangedProcesses = 0;
+
+//low memory mode: the merged objects are released as soon as they are written and the objects of the
+//output file are read back on demand (and released right after use) instead of being kept in memory
+bool lowMemory = false;
+
 
 struct NameAndType{
    std::string name;
@@ -114,6 +144,133 @@ string getDirName(JSONWrapper::Object& Process, string matchingKeyword=""){
    return dirName;
 }
 
+//index of the objects of the output file, dropped by every step that adds objects to the file
+utils::root::ObjectIndex OutputIndex;
+TObject* GetObjectFromOutput(TFile* File, const std::string& path){
+   if(!OutputIndex.isBuiltFor(File))OutputIndex.build(File);
+   return OutputIndex.get(path);
+}
+
+//an object read from disk through the output index is deleted once used, it will be read again if needed; the
+//histograms the output file holds in memory (merged by this run) are only deleted in low memory mode
+void ReleaseFromOutput(TObject* obj){
+   if(!obj)return;
+   TH1* hist = dynamic_cast<TH1*>(obj);
+   if(lowMemory || (hist && !OutputIndex.isInMemory(hist->GetDirectory(), hist->GetName())))delete obj;
+}
+
+//delete the in-memory copies of the objects of a directory (and of its subdirectories), they must have been written
+void ReleaseObjects(TDirectory* dir){
+   std::vector<TObject*> toDelete;
+   TIter next(dir->GetList());
+   while(TObject* obj = next()){
+      if(obj->InheritsFrom("TDirectory")){ ReleaseObjects((TDirectory*)obj); }else{ toDelete.push_back(obj); }
+   }
+   for(unsigned int d=0;d<toDelete.size();d++){delete toDelete[d];}
+}
+
+//print the current and peak memory of the phase that just ended, then reset the peak for the next phase
+//(some kernels ignore the reset, the peak is then the one since the start of the job)
+bool PeakMemoryNotReset = false;
+void ReportMemory(const char* phase){
+   double current = profUtils::getMemoryMB("VmRSS");
+   printf("Memory %-28s: current %8.1f MB, peak %8.1f MB%s\n", phase, current, profUtils::getMemoryMB("VmHWM"), PeakMemoryNotReset?" (since start)":"");
+   FILE* pFile = fopen("/proc/self/clear_refs", "w");
+   if(pFile){ fprintf(pFile, "5"); fclose(pFile); }
+   if(profUtils::getMemoryMB("VmHWM") > current*1.05+1)PeakMemoryNotReset = true;
+}
+
+//inventory of the input files (size, mtime, UUID, validity and list of objects), persisted in the input directory
+//so that the objects of unchanged files do not need to be discovered again at the next invocation
+struct FileInventory_t{
+   long long size;
+   long long mtime;
+   string uuid;
+   bool valid;
+   bool listed;
+   std::vector<NameAndType> objects;
+   FileInventory_t():size(-1),mtime(-1),uuid("-"),valid(false),listed(false){}
+};
+std::unordered_map<string, FileInventory_t> Inventory;
+bool InventoryChanged = false;
+std::unordered_set<string> HistlistNames;
+
+void LoadInventory(const string& path){
+   Inventory.clear();
+   InventoryChanged = false;
+   FILE* pFile = fopen(path.c_str(), "r");
+   if(!pFile)return;
+   char line[4096];
+   FileInventory_t* current = NULL;
+   while(fgets(line, sizeof(line), pFile)){
+      size_t len = strlen(line); while(len>0 && (line[len-1]=='\n' || line[len-1]=='\r'))line[--len]='\0';
+      long long size, mtime; int valid, listed, type, isIndex; char uuid[64]; int offset=0;
+      if(sscanf(line, "file %lld %lld %d %d %63s %n", &size, &mtime, &valid, &listed, uuid, &offset)==5 && offset>0){
+         current = &Inventory[line+offset];
+         current->size = size; current->mtime = mtime; current->uuid = uuid;
+         current->valid = valid; current->listed = listed; current->objects.clear();
+      }else if(current && sscanf(line, "obj %d %d %n", &type, &isIndex, &offset)==2 && offset>0){
+         current->objects.push_back(NameAndType(line+offset, type, isIndex));
+      }
+   }
+   fclose(pFile);
+   printf("Reusing the inventory of %lu input files from %s\n", (unsigned long)Inventory.size(), path.c_str());
+}
+
+void SaveInventory(const string& path){
+   if(!InventoryChanged)return;
+   string tmpPath = path + ".tmp";
+   FILE* pFile = fopen(tmpPath.c_str(), "w");
+   if(!pFile){ printf("Can not write the inventory of the input files to %s\n", path.c_str()); return; }
+   for(std::unordered_map<string, FileInventory_t>::iterator it=Inventory.begin(); it!=Inventory.end(); it++){
+      struct stat st; if(stat(it->first.c_str(), &st)!=0)continue; //drop the files that are gone
+      fprintf(pFile, "file %lld %lld %d %d %s %s\n", it->second.size, it->second.mtime, (int)it->second.valid, (int)it->second.listed, it->second.uuid.c_str(), it->first.c_str());
+      for(unsigned int o=0;o<it->second.objects.size();o++){
+         fprintf(pFile, "obj %d %d %s\n", it->second.objects[o].type, (int)it->second.objects[o].isIndexPlot, it->second.objects[o].name.c_str());
+      }
+   }
+   fclose(pFile);
+   if(rename(tmpPath.c_str(), path.c_str())!=0){ printf("Can not write the inventory of the input files to %s\n", path.c_str()); remove(tmpPath.c_str()); }
+   InventoryChanged = false;
+}
+
+//append the objects to the list, skipping the names that are already known
+void AddToHistlist(std::list<NameAndType>& histlist, const std::vector<NameAndType>& objects){
+   for(unsigned int o=0;o<objects.size();o++){
+      if(HistlistNames.insert(objects[o].name).second)histlist.push_back(objects[o]);
+   }
+}
+
+//recursively list the histograms and trees of a directory, the type is taken from the key and only histograms are read (to check for the cut index axis)
+void ListObjects(TDirectory* dir, std::string parentPath, std::vector<NameAndType>& objects){
+   TList* list = dir->GetListOfKeys();
+   for(int i=0;i<list->GetSize();i++){
+      TKey* key = (TKey*)list->At(i);
+      TClass* cl = TClass::GetClass(key->GetClassName());
+//      printf("check object %s:%s\n", parentPath.c_str(), key->GetName());
+
+      if(cl && cl->InheritsFrom("TDirectory")){
+         TDirectory* subdir = dir->GetDirectory(key->GetName());
+         if(subdir)ListObjects(subdir, parentPath+ key->GetName()+"/", objects);
+      }else if(cl && cl->InheritsFrom("TTree")){ 
+        printf("found one object inheriting from a ttree\n");
+        objects.push_back(NameAndType(parentPath+key->GetName(), 4, false ) );
+      }else if(cl && cl->InheritsFrom("TH1")){
+        int  type = 0;
+        if(cl->InheritsFrom("TH1")) type++;
+        if(cl->InheritsFrom("TH2")) type++;
+        if(cl->InheritsFrom("TH3")) type++;
+        TH1* tmp = (TH1*)key->ReadObj();
+        bool hasIndex = tmp && string(tmp->GetXaxis()->GetTitle()).find("cut index")<string::npos;
+        if(hasIndex){type=1;}
+        objects.push_back(NameAndType(parentPath+key->GetName(), type, hasIndex ) );
+        delete tmp;
+      }else if(string(key->GetName())!="plotterInputs"){
+        printf("The file contain an unknown object named %s\n", key->GetName() );
+      }
+   }
+}
+
 void GetListOfObject(JSONWrapper::Object& Root, std::string RootDir, std::list<NameAndType>& histlist, std::string parentPath="/",  TDirectory* dir=NULL){
 
    if(parentPath=="/"){
@@ -121,6 +278,11 @@ void GetListOfObject(JSONWrapper::Object& Root, std::string RootDir, std::list<N
       int signProcessed = 0;
       int bckgProcessed = 0; 
 
+      HistlistNames.clear();
+      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++)HistlistNames.insert(it->name);
+      string inventoryPath = RootDir + "plotterInventory.txt";
+      LoadInventory(inventoryPath);
+
       std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
       for(size_t ip=0; ip<Process.size(); ip++){
          if(Process[ip].isTag("interpollation") || Process[ip].isTag("mixing") || Process[ip].isTag("nosample"))continue; //treated in a specific function after the loop on Process
@@ -128,7 +290,7 @@ void GetListOfObject(JSONWrapper::Object& Root, std::string RootDir, std::list<N
          if(!utils::root::getMatchingKeyword(Process[ip], keywords, matchingKeyword))continue; //only consider samples passing key filtering
          string dirName = getDirName(Process[ip], matchingKeyword);
 
-         if(dir){  //check if a directory already exist for this process in the output file
+         if(dir && !incremental){  //check if a directory already exist for this process in the output file (in incremental mode the inputs are always listed, to detect changes)
             TObject* tmp = utils::root::GetObjectFromPath(dir,dirName,false);
             if(tmp && tmp->InheritsFrom("TDirectory")){
                printf("Adding all objects from %25s to the list of considered objects:\n",  dirName.c_str());
@@ -161,31 +323,55 @@ void GetListOfObject(JSONWrapper::Object& Root, std::string RootDir, std::list<N
                  }
                  FileName += ".root";
 
-                 FILE* pFile = fopen(FileName.c_str(), "r");  //check if the file exist
-                 if(!pFile){MissingFiles[dtag].push_back(FileName); continue;}else{fclose(pFile);}
-
-                 TFile* File = new TFile(FileName.c_str());                                 
-                 if(!File || File->IsZombie() || !File->IsOpen() || File->TestBit(TFile::kRecovered) ){
+                 struct stat st;  //check if the file exist
+                 if(stat(FileName.c_str(), &st)!=0){MissingFiles[dtag].push_back(FileName); continue;}
+
+                 //only open the files that changed since the last inventory
+                 TFile* File = NULL;
+                 FileInventory_t& inv = Inventory[FileName];
+                 if(inv.size!=(long long)st.st_size || inv.mtime!=(long long)st.st_mtime){
+                    inv = FileInventory_t();
+                    inv.size  = st.st_size;
+                    inv.mtime = st.st_mtime;
+                    File = new TFile(FileName.c_str());
+                    inv.valid = File && !File->IsZombie() && File->IsOpen() && !File->TestBit(TFile::kRecovered);
+                    if(inv.valid)inv.uuid = File->GetUUID().AsString();
+                    InventoryChanged = true;
+                 }
+                 if(!inv.valid){
                     MissingFiles[dtag].push_back(FileName);
+                    delete File;
                     continue; 
                  }else{
                     DSetFiles[dtag+filtExt].push_back(FileName);
+                    if(incremental){
+                       char stamp[512]; sprintf(stamp, "%lld %lld %s", inv.size, inv.mtime, inv.uuid.c_str());
+                       FileStamps[FileName] = stamp;
+                    }
                  }
 
-                 if(fileProcessed%5!=0){File->Close();fileProcessed++;continue;} //only consider 1file every 5 of each sample to get the list of object 
+                 if(fileProcessed%5!=0){delete File;fileProcessed++;continue;} //only consider 1file every 5 of each sample to get the list of object 
  
                  //just to make it faster, only consider the first 3 sample of a same kind
-                 if(fileProcessed==0 && isData){if(dataProcessed>=20 ){ File->Close(); continue;}else{dataProcessed++;}}
-                 if(fileProcessed==0 && isSign){if(signProcessed>=20 ){ File->Close(); continue;}else{signProcessed++;}}
-                 if(fileProcessed==0 && isMC  ){if(bckgProcessed>=20 ){ File->Close(); continue;}else{bckgProcessed++;}}
+                 if(fileProcessed==0 && isData){if(dataProcessed>=20 ){ delete File; continue;}else{dataProcessed++;}}
+                 if(fileProcessed==0 && isSign){if(signProcessed>=20 ){ delete File; continue;}else{signProcessed++;}}
+                 if(fileProcessed==0 && isMC  ){if(bckgProcessed>=20 ){ delete File; continue;}else{bckgProcessed++;}}
                  fileProcessed++;
 
-                 printf("Adding all objects from %25s to the list of considered objects:\n",  FileName.c_str());
-                 GetListOfObject(Root,RootDir,histlist,"", (TDirectory*)File );
-                 File->Close();
+                 if(!inv.listed){
+                    if(!File)File = new TFile(FileName.c_str());
+                    printf("Adding all objects from %25s to the list of considered objects:\n",  FileName.c_str());
+                    inv.objects.clear();
+                    ListObjects(File, "", inv.objects);
+                    inv.listed = true;
+                    InventoryChanged = true;
+                 }
+                 AddToHistlist(histlist, inv.objects);
+                 delete File;
                }
             }          
       }
+      SaveInventory(inventoryPath);
 
       if(MissingFiles.size()>0){
          printf("The list of missing or corrupted files, that are ignored, can be found below:\n");
@@ -202,352 +388,536 @@ void GetListOfObject(JSONWrapper::Object& Root, std::string RootDir, std::list<N
       return;
 
    }else if(dir){
-      TList* list = dir->GetListOfKeys();
-      for(int i=0;i<list->GetSize();i++){
-         TObject* tmp = utils::root::GetObjectFromPath(dir,list->At(i)->GetName(),false);
-   //      printf("check object %s:%s\n", parentPath.c_str(), list->At(i)->GetName());
-
-         if(tmp->InheritsFrom("TDirectory")){
-            GetListOfObject(Root,RootDir,histlist,parentPath+ list->At(i)->GetName()+"/",(TDirectory*)tmp);
-         }else if(tmp->InheritsFrom("TTree")){ 
-           printf("found one object inheriting from a ttree\n");
-           histlist.push_back(NameAndType(parentPath+list->At(i)->GetName(), 4, false ) );
-         }else if(tmp->InheritsFrom("TH1")){
-           int  type = 0;
-           if(tmp->InheritsFrom("TH1")) type++;
-           if(tmp->InheritsFrom("TH2")) type++;
-           if(tmp->InheritsFrom("TH3")) type++;
-           bool hasIndex = string(((TH1*)tmp)->GetXaxis()->GetTitle()).find("cut index")<string::npos;
-           if(hasIndex){type=1;}
-           histlist.push_back(NameAndType(parentPath+list->At(i)->GetName(), type, hasIndex ) );
-         }else{
-           printf("The file contain an unknown object named %s\n", list->At(i)->GetName() );
-         }
-         delete tmp;
-      }
+      std::vector<NameAndType> objects;
+      ListObjects(dir, parentPath, objects);
+      AddToHistlist(histlist, objects);
   }
 
 }
 
 
-void MixProcess(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist){    
-   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
-   for(unsigned int i=0;i<Process.size();i++){
-      if(!Process[i].isTag("mixing"))continue; //only consider intepollated processes
-      string matchingKeyword="";
-      if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
+//
+// Derived processes (interpolated signals, sums of the jet bins, mixed and NRB processes) are built from a graph
+// of (process, histogram) nodes. The processes are planned in the order of the former sequential steps
+// (interpolation, sums, mixing, NRB) and each one gets a level: one more than the highest level of the processes it
+// reads, the merged processes having level 0. The nodes of a level only read objects written by lower levels, so
+// they are computed concurrently (--nThreads) by workers that each open their own read-only copy of the output
+// file. The results are always written by the main thread in the order of the nodes, whatever the scheduling.
+//
+enum DerivedKind_t{ kInterpollated=0, kSumBins, kMixed, kNRB };
+
+struct DerivedProcess_t{
+   int kind;
+   int level;
+   string dirName;
+   string matchingKeyword;
+   size_t process;                                       //index in the list of processes, for the style
+   std::vector<std::pair<string, double> > subProcList;  //input directories and their scale (left and right signal for the interpolation)
+   double mass, massL, massR, xsecXbr, xsecXbrL, xsecXbrR;
+};
 
-      string dirName = getDirName(Process[i], matchingKeyword);
-      File->cd();
- 
-      TDirectory* subdir = File->GetDirectory(dirName.c_str());
-      if(subdir && subdir!=File){
-         printf("Skip process %s as it seems to be already processed\n", dirName.c_str());
-         continue;  //skip this process as it already exist in the file
-      }
+struct DerivedNode_t{
+   size_t process;  //index in the list of derived processes
+   NameAndType* histo;
+   string outName;
+};
 
-      
-      //check that the subProcess actually point to an existing directory
-      std::vector<JSONWrapper::Object> subProcess = Process[i]["mixing"].daughters();     
-      std::vector<std::pair<string, double> > subProcList;
-      for(unsigned int sp=0;sp<subProcess.size();sp++){
-         string subProcDir = subProcess[sp].getString("tag", "");
-         if(!File->GetDirectory(subProcDir.c_str())){printf("subprocess directory not found: %s\n", subProcDir.c_str()); continue;}
-         subProcList.push_back(std::make_pair(subProcDir, subProcess[sp].getDouble("scale", 1.0)) );
+//inputs read by the workers are always owned, those read from the output file by the main thread follow ReleaseFromOutput
+void ReleaseInput(TObject* obj, bool ownInputs){
+   if(ownInputs)delete obj; else ReleaseFromOutput(obj);
+}
+
+//compute one node from the objects reached through index, the result is detached from any directory (NULL if nothing to write)
+//tmpSuffix keeps the names of the temporary histograms unique between concurrent workers
+TH1* ComputeDerivedNode(const DerivedProcess_t& proc, NameAndType& HistoProperties, utils::root::ObjectIndex& index, bool ownInputs, const string& tmpSuffix){
+   const std::vector<std::pair<string, double> >& subProcList = proc.subProcList;
+   TH1* result = NULL;
+
+   if(proc.kind==kMixed){
+      TH1* obj1 = (TH1*)index.get(subProcList[0].first + "/" + HistoProperties.name);      
+      if(!obj1)return NULL;
+      TH1* sum = (TH1*)obj1->Clone(HistoProperties.name.c_str());
+      sum->SetDirectory(0);
+      ReleaseInput(obj1, ownInputs);
+      utils::root::checkSumw2(sum);
+      sum->Scale(subProcList[0].second);
+
+      for(unsigned int sp=1;sp<subProcList.size();sp++){
+         TH1* obj2 = (TH1*)index.get(subProcList[sp].first + "/" + HistoProperties.name);
+         if(!obj2)continue;
+         sum->Add(obj2, subProcList[sp].second);
+         ReleaseInput(obj2, ownInputs);
+      }
+      result = CheckPositiveBins(sum, HistoProperties.name.c_str()); 
+      delete sum;
+
+   }else if(proc.kind==kNRB){
+      TH1* obj1 = (TH1*)index.get(subProcList[0].first + "/" + HistoProperties.name);      
+      if(!obj1)return NULL;
+      result = (TH1*)obj1->Clone(HistoProperties.name.c_str());
+      result->SetDirectory(0);
+      ReleaseInput(obj1, ownInputs);
+      utils::root::checkSumw2(result);
+      result->Reset();
+
+      //std::vector<std::pair<string,double>> channels = {std::make_pair("ee",0.36), std::make_pair("mumu",0.77), std::make_pair("ll",0.36+0.77)}; //2015 data
+      std::vector<std::pair<string,double>> channels = {std::make_pair("ee",0.369), std::make_pair("mumu",0.683), std::make_pair("ll",0.369+0.683)}; //2016 data
+      for(auto ch=channels.begin();ch!=channels.end();ch++){
+         if(HistoProperties.name.find(ch->first)==0){
+            std::string emName = HistoProperties.name;  emName.replace(0,ch->first.size(),"emu");
+            for(unsigned int sp=0;sp<subProcList.size();sp++){
+               TH1* obj2 = (TH1*)index.get(subProcList[sp].first + "/" + emName);
+               if(!obj2)continue;
+               result->Add(obj2, subProcList[sp].second*ch->second);
+               ReleaseInput(obj2, ownInputs);
+            }
+         }
       }
-      if(subProcList.size()<=0){printf("No subProcess defined to construct the mixed process %s\n", dirName.c_str()); continue;  };
 
-      //create the directory to host the results
-      subdir = File->mkdir(dirName.c_str());
-      subdir->cd();
+   }else if(proc.kind==kSumBins){
+      TString Incname = HistoProperties.name.c_str();   Incname.ReplaceAll("geq1jets_", "_");
+      if(index.contains(proc.dirName + "/" + Incname.Data()))return NULL; //inc. histo already exist
+
+      TH1* obj1 = (TH1*)index.get(proc.dirName + "/" + HistoProperties.name);      
+      if(!obj1)return NULL;
+      result = (TH1*)obj1->Clone(HistoProperties.name.c_str());
+      result->SetDirectory(0);
+      ReleaseInput(obj1, ownInputs);
+      utils::root::checkSumw2(result);
+
+      //add eq0jets and vbf
+      const char* bins[] = {"eq0jets_", "vbf_"};
+      for(unsigned int b=0;b<2;b++){
+         TString name = HistoProperties.name.c_str();   name.ReplaceAll("geq1jets_", bins[b]);
+         TH1* obj2 = (TH1*)index.get(proc.dirName + "/" + name.Data());
+         if(!obj2){delete result; return NULL;}
+         result->Add(obj2, 1);
+         ReleaseInput(obj2, ownInputs);
+      }
 
-      int ictr = 0;
-      int TreeStep = std::max(1,(int)(histlist.size()/50));
-      printf("Mixing %20s :", dirName.c_str());
-      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
-         if(ictr%TreeStep==0){printf(".");fflush(stdout);}
-         NameAndType& HistoProperties = *it;        
-	  
-         TH1* obj1_new = NULL;
-         TH1* obj1 = (TH1*)utils::root::GetObjectFromPath(File,subProcList[0].first + "/" + HistoProperties.name);      
-         if(!obj1)continue;
-         obj1 = (TH1*)obj1->Clone(HistoProperties.name.c_str());
-         utils::root::checkSumw2(obj1);
-         obj1->Scale(subProcList[0].second);
-
-         for(unsigned int sp=1;sp<subProcList.size();sp++){
-            TH1* obj2 = (TH1*)utils::root::GetObjectFromPath(File,subProcList[sp].first + "/" + HistoProperties.name);
-            if(!obj2)continue;
-            obj1->Add(obj2, subProcList[sp].second);
+   }else if(proc.kind==kInterpollated){
+      TH1* objL = (TH1*)index.get(subProcList[0].first + "/" + HistoProperties.name);      
+      TH1* objR = (TH1*)index.get(subProcList[1].first + "/" + HistoProperties.name);      
+      if(!objL || !objR){ReleaseInput(objL, ownInputs); ReleaseInput(objR, ownInputs); return NULL;}
+      double Ratio = (proc.mass - proc.massL)/(proc.massR - proc.massL);
+
+      //the inputs are rescaled in place, they are always deleted afterward
+      if(HistoProperties.isIndexPlot){
+         TH2F* histo2DL = (TH2F*) objL;
+         TH2F* histo2DR = (TH2F*) objR;
+         histo2DL->Scale(1.0/proc.xsecXbrL);
+         histo2DR->Scale(1.0/proc.xsecXbrR);
+         TH2F* histo2D  = (TH2F*) histo2DL->Clone(histo2DL->GetName());
+         histo2D->SetDirectory(0);
+         histo2D->Reset();
+
+         //all the projections have the same binning, the merged output binning is computed only once
+         std::shared_ptr<HistoMorpher> binningRef;
+         std::vector<double> morphed;
+         for(unsigned int cutIndex=0;cutIndex<=(unsigned int)(histo2DL->GetNbinsX()+1);cutIndex++){
+            TH1D* histoL = histo2DL->ProjectionY(("tempL"+tmpSuffix).c_str(), cutIndex, cutIndex);
+            TH1D* histoR = histo2DR->ProjectionY(("tempR"+tmpSuffix).c_str(), cutIndex, cutIndex);
+            if(histoL->GetSum() >0 && histoR->GetSum()>0){  //Important
+               std::shared_ptr<HistoMorpher> morpher(new HistoMorpher(histoL, histoR, proc.massL, proc.massR, binningRef.get()));
+               if(!binningRef) binningRef = morpher;
+               morphed.assign(morpher->nBins(), 0.);
+               morpher->morph(proc.mass, (1-Ratio)*histoL->Integral() + Ratio*histoR->Integral(), morphed.data());
+               //the morphed shape has no sum of weights squared, its errors are sqrt(|content|) and its under/overflow are empty
+               for(unsigned int y=0;y<=(unsigned int)(histo2DL->GetNbinsY()+1);y++){
+                 double content = (y>=1 && y<=morphed.size()) ? morphed[y-1] : 0.;
+                 histo2D->SetBinContent(cutIndex, y, content);
+                 histo2D->SetBinError(cutIndex, y, sqrt(fabs(content)));
+               }
+            }
+            delete histoR;
+            delete histoL;
          }
-         utils::root::setStyleFromKeyword(matchingKeyword,Process[i], obj1);
-      	
-         obj1_new = CheckPositiveBins( obj1, HistoProperties.name.c_str()); 
-         subdir->cd();
-         obj1_new->Write(HistoProperties.name.c_str());
-         gROOT->cd();
-         delete obj1_new;
-      }printf("\n");
+         histo2D->Scale(proc.xsecXbr);
+         result = histo2D;
+      }else if(HistoProperties.is1D()){
+         TH1F* histoL = (TH1F*) objL;
+         TH1F* histoR = (TH1F*) objR;
+         if(histoL->GetSum() >0 && histoR->GetSum()>0){  //Important
+            histoL->Scale(1.0/proc.xsecXbrL);
+            histoR->Scale(1.0/proc.xsecXbrR);
+            if(histoL->Integral()>0 && histoR->Integral()>0){            
+               double Integral = (1-Ratio)*histoL->Integral() + Ratio*histoR->Integral();               
+               TH1F* histo  = (TH1F*)histoL->Clone(HistoProperties.name.c_str());
+               histo->SetDirectory(0);
+               histo->Reset();
+               HistoMorpher morpher(histoL, histoR, proc.massL, proc.massR);
+               morpher.addTo(histo, proc.mass, Integral);
+               histo->Scale(proc.xsecXbr);          
+               result = histo;
+            }
+         }
+      }
+      delete objL;
+      delete objR;
    }
-}
-
-
 
-void NRBProcess(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist){    
-   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
-   for(unsigned int i=0;i<Process.size();i++){
-      if(!Process[i].isTag("NRB"))continue; //only consider intepollated processes
-      string matchingKeyword="";
-      if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
+   if(result)result->SetDirectory(0);
+   return result;
+}
 
-      string dirName = getDirName(Process[i], matchingKeyword);
-      File->cd();
- 
-      TDirectory* subdir = File->GetDirectory(dirName.c_str());
-      if(subdir && subdir!=File){
-         printf("Skip process %s as it seems to be already processed\n", dirName.c_str());
-         continue;  //skip this process as it already exist in the file
+//
+// Computes the nodes of one level with a pool of threads, each worker reading its own read-only copy of the output
+// file. At most 'window' nodes are computed ahead of the consumer and the results are handed back in order.
+class DerivedNodeRunner{
+   public:
+      DerivedNodeRunner(const std::vector<DerivedProcess_t>& procs, const std::vector<DerivedNode_t>& nodes, const std::vector<size_t>& order, int nWorkers):
+         procs_(procs), nodes_(nodes), order_(order), results_(order.size(), NULL), ready_(order.size(), false), next_(0), consumed_(0), window_(2*nWorkers), opened_(0)
+      {
+         int n = std::min(nWorkers, (int)order.size());
+         for(int w=0;w<n;w++){ workers_.push_back(std::thread(&DerivedNodeRunner::work, this, w)); }
+         //the main thread only starts writing once all the workers have read the state of the file
+         std::unique_lock<std::mutex> lock(mutex_);
+         while(opened_<n) cond_.wait(lock);
       }
 
-      
-      //check that the subProcess actually point to an existing directory
-      std::vector<JSONWrapper::Object> subProcess = Process[i]["NRB"].daughters();     
-      std::vector<std::pair<string, double> > subProcList;
-      for(unsigned int sp=0;sp<subProcess.size();sp++){
-         string subProcDir = subProcess[sp].getString("tag", "");
-         if(!File->GetDirectory(subProcDir.c_str())){printf("subprocess directory not found: %s\n", subProcDir.c_str()); continue;}
-         subProcList.push_back(std::make_pair(subProcDir, subProcess[sp].getDouble("scale", 1.0)) );
+      ~DerivedNodeRunner(){
+         { std::unique_lock<std::mutex> lock(mutex_); next_ = order_.size(); } //stop handing out new nodes
+         cond_.notify_all();
+         for(size_t w=0;w<workers_.size();w++){ workers_[w].join(); }
+         for(size_t k=0;k<results_.size();k++){ delete results_[k]; }
       }
-      if(subProcList.size()<=0){printf("No subProcess defined to construct the mixed process %s\n", dirName.c_str()); continue;  };
 
-      //create the directory to host the results
-      subdir = File->mkdir(dirName.c_str());
-      subdir->cd();
+      //result of the k-th node of the level (NULL if there is nothing to write); the caller owns it
+      TH1* get(size_t k){
+         std::unique_lock<std::mutex> lock(mutex_);
+         while(!ready_[k]) cond_.wait(lock);
+         TH1* toReturn = results_[k];
+         results_[k] = NULL;
+         consumed_ = k+1;
+         cond_.notify_all();
+         return toReturn;
+      }
 
-      int ictr = 0;
-      int TreeStep = std::max(1,(int)(histlist.size()/50));
-      printf("NRB %20s :", dirName.c_str());
-      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
-         if(ictr%TreeStep==0){printf(".");fflush(stdout);}
-         NameAndType& HistoProperties = *it;        
-        
-         TH1* obj1 = (TH1*)utils::root::GetObjectFromPath(File,subProcList[0].first + "/" + HistoProperties.name);      
-         if(!obj1)continue;
-         obj1 = (TH1*)obj1->Clone(HistoProperties.name.c_str());
-         utils::root::checkSumw2(obj1);
-         obj1->Reset();
-
-         //std::vector<std::pair<string,double>> channels = {std::make_pair("ee",0.36), std::make_pair("mumu",0.77), std::make_pair("ll",0.36+0.77)}; //2015 data
-         std::vector<std::pair<string,double>> channels = {std::make_pair("ee",0.369), std::make_pair("mumu",0.683), std::make_pair("ll",0.369+0.683)}; //2016 data
-         for(auto ch=channels.begin();ch!=channels.end();ch++){
-            if(HistoProperties.name.find(ch->first)==0){
-               std::string emName = HistoProperties.name;  emName.replace(0,ch->first.size(),"emu");
-               for(unsigned int sp=0;sp<subProcList.size();sp++){
-                  TH1* obj2 = (TH1*)utils::root::GetObjectFromPath(File,subProcList[sp].first + "/" + emName);
-                  if(!obj2)continue;
-                  obj1->Add(obj2, subProcList[sp].second*ch->second);
-               }
+   private:
+      void work(int worker){
+         TFile* File = new TFile(outFile.c_str(), "READ");
+         utils::root::ObjectIndex index(File);
+         char suffix[32]; sprintf(suffix, "_worker%d", worker);
+         { std::unique_lock<std::mutex> lock(mutex_); opened_++; }
+         cond_.notify_all();
+
+         while(true){
+            size_t k;
+            {
+               std::unique_lock<std::mutex> lock(mutex_);
+               while(next_<order_.size() && next_>=consumed_+window_) cond_.wait(lock);
+               if(next_>=order_.size()) break;
+               k = next_++;
             }
+
+            const DerivedNode_t& node = nodes_[order_[k]];
+            TH1* result = ComputeDerivedNode(procs_[node.process], *node.histo, index, true, suffix);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            results_[k] = result;
+            ready_[k] = true;
+            cond_.notify_all();
          }
-         utils::root::setStyleFromKeyword(matchingKeyword,Process[i], obj1);
-        
-         subdir->cd();
-         obj1->Write(HistoProperties.name.c_str());
-         gROOT->cd();
-         delete obj1;
-      }printf("\n");
-   }
-}
+         delete File;
+      }
 
+      const std::vector<DerivedProcess_t>& procs_;
+      const std::vector<DerivedNode_t>& nodes_;
+      const std::vector<size_t>& order_;
+      std::vector<TH1*> results_;
+      std::vector<bool> ready_;
+      size_t next_, consumed_, window_;
+      int opened_;
+      std::vector<std::thread> workers_;
+      std::mutex mutex_;
+      std::condition_variable cond_;
+};
 
+//a directory of the output file or one planned for a derived process
+bool ProcessExists(TFile* File, const string& dirName, std::unordered_map<string, int>& dirLevel){
+   if(dirLevel.find(dirName)!=dirLevel.end())return true;
+   TDirectory* subdir = File->GetDirectory(dirName.c_str());
+   return subdir && subdir!=File;
+}
 
-void SumBins(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist){    
-   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
-   for(unsigned int i=0;i<Process.size();i++){
-      string matchingKeyword="";
-      if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
+int ProcessLevel(const string& dirName, std::unordered_map<string, int>& dirLevel){
+   std::unordered_map<string, int>::iterator it = dirLevel.find(dirName);
+   return it==dirLevel.end() ? 0 : it->second;
+}
 
-      string dirName = getDirName(Process[i], matchingKeyword);
-      File->cd();
- 
-      TDirectory* subdir = File->GetDirectory(dirName.c_str());
-      if(! (subdir && subdir!=File)){
-         printf("skip missing process %s\n", dirName.c_str());
-         continue;
-      }
-      subdir->cd();
+//list the derived processes (creating their directories) and one node per histogram
+void PlanDerivedProcesses(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist, std::vector<DerivedProcess_t>& procs, std::vector<DerivedNode_t>& nodes){
+   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
+   std::unordered_map<string, int> dirLevel; //level of the planned processes
+   const char* stageTags[] = {"interpollation", "", "mixing", "NRB"};
 
-      int ictr = 0;
-      int TreeStep = std::max(1,(int)(histlist.size()/50));
-      printf("Sum %20s :", dirName.c_str());
-      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
-         if(ictr%TreeStep==0){printf(".");fflush(stdout);}
-         NameAndType& HistoProperties = *it;        
-
-         if( HistoProperties.name.find("geq1jets_")!=std::string::npos){  //only consider llgeq1jets
-
-            TString Incname = HistoProperties.name.c_str();   Incname.ReplaceAll("geq1jets_", "_");
-            if(utils::root::GetObjectFromPath(File,dirName + "/" + Incname.Data())!=NULL)continue; //inc. histo already exist
-
-        
-            TH1* obj1 = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name);      
-            if(!obj1)continue;
-            obj1 = (TH1*)obj1->Clone(HistoProperties.name.c_str());
-            utils::root::checkSumw2(obj1);
-
-            //add eq0jets
-            if(true){
-               TString name = HistoProperties.name.c_str();   name.ReplaceAll("geq1jets_", "eq0jets_");
-               TH1* obj2 = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + name.Data());
-               if(!obj2)continue;
-               obj1->Add(obj2, 1);
+   for(int kind=kInterpollated; kind<=kNRB; kind++){
+      if(kind==kInterpollated && !doInterpollation)continue;
+      for(unsigned int i=0;i<Process.size();i++){
+         if(kind!=kSumBins && !Process[i].isTag(stageTags[kind]))continue;
+         string matchingKeyword="";
+         if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
+
+         DerivedProcess_t proc;
+         proc.kind = kind;
+         proc.dirName = getDirName(Process[i], matchingKeyword);
+         proc.matchingKeyword = matchingKeyword;
+         proc.process = i;
+         proc.mass = proc.massL = proc.massR = 0;
+         proc.xsecXbr = proc.xsecXbrL = proc.xsecXbrR = 1.0;
+
+         if(kind==kSumBins){ //the inclusive histograms are added to the existing processes
+            if(!ProcessExists(File, proc.dirName, dirLevel)){
+               printf("skip missing process %s\n", proc.dirName.c_str());
+               continue;
+            }
+            proc.level = ProcessLevel(proc.dirName, dirLevel) + 1;
+            dirLevel[proc.dirName] = proc.level;  //later processes reading this one see the inclusive histograms
+         }else{
+            if(ProcessExists(File, proc.dirName, dirLevel)){
+               printf("Skip process %s as it seems to be already processed\n", proc.dirName.c_str());
+               continue;  //skip this process as it already exist in the file
             }
 
-            //add vbf
-            if(true){
-               TString name = HistoProperties.name.c_str();   name.ReplaceAll("geq1jets_", "vbf_");
-               TH1* obj2 = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + name.Data());
-               if(!obj2)continue;
-               obj1->Add(obj2, 1);
+            if(kind==kInterpollated){
+               string signalL  = Process[i]["interpollation"][0]["tagLeft"].c_str();
+               string signalR  = Process[i]["interpollation"][0]["tagRight"].c_str();
+               proc.mass     = Process[i]["interpollation"][0]["mass"].toDouble();
+               proc.massL    = Process[i]["interpollation"][0]["massLeft"].toDouble();
+               proc.massR    = Process[i]["interpollation"][0]["massRight"].toDouble();
+               proc.xsecXbr  = utils::root::getXsecXbr(Process[i]);
+               proc.xsecXbrL = proc.xsecXbr;  for(unsigned int j=0;j<Process.size();j++){if(Process[j]["tag"].c_str()==signalL){proc.xsecXbrL = utils::root::getXsecXbr(Process[j]); break;}}
+               proc.xsecXbrR = proc.xsecXbr;  for(unsigned int j=0;j<Process.size();j++){if(Process[j]["tag"].c_str()==signalR){proc.xsecXbrR = utils::root::getXsecXbr(Process[j]); break;}}
+               while(signalL.find("/")!=std::string::npos)signalL.replace(signalL.find("/"),1,"-");
+               while(signalR.find("/")!=std::string::npos)signalR.replace(signalR.find("/"),1,"-");
+               proc.subProcList.push_back(std::make_pair(signalL, 1.0));
+               proc.subProcList.push_back(std::make_pair(signalR, 1.0));
+            }else{
+               //check that the subProcess actually point to an existing directory
+               std::vector<JSONWrapper::Object> subProcess = Process[i][stageTags[kind]].daughters();     
+               for(unsigned int sp=0;sp<subProcess.size();sp++){
+                  string subProcDir = subProcess[sp].getString("tag", "");
+                  if(!ProcessExists(File, subProcDir, dirLevel)){printf("subprocess directory not found: %s\n", subProcDir.c_str()); continue;}
+                  proc.subProcList.push_back(std::make_pair(subProcDir, subProcess[sp].getDouble("scale", 1.0)) );
+               }
+               if(proc.subProcList.size()<=0){printf("No subProcess defined to construct the mixed process %s\n", proc.dirName.c_str()); continue;  };
             }
 
-            utils::root::setStyleFromKeyword(matchingKeyword,Process[i], obj1);
-           
-            subdir->cd();
+            proc.level = 1;
+            for(unsigned int sp=0;sp<proc.subProcList.size();sp++){ proc.level = std::max(proc.level, ProcessLevel(proc.subProcList[sp].first, dirLevel)+1); }
+            dirLevel[proc.dirName] = proc.level;
+
+            //create the directory to host the results
+            File->mkdir(proc.dirName.c_str());
+         }
 
-            obj1->Write(Incname.Data());
-            gROOT->cd();
-            delete obj1;
+         procs.push_back(proc);
+         for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++){
+            DerivedNode_t node;
+            node.process = procs.size()-1;
+            node.histo = &(*it);
+            node.outName = it->name;
+            if(kind==kSumBins){
+               if(it->name.find("geq1jets_")==std::string::npos)continue;  //only consider llgeq1jets
+               TString Incname = it->name.c_str();   Incname.ReplaceAll("geq1jets_", "_");
+               node.outName = Incname.Data();
+            }
+            nodes.push_back(node);
          }
-      }printf("\n");
+      }
    }
 }
 
+//build all the derived processes, level by level; returns the output file (it is reopened when workers are used)
+TFile* BuildDerivedProcesses(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist){
+   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
+   std::vector<DerivedProcess_t> procs;
+   std::vector<DerivedNode_t> nodes;
+   PlanDerivedProcesses(Root, File, histlist, procs, nodes);
+
+   int maxLevel = 0;
+   for(unsigned int p=0;p<procs.size();p++){ maxLevel = std::max(maxLevel, procs[p].level); }
+
+   for(int level=1; level<=maxLevel; level++){
+      std::vector<size_t> order;
+      for(unsigned int n=0;n<nodes.size();n++){ if(procs[nodes[n].process].level==level)order.push_back(n); }
+      if(order.empty())continue;
+
+      int TreeStep = std::max(1,(int)(order.size()/50));
+      printf("Derived processes (level %d) :", level);
+      DerivedNodeRunner* runner = NULL;
+      if(nThreads>1){
+         //the workers read the file from disk: close it so that everything written so far is visible
+         File->Close();
+         delete File;
+         File = new TFile(outFile.c_str(), "UPDATE");
+         OutputIndex.clear();
+         runner = new DerivedNodeRunner(procs, nodes, order, nThreads);
+      }else if(!OutputIndex.isBuiltFor(File)){
+         OutputIndex.build(File);
+      }
 
+      for(unsigned int k=0;k<order.size();k++){
+         if(k%TreeStep==0){printf(".");fflush(stdout);}
+         DerivedNode_t& node = nodes[order[k]];
+         DerivedProcess_t& proc = procs[node.process];
+         TH1* result = runner ? runner->get(k) : ComputeDerivedNode(proc, *node.histo, OutputIndex, false, "");
+         if(!result)continue;
 
+         if(proc.kind!=kInterpollated)utils::root::setStyleFromKeyword(proc.matchingKeyword, Process[proc.process], result);
+         File->GetDirectory(proc.dirName.c_str())->cd();
+         result->Write(node.outName.c_str());
+         gROOT->cd();
+         delete result;
+      }
+      delete runner;
+      printf("\n");
+      OutputIndex.clear(); //objects were added to the output file
+   }
+   return File;
+}
 
 
-void InterpollateProcess(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist){    
-   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
-   for(unsigned int i=0;i<Process.size();i++){
-      if(!Process[i].isTag("interpollation"))continue; //only consider intepollated processes
-      string matchingKeyword="";
-      if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
-
-      string dirName = getDirName(Process[i], matchingKeyword);
-      File->cd();
- 
-      TDirectory* subdir = File->GetDirectory(dirName.c_str());
-      if(!subdir || subdir==File){ subdir = File->mkdir(dirName.c_str());
-      }else{
-         printf("Skip process %s as it seems to be already processed\n", dirName.c_str());
-         continue;  //skip this process as it already exist in the file
+//
+// Reads the input files of one process with a pool of threads (--nThreads). Each worker opens a single file
+// at a time and returns its histograms scaled and detached from the file; at most 'window' files are read
+// ahead of the consumer. The files are handed back in order, so that the sums are identical to the serial loop.
+class ConcurrentFileReader{
+   public:
+      ConcurrentFileReader(const std::vector<string>& files, const std::vector<float>& weights, const std::vector<NameAndType>& histos, int nWorkers):
+         files_(files), weights_(weights), histos_(histos), results_(files.size()), ready_(files.size(), false), next_(0), consumed_(0), window_(2*nWorkers)
+      {
+         for(int w=0;w<std::min(nWorkers, (int)files.size());w++){ workers_.push_back(std::thread(&ConcurrentFileReader::work, this)); }
       }
-      subdir->cd();
-
-      string signal   = Process[i].getStringFromKeyword(matchingKeyword, "tag");
-      string signalL  = Process[i]["interpollation"][0]["tagLeft"].c_str();
-      string signalR  = Process[i]["interpollation"][0]["tagRight"].c_str();
-      double mass     = Process[i]["interpollation"][0]["mass"].toDouble();
-      double massL    = Process[i]["interpollation"][0]["massLeft"].toDouble();
-      double massR    = Process[i]["interpollation"][0]["massRight"].toDouble();
-      double Ratio = ((double)mass - massL); Ratio/=(massR - massL);
 
-      double xsecXbr  = utils::root::getXsecXbr(Process[i]);
-      double xsecXbrL = xsecXbr;  for(unsigned int j=0;j<Process.size();j++){if(Process[j]["tag"].c_str()==signalL){xsecXbrL = utils::root::getXsecXbr(Process[j]); break;}}
-      double xsecXbrR = xsecXbr;  for(unsigned int j=0;j<Process.size();j++){if(Process[j]["tag"].c_str()==signalR){xsecXbrR = utils::root::getXsecXbr(Process[j]); break;}}
+      ~ConcurrentFileReader(){
+         { std::unique_lock<std::mutex> lock(mutex_); next_ = files_.size(); } //stop handing out new files
+         cond_.notify_all();
+         for(size_t w=0;w<workers_.size();w++){ workers_[w].join(); }
+         for(size_t f=0;f<results_.size();f++){ for(size_t h=0;h<results_[f].size();h++){ delete results_[f][h]; } }
+      }
 
-      while(signalL.find("/")!=std::string::npos)signalL.replace(signalL.find("/"),1,"-");
-      while(signalR.find("/")!=std::string::npos)signalR.replace(signalR.find("/"),1,"-");
+      //histograms of file f, aligned with the list of histos (NULL if missing in the file); the caller owns them
+      std::vector<TH1*> get(size_t f){
+         std::unique_lock<std::mutex> lock(mutex_);
+         while(!ready_[f]) cond_.wait(lock);
+         std::vector<TH1*> toReturn;
+         toReturn.swap(results_[f]);
+         consumed_ = f+1;
+         cond_.notify_all();
+         return toReturn;
+      }
 
-      int ictr = 0;
-      int TreeStep = std::max(1,(int)(histlist.size()/50));
-      printf("Interpol %20s :", signal.c_str());
-
-      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
-         if(ictr%TreeStep==0){printf(".");fflush(stdout);}
-         NameAndType& HistoProperties = *it;        
-
-//         printf("%s\n", HistoProperties.name.c_str());
-//         time_t now = time(0);
-        
-         TH1* objL = (TH1*)utils::root::GetObjectFromPath(File,signalL + "/" + HistoProperties.name);      
-         TH1* objR = (TH1*)utils::root::GetObjectFromPath(File,signalR + "/" + HistoProperties.name);      
-         if(!objL || !objR)continue;
-
-//         time_t after1 = time(0);
-
-
-         TH1* histoInterpolated = NULL;
-         if(HistoProperties.isIndexPlot){
-            TH2F* histo2DL = (TH2F*) objL;
-            TH2F* histo2DR = (TH2F*) objR;
-            if(!histo2DL or !histo2DR)continue;
-            histo2DL->Scale(1.0/xsecXbrL);
-            histo2DR->Scale(1.0/xsecXbrR);
-            TH2F* histo2D  = (TH2F*) histo2DL->Clone(histo2DL->GetName());
-            histo2D->Reset();
-
-            for(unsigned int cutIndex=0;cutIndex<=(unsigned int)(histo2DL->GetNbinsX()+1);cutIndex++){
-               TH1D* histoL = histo2DL->ProjectionY("tempL", cutIndex, cutIndex);
-               TH1D* histoR = histo2DR->ProjectionY("tempR", cutIndex, cutIndex);
-               if(histoL->GetSum() >0 && histoR->GetSum()>0){  //Important
-//               if(histoL->Integral()>0 && histoR->Integral()>0){
-                  TH1D* histo  = th1fmorph("interpolTemp","interpolTemp", histoL, histoR, massL, massR, mass, (1-Ratio)*histoL->Integral() + Ratio*histoR->Integral(), 0);
-                  for(unsigned int y=0;y<=(unsigned int)(histo2DL->GetNbinsY()+1);y++){
-                    histo2D->SetBinContent(cutIndex, y, histo->GetBinContent(y));
-                    histo2D->SetBinError(cutIndex, y, histo->GetBinError(y));
-                  }
-                  delete histo;
-               }
-               delete histoR;
-               delete histoL;
+   private:
+      void work(){
+         while(true){
+            size_t f;
+            {
+               std::unique_lock<std::mutex> lock(mutex_);
+               while(next_<files_.size() && next_>=consumed_+window_) cond_.wait(lock);
+               if(next_>=files_.size()) return;
+               f = next_++;
             }
-            delete histo2DL;
-            delete histo2DR;
-            histo2D->Scale(xsecXbr);
-            histoInterpolated = histo2D;
-         }else if(HistoProperties.is1D()){
-            TH1F* histoL = (TH1F*) objL;
-            TH1F* histoR = (TH1F*) objR;
-            if(!histoL or !histoR)continue;
-            if(histoL->GetSum() <=0 || histoR->GetSum()<=0)continue;  //Important
-            histoL->Scale(1.0/xsecXbrL);
-            histoR->Scale(1.0/xsecXbrR);
-            if(histoL->Integral()>0 && histoR->Integral()>0){            
-               double Integral = (1-Ratio)*histoL->Integral() + Ratio*histoR->Integral();               
-               TH1F* histo  = (TH1F*)histoL->Clone(HistoProperties.name.c_str());  histo->Reset();
 
-               histo->Add(th1fmorph("interpolTemp","interpolTemp", histoL, histoR, massL, massR, mass, Integral, 0), 1.0);
-   //          printf("%40s - %f - %f -%f    --> %f - %f -%f\n", HistoProperties.name.c_str(), massL, mass, massR, histoL->Integral(), histo->Integral(), histoR->Integral() );
-               histo->Scale(xsecXbr);          
-               histoInterpolated = histo;
+            std::vector<TH1*> histos(histos_.size(), NULL);
+            TFile* File = new TFile(files_[f].c_str());
+            utils::root::ObjectIndex index(File);
+            for(size_t h=0;h<histos_.size();h++){
+               TObject* inobj = index.get(histos_[h].name);  if(!inobj)continue;
+               TH1* inhist = (TH1*)inobj;
+               inhist->SetDirectory(0);
+               if(histos_[h].name.find("optim_")==std::string::npos) inhist->Scale(weights_[f]);
+               histos[h] = inhist;
             }
-            delete histoR;
-            delete histoL;
+            delete File;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            results_[f].swap(histos);
+            ready_[f] = true;
+            cond_.notify_all();
          }
+      }
 
-//         time_t after2 = time(0);
+      const std::vector<string>& files_;
+      const std::vector<float>& weights_;
+      const std::vector<NameAndType>& histos_;
+      std::vector<std::vector<TH1*> > results_;
+      std::vector<bool> ready_;
+      size_t next_, consumed_, window_;
+      std::vector<std::thread> workers_;
+      std::mutex mutex_;
+      std::condition_variable cond_;
+};
 
-         if(histoInterpolated){
-            subdir->cd();
-            histoInterpolated->Write(HistoProperties.name.c_str());
-            gROOT->cd();
-            delete histoInterpolated;
-         }
+//trees are merged basket by basket, the normalization of each input is stored once as a range of entries
+//in the companion tree <name>_PWeight (firstEntry, entries, plotterWeight) instead of one entry per event
+void AddTreeToFile(TDirectory* subdir, NameAndType& HistoProperties, TTree* intree, float weight){
+   TTree* outtree = (TTree*)utils::root::GetObjectFromPath(subdir,HistoProperties.name);
+   TTree* weightTree = (TTree*)utils::root::GetObjectFromPath(subdir,HistoProperties.name+"_PWeight");
+   Long64_t firstEntry = 0;
+   if(!outtree){ //tree not yet in file, so need to add it
+      subdir->cd();
+      outtree =  intree->CloneTree(-1, "fast");
+      outtree->SetDirectory(subdir);
+   }else{
+      firstEntry = outtree->GetEntries();
+      outtree->CopyEntries(intree, -1, "fast");
+   }
 
-//         time_t after3 = time(0);
-//         printf("%fs - %fs - %fs \n", difftime(after1,now), difftime(after2,after1), difftime(after3,after2));
+   Long64_t entries = outtree->GetEntries() - firstEntry;
+   float plotterWeight = weight;
+   if(!weightTree){
+      subdir->cd();
+      weightTree = new TTree((HistoProperties.name+"_PWeight").c_str(),"plotterWeight");
+      weightTree->Branch("firstEntry",&firstEntry,"firstEntry/L");
+      weightTree->Branch("entries",&entries,"entries/L");
+      weightTree->Branch("plotterWeight",&plotterWeight,"plotterWeight/F");
+      weightTree->SetDirectory(subdir);
+   }else{
+      weightTree->SetBranchAddress("firstEntry",&firstEntry);
+      weightTree->SetBranchAddress("entries",&entries);
+      weightTree->SetBranchAddress("plotterWeight",&plotterWeight);
+   }
+   weightTree->Fill();
+   weightTree->ResetBranchAddresses();
+}
 
-      }printf("\n");
+void AddHistoToFile(TDirectory* subdir, NameAndType& HistoProperties, TH1* inhist, string& matchingKeyword, JSONWrapper::Object& Process){
+   TH1* outhist = (TH1*)utils::root::GetObjectFromPath(subdir,HistoProperties.name);
+   if(!outhist){ //histogram not yet in file, so need to add it
+      subdir->cd();
+      outhist = (TH1*)inhist->Clone(inhist->GetName());
+      utils::root::setStyleFromKeyword(matchingKeyword,Process, outhist);
+      utils::root::checkSumw2(outhist);
+   }else{
+      outhist->Add(inhist);
    }
 }
 
+//remove the processes derived from the merged ones (interpolated, mixed, NRB), so that they are built again
+void DeleteDerivedProcesses(JSONWrapper::Object& Root, TFile* OutputFile){
+   std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
+   for(unsigned int i=0;i<Process.size();i++){
+      if(!Process[i].isTag("interpollation") && !Process[i].isTag("mixing") && !Process[i].isTag("NRB"))continue;
+      string matchingKeyword="";
+      if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue;
+      string dirName = getDirName(Process[i], matchingKeyword);
+      TDirectory* subdir = OutputFile->GetDirectory(dirName.c_str());
+      if(!subdir || subdir==OutputFile)continue;
+      printf("Process %s will be rebuilt from the updated inputs\n", dirName.c_str());
+      OutputFile->Delete((dirName+";*").c_str());
+   }
+   OutputIndex.clear();
+}
 
 void SavingToFile(JSONWrapper::Object& Root, std::string RootDir, TFile* OutputFile, std::list<NameAndType>& histlist){
    std::vector<TObject*> ObjectToDelete;
    std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
 
+   //the trees are always merged by the main thread
+   std::vector<NameAndType> histos, trees;
+   for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++){ if(it->isTree()){trees.push_back(*it);}else{histos.push_back(*it);} }
+
    int IndexFiles = 0;
    int NFilesStep = 0;  
    for(std::unordered_map<string, std::vector<string> >::iterator it = DSetFiles.begin(); it!=DSetFiles.end(); it++){NFilesStep+=it->second.size();} 
@@ -565,10 +935,38 @@ void SavingToFile(JSONWrapper::Object& Root, std::string RootDir, TFile* OutputF
 
 //      time_t now = time(0); 
       string dirName = getDirName(Process[i], matchingKeyword);
+
+      //list all the files of this process together with their normalization
+      std::vector<string> processFiles;
+      std::vector<float> processWeights;
+      float  Weight = 1.0;     
+      std::vector<JSONWrapper::Object> Samples = (Process[i])["data"].daughters();
+      for(unsigned int j=0;j<Samples.size();j++){
+         std::vector<string>& fileList = DSetFiles[(Samples[j])["dtag"].toString()+filtExt];
+         if(!Process[i].getBoolFromKeyword(matchingKeyword, "isdata", false) && !Process[i].getBoolFromKeyword(matchingKeyword, "isdatadriven", false)){Weight= iLumi/fileList.size();}else{Weight=1.0;}
+         for(unsigned int f=0;f<fileList.size();f++){ processFiles.push_back(fileList[f]); processWeights.push_back(Weight); }
+      }
+
+      string inputsRecord = "";
+      if(incremental){
+         char buf[255]; sprintf(buf, "lumi %f\n", iLumi);
+         inputsRecord = histlistStamp + buf;
+         for(unsigned int f=0;f<processFiles.size();f++){ inputsRecord += processFiles[f] + " " + FileStamps[processFiles[f]] + "\n"; }
+      }
+
       OutputFile->cd();
       TDirectory* subdir = OutputFile->GetDirectory(dirName.c_str());
+      if(subdir && subdir!=OutputFile && incremental){
+         TNamed* record = (TNamed*)subdir->Get("plotterInputs");
+         if(!record || inputsRecord!=record->GetTitle()){
+            printf("Inputs of process %s have changed, merging it again\n", dirName.c_str());
+            OutputFile->Delete((dirName+";*").c_str());
+            subdir = NULL;
+         }
+      }
       if(!subdir || subdir==OutputFile){ 
 	 subdir = OutputFile->mkdir(dirName.c_str());
+         nChangedProcesses++;
       }else{ 
          printf("Skip process %s as it seems to be already processed\n", dirName.c_str());
          continue;  //skip this process as it already exist in the file
@@ -577,63 +975,59 @@ void SavingToFile(JSONWrapper::Object& Root, std::string RootDir, TFile* OutputF
       subdir->cd();
 
 //      time_t after1 = time(0);
-      
-      float  Weight = 1.0;     
-      std::vector<JSONWrapper::Object> Samples = (Process[i])["data"].daughters();
-      for(unsigned int j=0;j<Samples.size();j++){
-         std::vector<string>& fileList = DSetFiles[(Samples[j])["dtag"].toString()+filtExt];
-         if(!Process[i].getBoolFromKeyword(matchingKeyword, "isdata", false) && !Process[i].getBoolFromKeyword(matchingKeyword, "isdatadriven", false)){Weight= iLumi/fileList.size();}else{Weight=1.0;}
 
-         for(int f=0;f<fileList.size();f++){
+      if(nThreads<=1){
+         for(unsigned int f=0;f<processFiles.size();f++){
            if(IndexFiles%NFilesStep==0){printf(".");fflush(stdout);} IndexFiles++;
-           TFile* File = new TFile(fileList[f].c_str());
+           TFile* File = new TFile(processFiles[f].c_str());
+           utils::root::ObjectIndex index(File);
 
            for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++){
               NameAndType& HistoProperties = *it;
 
-              TObject* inobj  = utils::root::GetObjectFromPath(File,HistoProperties.name);  if(!inobj)continue;
-              TObject* outobj = utils::root::GetObjectFromPath(subdir,HistoProperties.name);
-             
+              TObject* inobj  = index.get(HistoProperties.name);  if(!inobj)continue;
               if(HistoProperties.isTree()){
-                 TTree* outtree = (TTree*)outobj;
-                 if(!outtree){ //tree not yet in file, so need to add it
-                    subdir->cd();
-                    outtree =  ((TTree*)inobj)->CloneTree(-1, "fast");
-                    outtree->SetDirectory(subdir);
-
-                    TTree* weightTree = new TTree((HistoProperties.name+"_PWeight").c_str(),"plotterWeight");
-                    weightTree->Branch("plotterWeight",&weightTree,"plotterWeight/F");
-                    weightTree->SetDirectory(subdir);
-                    for(unsigned int i=0;i<((TTree*)inobj)->GetEntries();i++){weightTree->Fill();}                       
-                 }else{
-                    outtree->CopyEntries(((TTree*)inobj), -1, "fast");
-                    TTree* weightTree = (TTree*)utils::root::GetObjectFromPath(subdir,HistoProperties.name+"_PWeight");
-                    for(unsigned int i=0;i<((TTree*)inobj)->GetEntries();i++){weightTree->Fill();} 
-                 }
+                 AddTreeToFile(subdir, HistoProperties, (TTree*)inobj, processWeights[f]);
               }else{        
-                 if(HistoProperties.name.find("optim_")==std::string::npos) ((TH1*)inobj)->Scale(Weight);
-                 TH1* outhist = (TH1*)outobj;
-                 if(!outhist){ //histogram not yet in file, so need to add it
-                    subdir->cd();
-                    outhist = (TH1*)(inobj)->Clone(inobj->GetName());
-                    utils::root::setStyleFromKeyword(matchingKeyword,Process[i], outhist);
-                    utils::root::checkSumw2(outhist);
-                 }else{
-                    outhist->Add((TH1*)inobj);
-                 }
+                 if(HistoProperties.name.find("optim_")==std::string::npos) ((TH1*)inobj)->Scale(processWeights[f]);
+                 AddHistoToFile(subdir, HistoProperties, (TH1*)inobj, matchingKeyword, Process[i]);
               }
            }
            delete File;         
-         }   
+         }
+      }else{
+         ConcurrentFileReader reader(processFiles, processWeights, histos, nThreads);
+         for(unsigned int f=0;f<processFiles.size();f++){
+           if(IndexFiles%NFilesStep==0){printf(".");fflush(stdout);} IndexFiles++;
+           std::vector<TH1*> inhistos = reader.get(f);
+           for(unsigned int h=0;h<histos.size();h++){
+              if(!inhistos[h])continue;
+              AddHistoToFile(subdir, histos[h], inhistos[h], matchingKeyword, Process[i]);
+              delete inhistos[h];
+           }
+
+           if(trees.empty())continue;
+           TFile* File = new TFile(processFiles[f].c_str());
+           utils::root::ObjectIndex index(File);
+           for(unsigned int t=0;t<trees.size();t++){
+              TObject* inobj  = index.get(trees[t].name);  if(!inobj)continue;
+              AddTreeToFile(subdir, trees[t], (TTree*)inobj, processWeights[f]);
+           }
+           delete File;
+         }
       }
 //      time_t after2 = time(0);
       
       subdir->cd();
       subdir->Write();
+      //the record validates the directory for the next incremental runs, it is only written once the merge is complete
+      if(incremental){ TNamed record("plotterInputs", inputsRecord.c_str()); record.Write(); }
+      if(lowMemory)ReleaseObjects(subdir); //the process is complete, it is read back from the file when needed
 
 //      time_t after3 = time(0);
 //      printf("%s %fs - %fs - %fs\n", dirName.c_str(), difftime(after1,now), difftime(after2,after1), difftime(after3,after2));
      
+      OutputIndex.clear(); //objects were added to the output file
    }printf("\n");
 }
 
@@ -646,6 +1040,7 @@ void Draw2DHistogramSplitCanvas(JSONWrapper::Object& Root, TFile* File, NameAndT
 
    std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
    std::vector<TObject*> ObjectToDelete;
+   std::vector<TObject*> FromOutput;
    for(unsigned int i=0;i<Process.size();i++){
       string matchingKeyword="";
       if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering      
@@ -655,12 +1050,12 @@ void Draw2DHistogramSplitCanvas(JSONWrapper::Object& Root, TFile* File, NameAndT
       c1->SetLogz(true);
 
       string dirName = getDirName(Process[i], matchingKeyword);
-      TH1* hist = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name);
+      TH1* hist = (TH1*)GetObjectFromOutput(File,dirName + "/" + HistoProperties.name);
       if(!hist)continue;
       utils::root::setStyleFromKeyword(matchingKeyword,Process[i], hist);
 
       SaveName = hist->GetName();
-      ObjectToDelete.push_back(hist);
+      FromOutput.push_back(hist);
       hist->SetTitle("");
       hist->SetStats(kFALSE);
 
@@ -687,6 +1082,7 @@ void Draw2DHistogramSplitCanvas(JSONWrapper::Object& Root, TFile* File, NameAndT
    }
 
    for(unsigned int d=0;d<ObjectToDelete.size();d++){delete ObjectToDelete[d];}ObjectToDelete.clear();
+   for(unsigned int d=0;d<FromOutput.size();d++){ReleaseFromOutput(FromOutput[d]);}FromOutput.clear();
 }
 
 
@@ -710,6 +1106,7 @@ void Draw2DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
 
 
    std::vector<TObject*> ObjectToDelete;
+   std::vector<TObject*> FromOutput;
    for(unsigned int i=0;i<Process.size();i++){
       string matchingKeyword="";
       if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
@@ -720,12 +1117,12 @@ void Draw2DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
       pad->SetTopMargin(0.0); pad->SetBottomMargin(0.10);  pad->SetRightMargin(0.20);
 
       string dirName = getDirName(Process[i], matchingKeyword);
-      TH1* hist = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name);
+      TH1* hist = (TH1*)GetObjectFromOutput(File,dirName + "/" + HistoProperties.name);
       if(!hist)continue;
       utils::root::setStyleFromKeyword(matchingKeyword,Process[i], hist);
   
       SaveName = hist->GetName();
-      ObjectToDelete.push_back(hist);
+      FromOutput.push_back(hist);
       hist->SetTitle("");
       hist->SetStats(kFALSE);
 
@@ -749,23 +1146,26 @@ void Draw2DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
      c1->SaveAs((SavePath + *ext).c_str());
    }
    for(unsigned int d=0;d<ObjectToDelete.size();d++){delete ObjectToDelete[d];}ObjectToDelete.clear();
+   for(unsigned int d=0;d<FromOutput.size();d++){ReleaseFromOutput(FromOutput[d]);}FromOutput.clear();
    delete c1;
 }
 
 void addShapeUnc(TFile* File, string& dirName, NameAndType& HistoProperties, TH1* systHist){
-      TH1* syst = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + "all_optim_systs");
+      TH1* syst = (TH1*)GetObjectFromOutput(File,dirName + "/" + "all_optim_systs");
       if(!syst){printf("all_optim_systs histogram is not there\n"); return;}
 
       //loop over all shape syst      
       for(int ivar = 1; ivar<=syst->GetNbinsX();ivar++){
-         TH1* hist = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name + syst->GetXaxis()->GetBinLabel(ivar) );        
+         TH1* hist = (TH1*)GetObjectFromOutput(File,dirName + "/" + HistoProperties.name + syst->GetXaxis()->GetBinLabel(ivar) );        
 //         if(!hist){printf("histo for %s is not found\n", (dirName + "/" + HistoProperties.name + syst->GetXaxis()->GetBinLabel(ivar)).c_str() );}
          if(!hist){continue;}
          if(abs(rebin)>0){hist = hist->Rebin(abs(rebin)); hist->Scale(1.0/abs(rebin), rebin<0?"width":""); }
          for(int ibin=1; ibin<=systHist->GetXaxis()->GetNbins(); ibin++){
             systHist->SetBinError(ibin, sqrt(pow(systHist->GetBinError(ibin),2)+pow(systHist->GetBinContent(ibin) - hist->GetBinContent(ibin),2)));
          }
+         ReleaseFromOutput(hist);
       }
+      ReleaseFromOutput(syst);
 }
 
 
@@ -827,8 +1227,8 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
       if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
       if(Process[i].getBoolFromKeyword(matchingKeyword, "isinvisible", false))continue;
       string dirName = getDirName(Process[i], matchingKeyword);
-      TH1* hist = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name);
-      if(!hist){
+      TH1* histFromOutput = (TH1*)GetObjectFromOutput(File,dirName + "/" + HistoProperties.name);
+      if(!histFromOutput){
          //special case to make sure that we always have data on the legend
          if(Process[i].getBoolFromKeyword(matchingKeyword, "isdata", false)){
             TH1D* dummy = new TH1D("dummy", "dummy", 1, 0, 1);
@@ -839,6 +1239,9 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
 
          continue;
       }
+      //rebinning and scaling are done on a copy, the merged histogram is released (or kept intact without --lowMemory)
+      TH1* hist = (TH1*)histFromOutput->Clone(); hist->SetDirectory(0);
+      ReleaseFromOutput(histFromOutput);
       if(abs(rebin)>0){hist = hist->Rebin(abs(rebin)); hist->Scale(1.0/abs(rebin), rebin<0?"width":""); }
 
       utils::root::setStyleFromKeyword(matchingKeyword,Process[i], hist);
@@ -852,7 +1255,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
 
       if(Process[i].getBoolFromKeyword(matchingKeyword, "isdata", false)){
           if(!data){legA->AddEntry(hist, Process[i].getStringFromKeyword(matchingKeyword, "tag", "").c_str(), "P E");}
-          if(!data){data = (TH1D*)hist->Clone("data");utils::root::checkSumw2(data);}else{data->Add(hist);}
+          if(!data){data = (TH1D*)hist->Clone("data");utils::root::checkSumw2(data);ObjectToDelete.push_back(data);}else{data->Add(hist);}
       }else if(Process[i].getBoolFromKeyword(matchingKeyword, "spimpose", false)){
           legEntries.insert(legEntries.begin(), new TLegendEntry(hist, Process[i].getStringFromKeyword(matchingKeyword, "tag", "").c_str(), "L") );   
           hist->Scale(signalScale);
@@ -862,7 +1265,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
       }else{
 	 stack->Add(hist, "HIST"); //Add to Stack
          legEntries.push_back(new TLegendEntry(hist, Process[i].getStringFromKeyword(matchingKeyword, "tag", "").c_str(), "F"));
-         if(!mc){mc = (TH1D*)hist->Clone("mc");utils::root::checkSumw2(mc);}else{mc->Add(hist);}      
+         if(!mc){mc = (TH1D*)hist->Clone("mc");utils::root::checkSumw2(mc);ObjectToDelete.push_back(mc);}else{mc->Add(hist);}      
 
          //
          // take care of systematic error
@@ -894,8 +1297,9 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
             addShapeUnc(File, dirName, HistoProperties, histPlusSyst);
 
   
-            if(!mcPlusSyst){ mcPlusSyst = (TH1D*)hist->Clone("mcPlusSyst");mcPlusSyst->Reset(); utils::root::checkSumw2(mcPlusSyst);}
+            if(!mcPlusSyst){ mcPlusSyst = (TH1D*)hist->Clone("mcPlusSyst");mcPlusSyst->Reset(); utils::root::checkSumw2(mcPlusSyst);ObjectToDelete.push_back(mcPlusSyst);}
             mcPlusSyst->Add(histPlusSyst);
+            delete histPlusSyst;
          }
       }
    }
@@ -962,7 +1366,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
       systBand->Draw("same 2 0");
 
       TGraphErrors* errBand = new TGraphErrors(mc->GetNbinsX()); IPoint=0;
-      mcPlusRelUnc = (TH1 *) mc->Clone("totalmcwithunc");utils::root::checkSumw2(mcPlusRelUnc); mcPlusRelUnc->SetDirectory(0);        
+      mcPlusRelUnc = (TH1 *) mc->Clone("totalmcwithunc");utils::root::checkSumw2(mcPlusRelUnc); mcPlusRelUnc->SetDirectory(0); ObjectToDelete.push_back(mcPlusRelUnc);
       for(int ibin=1; ibin<=mcPlusRelUnc->GetXaxis()->GetNbins(); ibin++){
          errBand->SetPoint     (IPoint, mcPlusRelUnc->GetBinCenter(ibin), mcPlusRelUnc->GetBinContent(ibin) );
          errBand->SetPointError(IPoint, mcPlusRelUnc->GetBinWidth(ibin)/2, mcPlusRelUnc->GetBinError(ibin) );
@@ -1063,6 +1467,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
        else if (mcPlusRelUnc)denSystUncH=(TH1D *) mcPlusRelUnc->Clone("mcrelunc");
        else                  denSystUncH=(TH1D *) mc          ->Clone("mcrelunc");
        utils::root::checkSumw2(denSystUncH);
+       ObjectToDelete.push_back(denSystUncH);
 
        int GPoint=0;
        TGraphErrors *denSystUnc=new TGraphErrors(denSystUncH->GetXaxis()->GetNbins());  
@@ -1116,6 +1521,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
        if(mcPlusRelUnc) denRelUncH=(TH1D *) mcPlusRelUnc->Clone("mcrelunc");
        else             denRelUncH=(TH1D *) mc->Clone("mcrelunc");
        utils::root::checkSumw2(denRelUncH);
+       ObjectToDelete.push_back(denRelUncH);
 
        GPoint=0;
        TGraphErrors *denRelUnc=new TGraphErrors(denRelUncH->GetXaxis()->GetNbins());  
@@ -1169,6 +1575,7 @@ void Draw1DHistogram(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoP
 	   TString name("CompHistogram"); name+=icd;
 	   TH1D *dataToObsH = (TH1D*)compDists[icd]->Clone(name);
 	   utils::root::checkSumw2(dataToObsH);
+	   ObjectToDelete.push_back(dataToObsH);
 	   dataToObsH->Divide(mc);
            TGraphErrors* dataToObs = new TGraphErrors(dataToObsH);
            dataToObs->SetMarkerColor(dataToObsH->GetMarkerColor());
@@ -1224,13 +1631,14 @@ void ConvertToTex(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoProp
    FILE* pFile = NULL;
 
    std::vector<TObject*> ObjectToDelete;
+   std::vector<TObject*> FromOutput;
    TH1* stack = NULL; 
    std::vector<JSONWrapper::Object> Process = Root["proc"].daughters();
    for(unsigned int i=0;i<Process.size();i++){
       string matchingKeyword="";
       if(!utils::root::getMatchingKeyword(Process[i], keywords, matchingKeyword))continue; //only consider samples passing key filtering
       string dirName = getDirName(Process[i], matchingKeyword);
-      TH1* hist = (TH1*)utils::root::GetObjectFromPath(File,dirName + "/" + HistoProperties.name);
+      TH1* hist = (TH1*)GetObjectFromOutput(File,dirName + "/" + HistoProperties.name);
       if(!hist)continue;
 
       if(!pFile){
@@ -1259,7 +1667,7 @@ void ConvertToTex(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoProp
          fprintf(pFile, "\\begin{tabular}{ %s } \\hline\n", colfmt.c_str());
          fprintf(pFile, "Process %s \\\\ \\hline\\hline\n", colname.c_str());
       }
-      ObjectToDelete.push_back(hist);
+      FromOutput.push_back(hist);
 
       std::string CleanTag = Process[i].getStringFromKeyword(matchingKeyword, "tag", "").c_str();
       if(CleanTag.find("#")!=std::string::npos)CleanTag = string("$") + CleanTag + "$";
@@ -1299,6 +1707,7 @@ void ConvertToTex(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoProp
       fclose(pFile);
    }
    for(unsigned int d=0;d<ObjectToDelete.size();d++){delete ObjectToDelete[d];}ObjectToDelete.clear();
+   for(unsigned int d=0;d<FromOutput.size();d++){ReleaseFromOutput(FromOutput[d]);}FromOutput.clear();
 }
 
 
@@ -1306,6 +1715,22 @@ void ConvertToTex(JSONWrapper::Object& Root, TFile* File, NameAndType& HistoProp
 
 
 
+//render the histograms of the list with index%nWorkers==worker, the progress is either printed or
+//reported with one byte per histogram to progressFd (when called from a plotting worker)
+void DrawAllHistograms(JSONWrapper::Object& Root, TFile* File, std::list<NameAndType>& histlist, int worker, int nWorkers, int progressFd, ProgressMonitor* progress){
+   int ictr =0;
+   for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
+       if(ictr%nWorkers!=worker)continue;
+       if(progress)progress->update(ictr);
+   
+       if(doPlot && doTex && (it->name.find("eventflow")!=std::string::npos || it->name.find("evtflow")!=std::string::npos) && it->name.find("optim_eventflow")==std::string::npos){    ConvertToTex(Root,File,*it); }
+       if(doPlot && do2D  && it->is2D()){                      if(!splitCanvas){Draw2DHistogram(Root,File,*it); }else{Draw2DHistogramSplitCanvas(Root,File,*it);}}
+       if(doPlot && do1D  && it->is1D()){ Draw1DHistogram(Root,File,*it); }
+
+       if(progressFd>=0){ char done = 1; if(write(progressFd, &done, 1)!=1)perror("plotting progress"); }
+   }
+}
+
 int main(int argc, char* argv[]){
    gROOT->LoadMacro("../../src/tdrstyle.C");
    setTDRStyle();  
@@ -1357,6 +1782,12 @@ int main(int argc, char* argv[]){
         printf("--removeRatioPlot --> if you want to remove ratio plots between Data ad Mc\n");
         printf("--removeUnderFlow --> Remove the Underflow bin in the final plots\n");
         printf("--removeOverFlow --> Remove the Overflow bin in the final plots\n");
+        printf("--nThreads --> number of threads used to read the input files and to build the derived processes (1 by default)\n");
+        printf("--incremental --> update the output file, only merging again the processes whose inputs changed\n");
+        printf("--plotWorkers --> number of forked processes used to draw the plots (1 by default)\n");
+        printf("--lowMemory --> release the merged objects as soon as they are written and report the peak memory of each step\n");
+        printf("--profile --> write the time and memory used by each step to this JSON file\n");
+        printf("--statusFile --> file updated with the plotting progress (rate, ETA, memory) every --heartbeat seconds (30 by default)\n");
 
         printf("command line example: runPlotter --json ../data/beauty-samples.json --iLumi 2007 --inDir OUT/ --outDir OUT/plots/ --outFile plotter.root --noRoot --noPlot\n");
 	return 0;
@@ -1408,7 +1839,25 @@ int main(int argc, char* argv[]){
      if(arg.find("--cutflow" )!=string::npos && i+1<argc){ cutflowhisto   = argv[i+1];  i++;  printf("Normalizing from 1st bin in = %s\n", cutflowhisto.c_str());  }
      if(arg.find("--splitCanvas")!=string::npos){ splitCanvas = true;    }
      if(arg.find("--fileOption" )!=string::npos && i+1<argc){ fileOption = argv[i+1];  i++;  printf("FileOption = %s\n", fileOption.c_str());  }
+     if(arg.find("--incremental")!=string::npos){ incremental = true; printf("Incremental mode: unchanged processes are reused from the output file\n"); }
+     if(arg.find("--plotWorkers")!=string::npos && i+1<argc){ sscanf(argv[i+1],"%d",&plotWorkers); i++; printf("Drawing plots with %d processes\n", plotWorkers); }
+     if(arg.find("--profile")!=string::npos && i+1<argc){ profile = argv[i+1]; i++; printf("Profiling summary saved in %s\n", profile.c_str()); }
+     if(arg.find("--statusFile")!=string::npos && i+1<argc){ statusFile = argv[i+1]; i++; }
+     if(arg.find("--heartbeat")!=string::npos && i+1<argc){ sscanf(argv[i+1],"%lf",&heartbeat); i++; }
+     if(arg.find("--lowMemory")!=string::npos){ lowMemory = true; printf("Low memory mode: merged objects are only kept in memory while they are used\n"); }
+     if(arg.find("--nThreads" )!=string::npos && i+1<argc){ sscanf(argv[i+1],"%d",&nThreads); i++; printf("Reading input files with %d threads\n", nThreads); }
    } 
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+   if(nThreads>1)ROOT::EnableThreadSafety();
+#else
+   if(nThreads>1){ printf("Concurrent file reading requires ROOT>=6.06, using a single thread\n"); nThreads=1; }
+#endif
+   if(profile!="")profUtils::enable(outFile);
+   const int listingStage = profUtils::stage("listing objects");
+   const int mergingStage = profUtils::stage("merging input files");
+   const int derivedStage = profUtils::stage("derived processes");
+   const int plottingStage = profUtils::stage("plotting");
+   profUtils::mark(listingStage);
    if(doPlot)system( (string("mkdir -p ") + outDir).c_str());
    if(plotExt.size() == 0)
      plotExt.push_back(".png");
@@ -1417,6 +1866,10 @@ int main(int argc, char* argv[]){
    sprintf(buf, "_Index%d", cutIndex);
    cutIndexStr = buf;
 
+   if(incremental){
+      FILE* pFile = fopen(outFile.c_str(), "r");
+      if(pFile){ fclose(pFile); fileOption = "UPDATE"; }
+   }
    TFile* OutputFile = new TFile(outFile.c_str(),fileOption.c_str());
 
    JSONWrapper::Object Root(jsonFile, true);
@@ -1426,13 +1879,17 @@ int main(int argc, char* argv[]){
    }
    histlist.sort();
    histlist.unique();   
+   if(lowMemory)ReportMemory("listing objects");
+   profUtils::sampleMemory("listing objects");
 
    printf("Progressing Bar              :0%%       20%%       40%%       60%%       80%%       100%%\n");
 
+   std::vector<std::regex> histoNameMaskRegex;
+   for(unsigned int i=0;i<histoNameMask.size();i++)histoNameMaskRegex.push_back(std::regex(histoNameMask[i]));
    std::list<NameAndType>::iterator it= histlist.begin();
    while(it!= histlist.end()){
        bool passMasking = (histoNameMask.size()==0);  
-       for(unsigned int i=0;i<histoNameMask.size();i++){if(std::regex_match(it->name,std::regex(histoNameMask[i])))passMasking=true; break;}
+       for(unsigned int i=0;i<histoNameMaskRegex.size();i++){if(std::regex_match(it->name,histoNameMaskRegex[i])){passMasking=true; break;}}
        if(!passMasking){it=histlist.erase(it); continue; }
        if(!do2D   &&(it->is2D() || it->is3D())){it=histlist.erase(it); continue;}
        if(!do1D   && it->is1D()){it=histlist.erase(it); continue;}
@@ -1440,25 +1897,82 @@ int main(int argc, char* argv[]){
        it++;
    }
 
+   if(incremental){
+      //the merged objects depend on the list of objects and on its selection
+      string allNames = "";
+      for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++){ char buf[16]; sprintf(buf,":%d;",it->type); allNames += it->name + buf; }
+      char buf[255]; sprintf(buf, "histlist %u %lu\n", TString(allNames.c_str()).Hash(), (unsigned long)histlist.size());
+      histlistStamp = buf;
+   }
+
+   profUtils::count("objects", histlist.size());
+
    if(fileOption!="READ"){
+      profUtils::mark(mergingStage);
       SavingToFile(Root,inDir,OutputFile, histlist);       
-      if(doInterpollation)InterpollateProcess(Root, OutputFile, histlist);
-      SumBins(Root, OutputFile, histlist);
-      MixProcess(Root, OutputFile, histlist);
-      NRBProcess(Root, OutputFile, histlist);
+      if(lowMemory)ReportMemory("merging input files");
+      profUtils::sampleMemory("merging input files");
+      profUtils::mark(derivedStage);
+      if(incremental && nChangedProcesses>0)DeleteDerivedProcesses(Root, OutputFile);
+      OutputFile = BuildDerivedProcesses(Root, OutputFile, histlist);
+      if(lowMemory)ReportMemory("derived processes");
+      profUtils::sampleMemory("derived processes");
    }
+   profUtils::mark(plottingStage);
+
+
+   ProgressMonitor plotProgress("plotting", histlist.size(), "objects", statusFile, heartbeat);
+   plotProgress.setCommand(argc, argv);
+   if(doPlot && plotWorkers>1){
+      //ROOT graphics is not thread safe: fork workers that each open the summary file read-only and
+      //render one shard of the list, the progress is reported back through a pipe
+      OutputFile->Close();
+      OutputIndex.clear();
+      int progress[2];
+      if(pipe(progress)!=0){ printf("Can not create the pipe for the plotting workers\n"); return -1; }
+      fflush(stdout);
+      std::vector<pid_t> workers;
+      for(int w=0;w<plotWorkers;w++){
+         pid_t pid = fork();
+         if(pid==0){
+            close(progress[0]);
+            TFile* File = new TFile(outFile.c_str(),"READ");
+            DrawAllHistograms(Root, File, histlist, w, plotWorkers, progress[1], NULL);
+            File->Close();
+            close(progress[1]);
+            fflush(stdout);
+            _exit(0);
+         }
+         if(pid<0){ printf("Can not fork plotting worker %d\n", w); continue; }
+         workers.push_back(pid);
+      }
+      close(progress[1]);
 
+      int ictr = 0;
+      char buf[256];
+      ssize_t n;
+      while((n = read(progress[0], buf, sizeof(buf)))!=0){
+         if(n<0){ if(errno==EINTR)continue; break; }
+         ictr += n;
+         plotProgress.update(ictr);
+      }
+      close(progress[0]);
 
-   int ictr =0;
-   int TreeStep = std::max(1,(int)(histlist.size()/50));
-   printf("Plotting                     :");
-   for(std::list<NameAndType>::iterator it= histlist.begin(); it!= histlist.end(); it++,ictr++){
-       if(ictr%TreeStep==0){printf(".");fflush(stdout);}
-   
-       if(doPlot && doTex && (it->name.find("eventflow")!=std::string::npos || it->name.find("evtflow")!=std::string::npos) && it->name.find("optim_eventflow")==std::string::npos){    ConvertToTex(Root,OutputFile,*it); }
-       if(doPlot && do2D  && it->is2D()){                      if(!splitCanvas){Draw2DHistogram(Root,OutputFile,*it); }else{Draw2DHistogramSplitCanvas(Root,OutputFile,*it);}}
-       if(doPlot && do1D  && it->is1D()){ Draw1DHistogram(Root,OutputFile,*it); }
-   }printf("\n");
-   OutputFile->Close();   
+      for(unsigned int w=0;w<workers.size();w++){
+         int status = 0;
+         waitpid(workers[w], &status, 0);
+         if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) printf("Plotting worker %d failed, some plots may be missing\n", (int)w);
+      }
+      plotProgress.finish();
+      if(lowMemory){ struct rusage usage; getrusage(RUSAGE_CHILDREN, &usage); printf("Memory %-28s: peak %8.1f MB per worker\n", "plotting", usage.ru_maxrss/1024.); }
+      if(profile!=""){ struct rusage usage; getrusage(RUSAGE_CHILDREN, &usage); profUtils::count("plotting worker peak memory (MB)", usage.ru_maxrss/1024.); }
+   }else{
+      DrawAllHistograms(Root, OutputFile, histlist, 0, 1, -1, &plotProgress);
+      plotProgress.update(histlist.size());
+      plotProgress.finish();
+      if(lowMemory)ReportMemory("plotting");
+      OutputFile->Close();   
+   }
+   if(profile!="")profUtils::writeSummary(profile);
 }
 
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <climits>
 
 #include "FWCore/FWLite/interface/FWLiteEnabler.h"
 #include "FWCore/PythonParameterSet/interface/MakeParameterSets.h"
@@ -7,6 +8,9 @@
 #include "UserCode/bsmhiggs_fwk/interface/PatUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/MacroUtils.h"
 #include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryHandler.h"
+#include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryStream.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProgressMonitor.h"
 #include "UserCode/bsmhiggs_fwk/interface/BSMPhysicsEvent.h"
 #include "UserCode/bsmhiggs_fwk/interface/SmartSelectionMonitor.h"
 #include "UserCode/bsmhiggs_fwk/interface/PDFInfo.h"
@@ -26,6 +30,8 @@
 #include "TSystem.h"
 #include "TFile.h"
 #include "TTree.h"
+#include "TKey.h"
+#include "TClass.h"
 #include "TCanvas.h"
 #include "TH1F.h"
 #include "TH2F.h"
@@ -351,28 +357,88 @@ int main(int argc, char* argv[])
     //#############         GET READY FOR THE EVENT LOOP           #####################
     //##################################################################################
 
+    //optional per-stage timing and memory summary (JSON), see ProfilingUtils
+    std::string profile = runProcess.getUntrackedParameter<std::string>("profile", "");
+    if(profile!="") profUtils::enable(outFileUrl.Data());
+    const int readStage      = profUtils::stage("event read");
+    const int physicsStage   = profUtils::stage("getPhysicsEventFrom");
+    const int selectionStage = profUtils::stage("object selection");
+    const int btagSFStage    = profUtils::stage("b-tag SF");
+    const int categoryStage  = profUtils::stage("event categories");
+    const int outputStage    = profUtils::stage("output");
+
     //open the file and get events tree
     DataEvtSummaryHandler summaryHandler_;
 
-    TFile *file = TFile::Open(url);
-    printf("Looping on %s\n",url.Data());
-    if(file==0) return -1;
-    if(file->IsZombie()) return -1;
-    if( !summaryHandler_.attachToTree( (TTree *)file->Get(dirname) ) ) {
-        file->Close();
-        return -1;
+    //events can also be streamed directly from a runNtuplizer job running on the same node (outputStream option)
+    DataEvtSummaryStream summaryStream_;
+    std::string inputStream = runProcess.getUntrackedParameter<std::string>("inputStream", "");
+    bool useStream = (inputStream!="");
+
+    TFile *file = NULL;
+    if(useStream) {
+        printf("Looping on events streamed through %s\n",inputStream.c_str());
+        if( !summaryStream_.attach(inputStream) ) return -1;
+        //the number of events is not known in advance
+        evStart = 0;
+        if(evEnd<0) evEnd = INT_MAX;
+    } else {
+        file = TFile::Open(url);
+        printf("Looping on %s\n",url.Data());
+        if(file==0) return -1;
+        if(file->IsZombie()) return -1;
+        if( !summaryHandler_.attachToTree( (TTree *)file->Get(dirname) ) ) {
+            file->Close();
+            return -1;
+        }
     }
 
 
     //check run range to compute scale factor (if not all entries are used)
-    const Int_t totalEntries= summaryHandler_.getEntries();
-    float rescaleFactor( evEnd>0 ?  float(totalEntries)/float(evEnd-evStart) : -1 );
-    if(evEnd<0 || evEnd>summaryHandler_.getEntries() ) evEnd=totalEntries;
+    const Int_t totalEntries= useStream ? evEnd : summaryHandler_.getEntries();
+    float rescaleFactor( evEnd>0 && !useStream ?  float(totalEntries)/float(evEnd-evStart) : -1 );
+    if(evEnd<0 || evEnd>totalEntries ) evEnd=totalEntries;
     if(evStart > evEnd ) {
-        file->Close();
+        if(file) file->Close();
         return -1;
     }
 
+    //optional skim: events passing the lepton + (b-)jet preselection are copied to a slimmed summary tree,
+    //together with the bookkeeping histograms of the input file needed for the normalisation
+    bool saveSummaryTree = runProcess.getParameter<bool>("saveSummaryTree");
+    int skimMinLeptons = runProcess.getUntrackedParameter<int>("skimMinLeptons", 1);
+    int skimMinBJets = runProcess.getUntrackedParameter<int>("skimMinBJets", 1);
+    std::vector<std::string> skimBranchGroups = runProcess.getUntrackedParameter<std::vector<std::string> >("skimBranchGroups", std::vector<std::string>());
+    TFile *skimFile = NULL;
+    if(saveSummaryTree && useStream) {
+        printf("saveSummaryTree is not supported on streamed input, no skim will be written\n");
+    } else if(saveSummaryTree) {
+        //kept in a subdirectory so that the skims are not mistaken for plotter inputs
+        gSystem->Exec("mkdir -p " + outUrl + "/summary");
+        TString skimUrl = outUrl + "/summary/" + outFileUrl + ".root";
+        skimFile = TFile::Open(skimUrl, "recreate");
+        if(skimFile==0 || skimFile->IsZombie()) {
+            file->Close();
+            return -1;
+        }
+        TIter nextKey(file->GetListOfKeys());
+        while(TKey *key = (TKey*)nextKey()) {
+            TClass *cl = TClass::GetClass(key->GetClassName());
+            if(!cl || !cl->InheritsFrom("TH1")) continue;
+            TObject *obj = key->ReadObj();
+            skimFile->cd();
+            obj->Write(key->GetName());
+            delete obj;
+        }
+        //keep the tree at the same path as in the input file
+        skimFile->cd();
+        if(dirname.Contains("/")) skimFile->mkdir(TString(gSystem->DirName(dirname)))->cd();
+        bool copyAll = (skimMinLeptons<=0 && skimMinBJets<=0 && evStart==0 && evEnd==totalEntries && isMC);
+        summaryHandler_.initSkimTree(skimBranchGroups, copyAll);
+        if(copyAll) saveSummaryTree = false;
+        printf("Saving %s summary tree to %s\n", copyAll ? "the full" : "a preselected", skimUrl.Data());
+    }
+
     //MC normalization (to 1/pb)
     /*
     float cnorm=1.0;
@@ -427,23 +493,27 @@ int main(int argc, char* argv[])
 
 
     // loop on all the events
-    int treeStep = (evEnd-evStart)/50;
-    if(treeStep==0)treeStep=1;
+    //progress (rate, MB/s, ETA, memory) printed every heartbeat seconds and optionally written to a status file for the batch scripts
+    std::string statusFile = runProcess.getUntrackedParameter<std::string>("statusFile", "");
+    double heartbeat = runProcess.getUntrackedParameter<double>("heartbeat", 30.);
+    ProgressMonitor progress(outFileUrl.Data(), useStream ? -1 : evEnd-evStart, "events", statusFile, heartbeat);
+    progress.setCommand(argc, argv);
     DuplicatesChecker duplicatesChecker;
     int nDuplicates(0);
-    printf("Progressing Bar     :0%%       20%%       40%%       60%%       80%%       100%%\n");
-    printf("Scanning the ntuple :");
 
     for( int iev=evStart; iev<evEnd; iev++) {
-        if((iev-evStart)%treeStep==0) {
-	  printf("."); fflush(stdout);
-        }
+        progress.update(iev-evStart);
 
 	if ( verbose ) printf("\n\n Event info %3d: \n",iev);
 
         //##############################################   EVENT LOOP STARTS   ##############################################
         //load the event content from tree
-        summaryHandler_.getEntry(iev);
+        profUtils::beginEvent();
+        profUtils::mark(readStage);
+        if(useStream) {
+            if( !summaryStream_.pop(summaryHandler_.getEvent()) ) break;
+        }
+        else summaryHandler_.getEntry(iev);
         DataEvtSummary_t &ev=summaryHandler_.getEvent();
         if(!isMC && duplicatesChecker.isDuplicate( ev.run, ev.lumi, ev.event) ) {
             nDuplicates++;
@@ -481,7 +551,9 @@ int main(int argc, char* argv[])
 	*/
 
         // add PhysicsEvent_t class, get all tree to physics objects
+        profUtils::mark(physicsStage);
         PhysicsEvent_t phys=getPhysicsEventFrom(ev);
+        profUtils::mark(selectionStage);
 
         // FIXME need to have a function: loop all leptons, find a Z candidate,
         // can have input, ev.mn, ev.en
@@ -726,6 +798,7 @@ int main(int argc, char* argv[])
 
                 bool hasCSVtag(corrJets[ijet].btag0>CSVLooseWP);
 		if (isMC) {
+		  profUtils::ScopedTimer btagSFTimer(btagSFStage);
 		  // Apply b-tag SFs with Moriond17 recommendations (2016 data):
 		  btsfutil.SetSeed(ev.event*10 + ijet*10000);
 
@@ -795,6 +868,10 @@ int main(int argc, char* argv[])
 	  }
 	  
 	} // AK8 fatJets loop
+
+	//skim: at least skimMinLeptons good leptons and skimMinBJets loose b-tagged AK4 (before SF) or double-b AK8 jets
+	if(saveSummaryTree && (int)goodLeptons.size()>=skimMinLeptons
+	   && (int)(std::max(nCSVLtags,(int)CSVLoosebJets.size()) + DBfatJets.size())>=skimMinBJets) summaryHandler_.fillSkimTree();
 	
 	//###########################################################
 	//  Configure cleaned Ak4 and AK4 + CSVloose Jets : 
@@ -994,6 +1071,7 @@ int main(int argc, char* argv[])
         //#########################################################
         //####  RUN PRESELECTION AND CONTROL REGION PLOTS  ########
         //#########################################################
+        profUtils::mark(categoryStage);
 
 
         //##############################################
@@ -1015,10 +1093,26 @@ int main(int argc, char* argv[])
 
 
     } // loop on all events END
-
-
-    printf("\n");
-    file->Close();
+    progress.update(useStream ? (long long)summaryStream_.getNProcessed() : evEnd-evStart);
+    progress.finish();
+    profUtils::endEvent();
+    profUtils::sampleMemory("after event loop");
+    profUtils::mark(outputStage);
+
+
+    //let the producer finish its own loop if we stopped before the end of the stream (evEnd)
+    summaryStream_.detach();
+    if(useStream) printf("Received %llu events from %s\n", summaryStream_.getNProcessed(), inputStream.c_str());
+    if(skimFile) {
+        TTree *skimTree = summaryHandler_.getSkimTree();
+        if(skimTree) {
+            printf("Summary tree: %lld events selected out of %d\n", skimTree->GetEntries(), evEnd-evStart);
+            skimTree->GetDirectory()->cd();
+            skimTree->Write();
+        }
+        skimFile->Close();
+    }
+    if(file) file->Close();
 
     //##############################################
     //########     SAVING HISTO TO FILE     ########
@@ -1034,5 +1128,7 @@ int main(int argc, char* argv[])
     ofile->Close();
 
     if(outTxtFile_final)fclose(outTxtFile_final);
+
+    if(profile!="") profUtils::writeSummary(profile);
 }
 
@@ -0,0 +1,88 @@
+#ifndef asymptoticlimits_h
+#define asymptoticlimits_h
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+//
+// Binned likelihood of a shape (or cut&count) analysis and asymptotic CLs limits on the signal strength r, following
+// combine -M Asymptotic (G. Cowan et al., EPJC 71 (2011) 1554, LHC test statistic with r>=0):
+//  - every bin is Poisson with expectation nu = sum over yields of r^isSignal * nominal * prod kappa(theta)
+//  - every nuisance has a unit gaussian constraint and acts on the yields through log-normal factors, asymmetric with
+//    the smooth interpolation of combine for |theta|<0.5 (AsymPow); a shape uncertainty is one factor per bin
+//  - the expected limits are computed on the Asimov dataset of the background-only fit to the data (combine default),
+//    each quantile from the crossing of its own CLs level, as combine does
+// The nuisances acting on a single bin (bin-by-bin stat uncertainties) are eliminated analytically in each step of
+// the fits, so their cost is linear in their number; the cost of a step is cubic in the number of the other ones.
+// It is meant for fast scans, the final results should still be computed with combine.
+// Validation: test/testAsymptoticLimits checks the closed form of a single bin and the reference limits of the cards of
+// test/haa4b/computeLimit (asymptoticReference_*.dat and .log), and compareAsymptotic.py of that directory compares with
+// combine on these cards or on the cards of a computeLimit --asymptotic output directory.
+//
+class AsymptoticLimits {
+public:
+    struct Result_t {
+        bool   valid;
+        double observed;      //-1 if not computed
+        double expected[5];   //quantiles 2.5%, 16%, 50%, 84% and 97.5%
+        double significance;  //expected significance for r=1 (a priori Asimov), -1 if not computed
+        int    nFits;
+    };
+
+    AsymptoticLimits();
+
+    //a new bin with the observed data, returns its index
+    int addBin(double data);
+
+    //nominal yield of a process in a bin, returns its index
+    int addYield(int bin, double nominal, bool isSignal);
+
+    //effect of a nuisance on a yield: ratio of the yield for theta=+1 (kappaUp) and theta=-1 (kappaDown) to the nominal
+    void addEffect(int yield, const std::string& nuisance, double kappaUp, double kappaDown);
+
+    int nBins() const { return data_.size(); }
+    int nNuisances() const { return nuisanceNames_.size(); }
+
+    //expected limits at the confidence level cl, the observed one if observed=true and the expected significance
+    //if significance=true; returns false if the model has no signal or if a limit could not be found
+    bool compute(Result_t& result, bool observed=false, bool significance=false, double cl=0.95);
+
+    //same lines as combine, so that the scripts can parse both
+    static void print(FILE* pFile, const Result_t& result);
+
+private:
+    struct Effect_t { int nuisance; double logKappaHi, logKappaLo; };
+
+    void finalize();
+    void yieldValues(double r, const std::vector<double>& theta, std::vector<double>& nu) const;
+    double nll(const std::vector<double>& data, const std::vector<double>& glob, double r, const std::vector<double>& theta) const;
+    double fit(const std::vector<double>& data, const std::vector<double>& glob, double& r, bool fixR, std::vector<double>& theta);
+    double qAsimov(double r);
+    double clsObserved(double r, double rHat, double nllMin);
+
+    //model
+    std::vector<double> data_;
+    std::vector<int>    yieldBin_;
+    std::vector<double> yieldNominal_;
+    std::vector<char>   yieldSignal_;
+    std::vector<std::vector<Effect_t> > effects_;  //per yield
+    std::vector<std::string> nuisanceNames_;
+    std::map<std::string, int> nuisanceIndex_;
+
+    //built by finalize(): yields of each bin, bin of the nuisances acting on a single bin (-1 for the others) and
+    //position of the other ones in the matrix of the fit (r is at 0)
+    bool finalized_;
+    std::vector<std::vector<int> > binYields_;
+    std::vector<int> nuisanceBin_;
+    std::vector<int> nuisanceSlot_;
+    int nSlots_;
+
+    //Asimov dataset of the background-only fit to the data
+    std::vector<double> asimovData_, asimovGlob_, asimovTheta_;
+    double asimovNllMin_;
+    int nFits_;
+};
+
+#endif
@@ -8,6 +8,9 @@
 #include <iostream>
 #include <fstream>
 #include <set>
+#include <map>
+#include <vector>
+#include <string>
 #include <cmath>
 
 #include "Math/LorentzVector.h"
@@ -83,7 +86,7 @@ struct DataEvtSummary_t {
     Bool_t mn_IsLoose[MAXPARTICLES],mn_IsMedium[MAXPARTICLES],mn_IsTight[MAXPARTICLES],mn_IsSoft[MAXPARTICLES],mn_IsHighPt[MAXPARTICLES];
     Float_t mn_pileupIsoR03[MAXPARTICLES],mn_chargedIsoR03[MAXPARTICLES],mn_photonIsoR03[MAXPARTICLES],mn_neutralHadIsoR03[MAXPARTICLES];
     Float_t mn_pileupIsoR04[MAXPARTICLES],mn_chargedIsoR04[MAXPARTICLES],mn_photonIsoR04[MAXPARTICLES],mn_neutralHadIsoR04[MAXPARTICLES];
-    Bool_t mn_passId[MAXPARTICLES],mn_passIdLoose[MAXPARTICLES],mn_passSoftMuon[MAXPARTICLES],mn_passIso[MAXPARTICLES];
+    Bool_t mn_passId[MAXPARTICLES],mn_passIdLoose[MAXPARTICLES],mn_passSoftMuon[MAXPARTICLES],mn_passIso[MAXPARTICLES],mn_passIsoBoosted[MAXPARTICLES];
     Float_t mn_nMatches[MAXPARTICLES],mn_nMatchedStations[MAXPARTICLES],mn_validMuonHits[MAXPARTICLES],mn_innerTrackChi2[MAXPARTICLES],mn_trkLayersWithMeasurement[MAXPARTICLES],mn_pixelLayersWithMeasurement[MAXPARTICLES];
 
     //electron
@@ -191,6 +194,12 @@ public:
     bool initTree(TTree *t);
     void fillTree();
 
+    //output tuning (write mode, to be called after initTree)
+    static int getCompressionSettings(std::string preset, int level=-1);
+    static std::string getBranchGroup(const std::string& branchName);
+    void configureOutput(int compressionSettings, Int_t basketSize, Long64_t autoFlush);
+    void printBranchGroupSizes();
+
     //read mode
     bool attachToTree(TTree *t);
     int getEntries() { return (t_ ? t_->GetEntriesFast() : 0); }
@@ -201,9 +210,17 @@ public:
 
     void resetStruct();
 
+    //skim mode (read mode, to be called after attachToTree): clone the structure of the input tree into the
+    //current directory, keeping only the requested branch groups (all if empty), and copy selected entries;
+    //with copyAll the full tree is fast-cloned at once (no fillSkimTree needed)
+    TTree *initSkimTree(const std::vector<std::string>& keepGroups, bool copyAll=false);
+    void fillSkimTree();
+    TTree *getSkimTree() { return skimT_; }
+
 private:
     //the tree
     TTree *t_;
+    TTree *skimT_;
 };
 
 #endif
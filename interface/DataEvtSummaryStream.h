@@ -0,0 +1,59 @@
+#ifndef dataevtsummarystream_h
+#define dataevtsummarystream_h
+
+#include <string>
+#include <sys/types.h>
+#include <semaphore.h>
+
+#include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryHandler.h"
+
+struct DataEvtSummaryStreamHeader_t;
+
+//
+// Bounded ring of DataEvtSummary_t records in POSIX shared memory, used to pipe the ntuplizer
+// output directly into an analysis process running on the same node (no intermediate ntuple).
+// The producer blocks when all slots are in use (back-pressure), the consumer blocks when the
+// ring is empty; memory usage is fixed to nSlots*sizeof(DataEvtSummary_t).
+//
+class DataEvtSummaryStream {
+public:
+    DataEvtSummaryStream();
+    ~DataEvtSummaryStream();
+
+    //producer side: create the ring, fails if a running job already streams under this name (the segment left by a
+    //dead producer is reclaimed); push gives up if no consumer attached within attachTimeout seconds of the ring
+    //filling up, the destructor waits as long for a consumer before dropping the events left in the ring (<0 waits forever)
+    bool create(const std::string& name, unsigned int nSlots=16, int attachTimeout=600);
+    //blocks until a slot is free, returns false if the consumer went away or detached
+    bool push(const DataEvtSummary_t& ev);
+    //true if push failed because the consumer stopped reading on purpose (see detach)
+    bool consumerDetached() const { return consumerDetached_; }
+    //signal the end of the stream to the consumer
+    void close();
+
+    //consumer side: attach to an existing ring, waiting up to timeout seconds for the producer
+    bool attach(const std::string& name, int timeout=600);
+    //blocks until a record is available, returns false at the end of the stream
+    bool pop(DataEvtSummary_t& ev);
+    //tell the producer no more records will be read (also done when the consumer is destroyed)
+    void detach();
+
+    unsigned long long getNProcessed() const { return nProcessed_; }
+
+private:
+    bool waitSlot(sem_t* sem);
+    void release();
+
+    std::string name_;
+    bool isProducer_;
+    bool closed_;
+    bool consumerDetached_;
+    int attachTimeout_;
+    bool attachTimedOut_;
+    size_t size_;
+    DataEvtSummaryStreamHeader_t* header_;
+    DataEvtSummary_t* slots_;
+    unsigned long long nProcessed_;
+};
+
+#endif
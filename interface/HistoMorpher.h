@@ -0,0 +1,57 @@
+#ifndef histomorpher_h
+#define histomorpher_h
+
+#include <vector>
+#include <memory>
+
+class TH1;
+
+//
+// Cached version of th1fmorph (A. L. Read, NIM A 425 (1999) 357) for a pair of templates. The cumulative
+// distributions of the two inputs and the walk along them, which do not depend on the interpolation point, are
+// computed once in the constructor; morph() then only combines the cached points with the weights of the requested
+// parameter and projects them on the output binning, without allocating anything. The output binning (union of the
+// edges of the two inputs) can be shared by all the pairs with the same axes, e.g. the systematic variants of a shape.
+// The results are the same as th1fmorph, including the extrapolation warning and the empty input treatment (the
+// output is then empty, with the merged binning).
+//
+class HistoMorpher {
+public:
+    //binningFrom: morpher of another pair with the same input axes, whose output binning is reused
+    HistoMorpher(TH1* hist1, TH1* hist2, double par1, double par2, const HistoMorpher* binningFrom=NULL);
+
+    bool isValid() const { return valid_; }
+    //one of the inputs has no content, morph() returns an empty shape
+    bool isEmpty() const { return empty_; }
+
+    //output binning
+    int nBins() const { return binning_ ? (int)binning_->edges.size()-1 : 0; }
+    const std::vector<double>& edges() const { return binning_->edges; }
+
+    //content of the bins 1..nBins() of the interpolated shape at parinterp normalized to norm, written in out[0..nBins()-1]
+    void morph(double parinterp, double norm, double* out);
+
+    //same as h->Add(th1fmorph(...)) for a histogram h with the output binning (a temporary histogram is used otherwise)
+    void addTo(TH1* h, double parinterp, double norm);
+
+private:
+    struct Binning_t {
+        std::vector<double> edges1, edges2;  //edges of the inputs
+        std::vector<double> edges;           //merged edges of the output
+        std::vector<double> dx2;             //width of the bin of input 2 containing each output edge
+    };
+
+    bool sameAxes(TH1* hist1, TH1* hist2) const;
+
+    bool valid_, empty_, isFloat_;
+    double par1_, par2_;
+    std::shared_ptr<const Binning_t> binning_;
+
+    //points of the interpolated cumulative distribution: x = wt1*x1 + wt2*x2 at cumulative probability y
+    std::vector<double> x1_, x2_, y_;
+
+    //work arrays
+    std::vector<double> xdisn_, sigdisn_, sigdisf_, content_;
+};
+
+#endif
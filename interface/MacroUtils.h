@@ -151,6 +151,18 @@ namespace utils
       std::vector<double> smearJER(double pt, double eta, double genPt);
       std::vector<float> smearJES(double pt, double eta, JetCorrectionUncertainty *jecUnc);
    
+      // JER data/MC scale factor and its uncertainty for a given |eta| (table shared by all the smearing functions)
+      void getJERScaleFactor(double absEta, double& ptSF, double& ptSF_err);
+
+      // Batch JES/JER for n jets given as arrays (structure of arrays), results are written to caller-provided buffers of size n:
+      //   jecSF                  : raw pt -> corrected pt
+      //   jerSF, jerUp, jerDown  : JER smearing of the corrected pt and its up/down variations relative to the smeared pt (MC only, can be NULL)
+      //   jesUp, jesDown         : JES uncertainty variations relative to the smeared pt (MC only, can be NULL)
+      // genPt<=0 means no matched gen jet (no smearing)
+      void correctJets(size_t n, const float* rawPt, const float* eta, const float* area, const float* genPt, float rho, int nvtx,
+                       FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc,
+                       float* jecSF, float* jerSF=NULL, float* jerUp=NULL, float* jerDown=NULL, float* jesUp=NULL, float* jesDown=NULL);
+
 //    
 //    //set new jet energy corrections
      void updateJEC(pat::JetCollection& jets, FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc, float rho, int nvtx,bool isMC);
@@ -91,7 +91,9 @@ namespace patUtils
    bool passIso (VersionedPatElectronSelector id, pat::Electron& el);
    bool passIso(pat::Electron& el,  int IsoLevel, int cutVersion, double rho=0.0 ); // Old PHYS15 Iso
    bool passIso(pat::Muon&     mu,  int IsoLevel, int cutVersion);
-   bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, std::vector<pat::PackedCandidate> thePats, pat::MuonCollection muons, reco::Vertex& vertex );
+   class PFCandidateIsolation;
+   bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, const std::vector<pat::PackedCandidate>& thePats, pat::MuonCollection& muons, reco::Vertex& vertex );
+   bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, const PFCandidateIsolation& pfIso, pat::MuonCollection& muons, reco::Vertex& vertex );
    bool passPhotonTrigger(fwlite::Event &ev, float &triggerThreshold, float &triggerPrescale, float& triggerThresholdHigh);
    bool passVBFPhotonTrigger(fwlite::Event &ev, float &triggerThreshold, float &triggerPrescale, float& triggerThresholdHigh);
    bool passPFJetID(std::string label, pat::Jet jet);
@@ -110,8 +112,41 @@ namespace patUtils
   bool tightGlobal(const reco::Muon &mu)  ;
   bool safeId(const reco::Muon &mu)  ;
   bool partnerId(const reco::Muon &mu)  ;
-  float computePFphotonIsolation(std::vector<pat::PackedCandidate>, float , float , const pat::Muon &, pat::MuonCollection , reco::Vertex& vertex);
-  float makeTkIsoCloseBySafe( float coneSize, float initialValue, const pat::Muon &theMuon, pat::MuonCollection muons);
+  float computePFphotonIsolation(const std::vector<pat::PackedCandidate>&, float , float , const pat::Muon &, const pat::MuonCollection& , reco::Vertex& vertex);
+  float computePFphotonIsolation(const PFCandidateIsolation& pfIso, float , float , const pat::Muon &, const pat::MuonCollection& , reco::Vertex& vertex);
+  float makeTkIsoCloseBySafe( float coneSize, float initialValue, const pat::Muon &theMuon, const pat::MuonCollection& muons);
+
+   //event-scoped index over the packed PF candidates: the candidates are binned once in an eta-phi grid
+   //and cone queries around any lepton only visit the cells overlapping the cone
+   class PFCandidateIsolation{
+    public :
+     PFCandidateIsolation(const pat::PackedCandidateCollection& cands, float cellSize=0.1, float maxEta=5.0);
+     ~PFCandidateIsolation(){}
+
+     const pat::PackedCandidateCollection& candidates() const { return cands_; }
+     double eta(unsigned int i) const { return eta_[i]; }
+     double phi(unsigned int i) const { return phi_[i]; }
+     double pt (unsigned int i) const { return pt_[i]; }
+     int   absPdgId(unsigned int i) const { return absPdgId_[i]; }
+
+     //indices (in increasing order) of the candidates with deltaR2<=coneSize^2 around (eta,phi), optionally only for a given |pdgId|
+     void getNeighbours(double eta, double phi, float coneSize, std::vector<unsigned int>& out, int absPdgId=0) const;
+
+     //scalar pt sum of the candidates with vetoCone^2<=deltaR2<=coneSize^2 and pt>=threshold, optionally only for a given |pdgId|
+     float coneSum(double eta, double phi, float coneSize, int absPdgId=0, float threshold=0., float vetoCone=0.) const;
+
+    private :
+     int etaCell(double eta) const;
+     int phiCell(double phi) const;
+
+     const pat::PackedCandidateCollection& cands_;
+     float cellEta_, cellPhi_, maxEta_;
+     int nEta_, nPhi_;
+     std::vector<double> eta_, phi_, pt_;
+     std::vector<int> absPdgId_;
+     std::vector<unsigned int> cellStart_;  //candidates of cell c are cellCands_[cellStart_[c]..cellStart_[c+1]-1]
+     std::vector<unsigned int> cellCands_;
+   };
 
 
 
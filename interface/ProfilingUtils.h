@@ -0,0 +1,66 @@
+#ifndef profilingutils_h
+#define profilingutils_h
+
+#include <string>
+#include <vector>
+
+class TDirectory;
+
+//
+// Lightweight instrumentation shared by the executables: exclusive time per stage, per-event distributions of the
+// stage times, counters and memory samples, summarized in a JSON file (and optionally in a ROOT directory) at the
+// end of the job. Nothing is recorded until enable() is called and the inline entry points then only test a flag,
+// so the timers can stay in the event loops. Stages nest: the time is always given to the innermost active stage.
+// The timers are meant to be used from the main thread only.
+//
+namespace profUtils
+{
+   extern bool enabled;
+
+   //start recording; jobName is reported in the summary
+   void enable(const std::string& jobName);
+
+   //id of a stage, registered on the first call (can be used before enable, e.g. in static initializers)
+   int stage(const std::string& name);
+
+   void enterImpl(int id);
+   void leaveImpl();
+   void markImpl(int id);
+   void beginEventImpl();
+   void endEventImpl();
+
+   //enter a nested stage / go back to the enclosing one
+   inline void enter(int id){ if(enabled)enterImpl(id); }
+   inline void leave(){ if(enabled)leaveImpl(); }
+
+   //switch the current stage, for sequential code made of successive stages
+   inline void mark(int id){ if(enabled)markImpl(id); }
+
+   //delimit one event: the time spent in each stage during the event is added to its per-event distribution
+   inline void beginEvent(){ if(enabled)beginEventImpl(); }
+   inline void endEvent(){ if(enabled)endEventImpl(); }
+
+   //time the enclosing scope as a nested stage
+   class ScopedTimer{
+      public:
+         ScopedTimer(int id):active_(enabled){ if(active_)enterImpl(id); }
+         ~ScopedTimer(){ if(active_)leaveImpl(); }
+      private:
+         bool active_;
+   };
+
+   //add value to a named counter
+   void count(const std::string& name, double value=1.0);
+
+   //resident memory of the process in MB, field is "VmRSS" (current) or "VmHWM" (peak)
+   double getMemoryMB(const char* field);
+
+   //record the current and peak resident memory with a label
+   void sampleMemory(const std::string& label);
+
+   //close the current stage and write the summary to jsonFile; the per-event distributions are also written as
+   //histograms in dir (if not NULL)
+   void writeSummary(const std::string& jsonFile, TDirectory* dir=NULL);
+}
+
+#endif
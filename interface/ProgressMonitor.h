@@ -0,0 +1,56 @@
+#ifndef progressmonitor_h
+#define progressmonitor_h
+
+#include <string>
+
+//
+// Progress reporting for the event/object loops: every interval seconds a line with the processed
+// entries, the rate, the MB/s read from ROOT files, the ETA and the resident memory is printed, and
+// the same information is written to an optional status file (key = value lines, replaced atomically)
+// that the batch scripts read to spot stuck jobs and stragglers (see scripts/checkLocaljobs.py).
+// update() only decrements a counter between two clock checks, so it can be called for every entry.
+//
+class ProgressMonitor {
+public:
+    //total<=0 if the number of entries is not known in advance (no fraction and ETA then)
+    ProgressMonitor(const std::string& name, long long total, const std::string& unit="events",
+                    const std::string& statusFile="", double interval=30);
+    ~ProgressMonitor();
+
+    //record the command line of the job in the status file (used to resubmit it)
+    void setCommand(int argc, char* argv[]);
+    void setTotal(long long total) { total_ = total; }
+
+    inline void update(long long done) { done_ = done; if(--countdown_<=0) check(); }
+    inline void increment() { update(done_+1); }
+
+    //final report; ok=false marks the job as failed in the status file
+    void finish(bool ok=true);
+
+    long long getDone() const { return done_; }
+
+private:
+    void check();
+    void report(const char* state);
+    void writeStatus(const char* state, double now, double rate, double mbRate, double eta, double rss);
+
+    std::string name_;
+    std::string unit_;
+    std::string statusFile_;
+    std::string command_;
+    double interval_;
+    long long total_;
+    long long done_;
+    long long countdown_;
+    long long step_;
+    double startTime_;
+    double lastReport_;
+    long long lastDone_;
+    double lastCheck_;
+    long long lastCheckDone_;
+    double lastBytes_;
+    double startBytes_;
+    bool finished_;
+};
+
+#endif
@@ -23,12 +23,15 @@
 #include "TMultiGraph.h"
 #include "TPaveText.h"
 #include "THStack.h"
+#include "TKey.h"
+#include "TClass.h"
 
 #include <vector>
 #include <list>
 #include <iterator>
 #include <algorithm>
 #include <unordered_map>
+#include <set>
 #include <iostream>
 #include <string>
 #include <regex>
@@ -205,6 +208,78 @@ namespace utils
       }
    }
 
+   //
+   // Index of all the objects of a file (or directory) by full path ("dir/subdir/name"), built by walking
+   // the in-memory lists and key lists once. Absent objects are resolved by an index miss instead of failed
+   // TDirectory::Get calls; present objects are only read when requested, exactly as GetObjectFromPath does.
+   // The index must be rebuilt (or cleared) after objects are added to the indexed directories.
+   class ObjectIndex{
+      public:
+         ObjectIndex(TDirectory* dir=NULL):top_(NULL){ if(dir)build(dir); }
+
+         void build(TDirectory* dir){
+            clear();
+            top_ = dir;
+            addDirectory(dir, "");
+         }
+         void clear(){ top_=NULL; objects_.clear(); inMemory_.clear(); }
+         bool isBuiltFor(TDirectory* dir) const { return top_ && top_==dir; }
+
+         bool contains(const std::string& path) const { return objects_.find(path)!=objects_.end(); }
+         std::string getClassName(const std::string& path) const {
+            std::unordered_map<std::string, Entry_t>::const_iterator it = objects_.find(path);
+            return it==objects_.end() ? "" : it->second.className;
+         }
+         TObject* get(const std::string& path) const {
+            std::unordered_map<std::string, Entry_t>::const_iterator it = objects_.find(path);
+            if(it==objects_.end())return NULL;
+            return it->second.dir->Get(it->second.name.c_str());
+         }
+         //true if the object was already in the memory of its directory when the index was built (get() then returns
+         //that object, owned by the directory); objects read from disk by get() are owned by the caller
+         bool isInMemory(TDirectory* dir, const std::string& name) const { return inMemory_.count(std::make_pair(dir, name))>0; }
+
+      private:
+         struct Entry_t{
+            TDirectory* dir;
+            std::string name;
+            std::string className;
+         };
+
+         void addDirectory(TDirectory* dir, const std::string& prefix){
+            std::vector<std::string> subdirs;
+
+            //objects already in memory (possibly not yet written)
+            TIter nextObj(dir->GetList());
+            while(TObject* obj = nextObj()){
+               if(obj->InheritsFrom("TDirectory")){ subdirs.push_back(obj->GetName()); continue; }
+               Entry_t entry = {dir, obj->GetName(), obj->ClassName()};
+               objects_.insert(std::make_pair(prefix+obj->GetName(), entry));
+               inMemory_.insert(std::make_pair(dir, std::string(obj->GetName())));
+            }
+
+            //objects on disk, only the first (highest) cycle of each name is relevant
+            TIter nextKey(dir->GetListOfKeys());
+            while(TKey* key = (TKey*)nextKey()){
+               TClass* cl = TClass::GetClass(key->GetClassName());
+               if(cl && cl->InheritsFrom("TDirectory")){ subdirs.push_back(key->GetName()); continue; }
+               Entry_t entry = {dir, key->GetName(), key->GetClassName()};
+               objects_.insert(std::make_pair(prefix+key->GetName(), entry));
+            }
+
+            std::sort(subdirs.begin(), subdirs.end());
+            subdirs.erase(std::unique(subdirs.begin(), subdirs.end()), subdirs.end());
+            for(unsigned int d=0;d<subdirs.size();d++){
+               TDirectory* subdir = dir->GetDirectory(subdirs[d].c_str());
+               if(subdir)addDirectory(subdir, prefix+subdirs[d]+"/");
+            }
+         }
+
+         TDirectory* top_;
+         std::unordered_map<std::string, Entry_t> objects_;
+         std::set<std::pair<TDirectory*, std::string> > inMemory_;
+   };
+
   }
 }
 
@@ -2,22 +2,74 @@
 import os,sys
 import getopt
 import commands
+import glob
+import time
 
 
-SCRIPT = open('script_resubmit2local.sh',"w")
+"""
+Reads the status files written by the jobs (statusFile parameter, see ProgressMonitor)
+and returns them as dictionaries
+"""
+def readStatusFiles(dirs):
+	jobs = []
+	for d in dirs:
+		for f in sorted(glob.glob(d+'/*.status')):
+			job = {'file':f}
+			for line in open(f):
+				if(' = ' not in line):continue
+				key,val = line.rstrip('\n').split(' = ',1)
+				job[key] = val
+			try:
+				for key in ['done','total','rate','eta','elapsed','rssMB','interval','updated']: job[key] = float(job[key])
+			except (KeyError,ValueError):
+				print "Can not parse " + f
+				continue
+			jobs.append(job)
+	return jobs
+
 
-status, output = commands.getstatusoutput('ps -fww')
-alljobs = output.split('\n')
+SCRIPT = open('script_resubmit2local.sh',"w")
 
 SCRIPT.writelines('#!bin/sh \n\n')
 SCRIPT.writelines('set CWD = `pwd`; \n')
 SCRIPT.writelines('cd $CMSSW_BASE/src/UserCode/bsmhiggs_fwk/; \n\n')
 
-for line in alljobs:
-	if 'run2015_WIMPAnalysis' in line:
-		print line
-		ll=line.split()
-		SCRIPT.writelines(ll[7]+' '+ll[8]+' & ; \n')
+if(len(sys.argv)>1):
+	#status files of the jobs in the given directories: flag the jobs without heartbeat (stuck),
+	#the failed ones and the stragglers (expected to finish much later than the other running jobs)
+	now = time.time()
+	jobs = readStatusFiles(sys.argv[1:])
+	running = [j for j in jobs if j['state']=='running' and now-j['updated'] < 3*j['interval']+60]
+	etas = sorted([j['eta'] for j in running if j['eta']>=0])
+	medianEta = etas[len(etas)/2] if len(etas)>0 else -1
+
+	counts = {}
+	for j in jobs:
+		status = j['state']
+		if(status=='running' and j not in running): status = 'stuck'
+		elif(status=='running' and medianEta>0 and j['eta']>max(2*medianEta, medianEta+600)): status = 'straggler'
+		counts[status] = counts.get(status,0)+1
+
+		fraction = '%5.1f%%' % (100.*j['done']/j['total']) if j['total']>0 else '     ?'
+		eta = '%6.0fs' % j['eta'] if j['eta']>=0 else '      ?'
+		print '%-10s %s %10.1f %s/s  ETA %s  RSS %7.1f MB  %s:%s  %s' % (status, fraction, j['rate'], j['unit'], eta, j['rssMB'], j['host'], j['pid'], j['name'])
+
+		#stuck and failed jobs are run again, stragglers are only reported (split them with evStart/evEnd if needed)
+		if(status in ['stuck','failed'] and j['command']!=''):
+			if(status=='stuck'): SCRIPT.writelines('ssh ' + j['host'] + ' kill ' + j['pid'] + ' ; \n')
+			SCRIPT.writelines(j['command'] + ' & ; \n')
+
+	print ', '.join(['%d %s' % (counts[s], s) for s in sorted(counts)])
+	if(medianEta>0): print 'median ETA of the running jobs: %.0f s' % medianEta
+else:
+	status, output = commands.getstatusoutput('ps -fww')
+	alljobs = output.split('\n')
+
+	for line in alljobs:
+		if 'run2015_WIMPAnalysis' in line:
+			print line
+			ll=line.split()
+			SCRIPT.writelines(ll[7]+' '+ll[8]+' & ; \n')
 
 
 
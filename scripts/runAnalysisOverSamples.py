@@ -337,6 +337,11 @@ for procBlock in procList :
             	   sedcmd += '\''
                    cfgfile=prodfilepath + '_cfg.py'
                    os.system('cat ' + opt.cfg_file + ' | ' + sedcmd + ' > ' + cfgfile)
+                   #progress of the job, checked by checkLocaljobs.py to find stuck jobs and stragglers
+                   if(LaunchOnCondor.subTool!='crab'):
+                      cfgout = open(cfgfile, 'a')
+                      cfgout.write('runProcess.statusFile = cms.untracked.string("' + os.path.abspath(prodfilepath) + '.status")\n')
+                      cfgout.close()
 
                    #run the job
                    if len(opt.queue)==0 :
@@ -0,0 +1,425 @@
+#include "UserCode/bsmhiggs_fwk/interface/AsymptoticLimits.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "Math/ProbFuncMathCore.h"
+#include "Math/QuantFuncMathCore.h"
+
+using namespace std;
+
+//exponent theta*log(kappa(theta)) of the factor of a nuisance on a yield and its derivative: log-normal with kappaHi
+//above theta=0.5 and kappaLo below -0.5, and a polynomial interpolation of log(kappa) in between (AsymPow of combine)
+static inline double logFactor(double logKappaHi, double logKappaLo, double x, double& dfdx)
+{
+    if(fabs(x)>=0.5){
+        double logKappa = x>=0 ? logKappaHi : -logKappaLo;
+        dfdx = logKappa;
+        return logKappa*x;
+    }
+    double avg = 0.5*(logKappaHi - logKappaLo), halfdiff = 0.5*(logKappaHi + logKappaLo);
+    double twox = x+x, twox2 = twox*twox;
+    double alpha  = 0.125*twox*(twox2*(3*twox2-10)+15);
+    double dalpha = 3.75*(twox2-1)*(twox2-1);
+    double logKappa = avg + alpha*halfdiff;
+    dfdx = logKappa + x*dalpha*halfdiff;
+    return logKappa*x;
+}
+
+//solve A x = b in place for a symmetric positive definite matrix (A is destroyed), false if it is not positive definite
+static bool choleskySolve(std::vector<double>& A, int n, std::vector<double>& b)
+{
+    for(int j=0; j<n; j++){
+        double d = A[j*n+j];
+        for(int k=0; k<j; k++) d -= A[j*n+k]*A[j*n+k];
+        if(!(d>0)) return false;
+        d = sqrt(d);
+        A[j*n+j] = d;
+        for(int i=j+1; i<n; i++){
+            double s = A[i*n+j];
+            for(int k=0; k<j; k++) s -= A[i*n+k]*A[j*n+k];
+            A[i*n+j] = s/d;
+        }
+    }
+    for(int i=0; i<n; i++){
+        double s = b[i];
+        for(int k=0; k<i; k++) s -= A[i*n+k]*b[k];
+        b[i] = s/A[i*n+i];
+    }
+    for(int i=n-1; i>=0; i--){
+        double s = b[i];
+        for(int k=i+1; k<n; k++) s -= A[k*n+i]*b[k];
+        b[i] = s/A[i*n+i];
+    }
+    return true;
+}
+
+//
+AsymptoticLimits::AsymptoticLimits():
+    finalized_(false), nSlots_(1), asimovNllMin_(0), nFits_(0)
+{
+}
+
+//
+int AsymptoticLimits::addBin(double data)
+{
+    finalized_ = false;
+    data_.push_back(data);
+    return data_.size()-1;
+}
+
+//
+int AsymptoticLimits::addYield(int bin, double nominal, bool isSignal)
+{
+    if(bin<0 || bin>=(int)data_.size()){ printf("AsymptoticLimits: yield added to the unknown bin %i\n", bin); return -1; }
+    finalized_ = false;
+    yieldBin_.push_back(bin);
+    yieldNominal_.push_back(nominal);
+    yieldSignal_.push_back(isSignal);
+    effects_.push_back(std::vector<Effect_t>());
+    return yieldBin_.size()-1;
+}
+
+//
+void AsymptoticLimits::addEffect(int yield, const std::string& nuisance, double kappaUp, double kappaDown)
+{
+    if(yield<0 || yield>=(int)yieldBin_.size())return;
+    finalized_ = false;
+    std::map<std::string, int>::iterator it = nuisanceIndex_.find(nuisance);
+    int k;
+    if(it!=nuisanceIndex_.end()){
+        k = it->second;
+    }else{
+        k = nuisanceNames_.size();
+        nuisanceIndex_[nuisance] = k;
+        nuisanceNames_.push_back(nuisance);
+    }
+    if(kappaUp==1 && kappaDown==1)return;  //the nuisance exists but has no effect on this yield
+
+    //variations to zero (or negative) are limited to a factor 1000, as the log-normal can not reach them
+    Effect_t effect;
+    effect.nuisance   = k;
+    effect.logKappaHi = log(std::min(1E3, std::max(1E-3, kappaUp  )));
+    effect.logKappaLo = log(std::min(1E3, std::max(1E-3, kappaDown)));
+    if(!(fabs(effect.logKappaHi)<1E3) || !(fabs(effect.logKappaLo)<1E3))return;  //NaN
+    effects_[yield].push_back(effect);
+}
+
+//
+void AsymptoticLimits::finalize()
+{
+    if(finalized_)return;
+    finalized_ = true;
+    int K = nuisanceNames_.size();
+    binYields_.assign(data_.size(), std::vector<int>());
+    for(unsigned int y=0; y<yieldBin_.size(); y++) binYields_[yieldBin_[y]].push_back(y);
+
+    //nuisances acting on a single bin (-2 for the ones without any effect, -1 for the ones on several bins)
+    nuisanceBin_.assign(K, -2);
+    for(unsigned int y=0; y<yieldBin_.size(); y++){
+        for(unsigned int e=0; e<effects_[y].size(); e++){
+            int& bin = nuisanceBin_[effects_[y][e].nuisance];
+            if(bin==-2) bin = yieldBin_[y];
+            else if(bin!=yieldBin_[y]) bin = -1;
+        }
+    }
+    nSlots_ = 1;
+    nuisanceSlot_.assign(K, -1);
+    for(int k=0; k<K; k++){ if(nuisanceBin_[k]==-1) nuisanceSlot_[k] = nSlots_++; }
+}
+
+//
+void AsymptoticLimits::yieldValues(double r, const std::vector<double>& theta, std::vector<double>& nu) const
+{
+    nu.assign(data_.size(), 0.);
+    double d;
+    for(unsigned int y=0; y<yieldBin_.size(); y++){
+        double lv = 0;
+        const std::vector<Effect_t>& effects = effects_[y];
+        for(unsigned int e=0; e<effects.size(); e++) lv += logFactor(effects[e].logKappaHi, effects[e].logKappaLo, theta[effects[e].nuisance], d);
+        nu[yieldBin_[y]] += (yieldSignal_[y] ? r : 1.)*yieldNominal_[y]*exp(lv);
+    }
+}
+
+//negative log likelihood, up to a constant (it is 0 for nu=data and theta=glob)
+double AsymptoticLimits::nll(const std::vector<double>& data, const std::vector<double>& glob, double r, const std::vector<double>& theta) const
+{
+    std::vector<double> nu;
+    yieldValues(r, theta, nu);
+    double f = 0;
+    for(unsigned int b=0; b<nu.size(); b++){
+        double n = nu[b];
+        if(n<=0){ if(data[b]<=0)continue; n = 1E-9; }
+        f += n - data[b];
+        if(data[b]>0) f += data[b]*log(data[b]/n);
+    }
+    for(unsigned int k=0; k<theta.size(); k++) f += 0.5*(theta[k]-glob[k])*(theta[k]-glob[k]);
+    return f;
+}
+
+//
+// Minimum of the negative log likelihood with respect to r (r>=0, unless fixR) and to the nuisances, found with
+// damped Fisher scoring steps. The Fisher matrix of a bin has rank one, so the nuisances of a single bin are eliminated
+// with the Sherman-Morrison formula and only the matrix of r and of the nuisances acting on several bins is solved.
+//
+double AsymptoticLimits::fit(const std::vector<double>& data, const std::vector<double>& glob, double& r, bool fixR, std::vector<double>& theta)
+{
+    nFits_++;
+    const int K = nuisanceNames_.size();
+    const int B = data_.size();
+    const int S = nSlots_;
+
+    //jacobian entries of each bin: parameter (-1 for r, nuisance index otherwise) and derivative of nu
+    std::vector<int> jacParam;  std::vector<double> jacValue;  std::vector<int> jacOffset(B+1, 0);
+    std::vector<double> binW(B), binDenom(B), binLG(B);
+    std::vector<double> jac(K, 0.), derivs, grad(K), hess(S*S), rhs(S), step(K);
+    std::vector<char> touchedFlag(K, 0);
+    std::vector<int> touched;
+    std::vector<double> thetaNew(K);
+
+    double f = nll(data, glob, r, theta);
+    double lambda = 0;
+    for(int iter=0; iter<200; iter++){
+        double e = 1+lambda;
+        double gradR = 0;
+        std::fill(hess.begin(), hess.end(), 0.);
+        std::fill(rhs.begin(), rhs.end(), 0.);
+        jacParam.clear(); jacValue.clear();
+        for(int k=0; k<K; k++) grad[k] = theta[k]-glob[k];
+
+        for(int b=0; b<B; b++){
+            jacOffset[b] = jacParam.size();
+            touched.clear();
+            double nub = 0, jr = 0;
+            const std::vector<int>& yields = binYields_[b];
+            for(unsigned int i=0; i<yields.size(); i++){
+                int y = yields[i];
+                const std::vector<Effect_t>& effects = effects_[y];
+                derivs.resize(effects.size());
+                double lv = 0;
+                for(unsigned int j=0; j<effects.size(); j++) lv += logFactor(effects[j].logKappaHi, effects[j].logKappaLo, theta[effects[j].nuisance], derivs[j]);
+                double v = yieldNominal_[y]*exp(lv);
+                double nuy = yieldSignal_[y] ? r*v : v;
+                nub += nuy;
+                if(yieldSignal_[y]) jr += v;
+                for(unsigned int j=0; j<effects.size(); j++){
+                    int k = effects[j].nuisance;
+                    if(!touchedFlag[k]){ touchedFlag[k] = 1; touched.push_back(k); jac[k] = 0; }
+                    jac[k] += nuy*derivs[j];
+                }
+            }
+            if(nub<=0){
+                for(unsigned int i=0; i<touched.size(); i++) touchedFlag[touched[i]] = 0;
+                if(data[b]<=0)continue;
+                nub = 1E-9;
+            }
+            double w = 1/nub;
+            double res = 1 - data[b]*w;
+
+            //gradient, and the sums over the nuisances of this bin for the elimination
+            double a = 0, lg = 0;
+            gradR += res*jr;
+            if(jr!=0){ jacParam.push_back(-1); jacValue.push_back(jr); }
+            for(unsigned int i=0; i<touched.size(); i++){
+                int k = touched[i];
+                touchedFlag[k] = 0;
+                grad[k] += res*jac[k];
+                jacParam.push_back(k); jacValue.push_back(jac[k]);
+                if(nuisanceSlot_[k]<0){ a += jac[k]*jac[k]; }
+            }
+            for(unsigned int i=0; i<touched.size(); i++){
+                int k = touched[i];
+                if(nuisanceSlot_[k]<0) lg += jac[k]*(theta[k]-glob[k] + res*jac[k]);
+            }
+            binW[b] = w; binDenom[b] = e + w*a; binLG[b] = lg;
+
+            //Schur complement of the nuisances of this bin: the weight of the rank one matrix is reduced and the
+            //right hand side gets their gradient projected on the jacobian
+            double wEff = w*e/binDenom[b];
+            double rhsShift = res - w*lg/binDenom[b];
+            int begin = jacOffset[b], end = jacParam.size();
+            for(int i=begin; i<end; i++){
+                int si = jacParam[i]<0 ? 0 : nuisanceSlot_[jacParam[i]];
+                if(si<0)continue;
+                rhs[si] += rhsShift*jacValue[i];
+                for(int j=begin; j<end; j++){
+                    int sj = jacParam[j]<0 ? 0 : nuisanceSlot_[jacParam[j]];
+                    if(sj<0)continue;
+                    hess[si*S+sj] += wEff*jacValue[i]*jacValue[j];
+                }
+            }
+        }
+        jacOffset[B] = jacParam.size();
+
+        //constraints of the nuisances acting on several bins, damping, and r at its bound
+        for(int k=0; k<K; k++){
+            int s = nuisanceSlot_[k];
+            if(s<0)continue;
+            rhs[s] += theta[k]-glob[k];
+            hess[s*S+s] += e;
+        }
+        hess[0] += lambda*hess[0] + 1E-12;
+        bool freezeR = fixR || (r<=0 && -rhs[0]/hess[0]<0);
+        if(freezeR){
+            for(int s=0; s<S; s++){ hess[s] = 0; hess[s*S] = 0; }
+            hess[0] = 1; rhs[0] = 0;
+        }
+        for(int s=0; s<S; s++) rhs[s] = -rhs[s];
+        if(!choleskySolve(hess, S, rhs)){ lambda = lambda>0 ? lambda*10 : 1E-3; if(lambda>1E8)break; continue; }
+
+        //steps of the nuisances: the ones on several bins from the solution, the ones on a single bin by substitution
+        double stepR = rhs[0];
+        for(int k=0; k<K; k++){ int s = nuisanceSlot_[k]; step[k] = s>0 ? rhs[s] : 0.; }
+        for(int b=0; b<B; b++){
+            int begin = jacOffset[b], end = jacOffset[b+1];
+            if(begin==end)continue;
+            double t = 0, c = binW[b]/(e*binDenom[b]);
+            for(int i=begin; i<end; i++){
+                int p = jacParam[i];
+                t += jacValue[i]*(p<0 ? stepR : step[p]);
+            }
+            for(int i=begin; i<end; i++){
+                int k = jacParam[i];
+                if(k<0 || nuisanceSlot_[k]>=0)continue;
+                step[k] = -(grad[k]/e - c*binLG[b]*jacValue[i]) - binW[b]*t*jacValue[i]/binDenom[b];
+            }
+        }
+        double predicted = -gradR*stepR;
+        for(int k=0; k<K; k++) predicted -= grad[k]*step[k];
+        if(predicted<1E-9)break;  //converged
+
+        //backtracking line search
+        double fNew = f, rNew = r, length = 1;
+        for(int ls=0; ls<12; ls++){
+            rNew = fixR ? r : std::max(0., r + length*stepR);
+            for(int k=0; k<K; k++) thetaNew[k] = theta[k] + length*step[k];
+            fNew = nll(data, glob, rNew, thetaNew);
+            if(fNew<=f)break;
+            length *= 0.5;
+        }
+        if(!(fNew<=f)){ lambda = lambda>0 ? lambda*10 : 1E-3; if(lambda>1E8)break; continue; }
+        double decrease = f-fNew;
+        f = fNew; r = rNew; theta.swap(thetaNew);
+        lambda = lambda>1E-6 ? lambda*0.1 : 0;
+        if(decrease<1E-10 && length==1)break;
+    }
+    return f;
+}
+
+//
+double AsymptoticLimits::qAsimov(double r)
+{
+    std::vector<double> theta = asimovTheta_;
+    double f = fit(asimovData_, asimovGlob_, r, true, theta);
+    return std::max(0., 2*(f-asimovNllMin_));
+}
+
+//
+double AsymptoticLimits::clsObserved(double r, double rHat, double nllMin)
+{
+    std::vector<double> theta = asimovTheta_;
+    std::vector<double> glob(nuisanceNames_.size(), 0.);
+    double rFit = r;
+    double q = r<rHat ? 0 : std::max(0., 2*(fit(data_, glob, rFit, true, theta)-nllMin));
+    double qA = qAsimov(r);
+    if(qA<=0)return 1;
+    double clsb, clb;
+    if(q>qA){
+        clsb = ROOT::Math::normal_cdf_c((q+qA)/(2*sqrt(qA)), 1.);
+        clb  = ROOT::Math::normal_cdf_c((q-qA)/(2*sqrt(qA)), 1.);
+    }else{
+        clsb = ROOT::Math::normal_cdf_c(sqrt(q), 1.);
+        clb  = ROOT::Math::normal_cdf(sqrt(qA)-sqrt(q), 1.);
+    }
+    return clb>0 ? clsb/clb : 1;
+}
+
+//
+bool AsymptoticLimits::compute(Result_t& result, bool observed, bool significance, double cl)
+{
+    result.valid = false;
+    result.observed = -1;
+    result.significance = -1;
+    for(int i=0; i<5; i++) result.expected[i] = -1;
+    finalize();
+    nFits_ = 0;
+    const int K = nuisanceNames_.size();
+    const double alpha = 1-cl;
+
+    bool hasSignal = false;
+    for(unsigned int y=0; y<yieldBin_.size(); y++){ if(yieldSignal_[y] && yieldNominal_[y]>0) hasSignal = true; }
+    if(!hasSignal){ printf("AsymptoticLimits: no signal in the model, no limit computed\n"); return false; }
+
+    //Asimov dataset of the background-only fit to the data, the global observables are moved to the fitted nuisances
+    std::vector<double> zero(K, 0.);
+    asimovTheta_ = zero;
+    double r = 0;
+    fit(data_, zero, r, true, asimovTheta_);
+    yieldValues(0, asimovTheta_, asimovData_);
+    asimovGlob_ = asimovTheta_;
+    asimovNllMin_ = nll(asimovData_, asimovGlob_, 0, asimovTheta_);
+
+    //expected limits: CLs on the Asimov dataset is alpha at the quantile q for sqrt(qA) = Z(alpha q) + Z(1-q), with Z the
+    //upper quantile of the normal distribution (crossing of combine); sqrt(qA) is close to r/sigma so the iteration
+    //starts from the sigma of the signal without nuisances
+    std::vector<double> nuS;
+    yieldValues(1, asimovTheta_, nuS);
+    double info = 0;
+    for(unsigned int b=0; b<nuS.size(); b++){ double s = nuS[b]-asimovData_[b]; if(asimovData_[b]>0) info += s*s/asimovData_[b]; else if(s>0) info += s; }
+    double sigma = info>0 ? 1/sqrt(info) : 1;
+    const double quantiles[5] = {0.025, 0.16, 0.5, 0.84, 0.975};
+    for(int i=0; i<5; i++){
+        double z = ROOT::Math::normal_quantile_c(alpha*quantiles[i], 1.) + ROOT::Math::normal_quantile(quantiles[i], 1.);
+        r = sigma*z;
+        bool converged = false;
+        for(int iter=0; iter<50 && r<1E12; iter++){
+            double qA = qAsimov(r);
+            if(qA<=1E-12){ r *= 10; continue; }
+            double rNew = r*z/sqrt(qA);
+            if(fabs(rNew-r)<1E-4*r){ r = rNew; converged = true; break; }
+            r = rNew;
+        }
+        if(!converged){ printf("AsymptoticLimits: the expected limit at %g%% did not converge (r=%g)\n", 100*quantiles[i], r); return false; }
+        result.expected[i] = r;
+        sigma = r/z;  //starting point of the next quantile
+    }
+    r = result.expected[2];
+    result.valid = true;
+
+    //observed limit: CLs decreases with r, the crossing is bracketed then bisected
+    if(observed){
+        std::vector<double> theta = asimovTheta_;
+        double rHat = r;
+        double nllMin = fit(data_, zero, rHat, false, theta);
+        double lo = rHat, hi = std::max(2*rHat, r);
+        for(int i=0; i<40 && clsObserved(hi, rHat, nllMin)>alpha; i++){ lo = hi; hi *= 2; }
+        for(int i=0; i<60 && hi-lo>5E-4*hi; i++){
+            double mid = 0.5*(lo+hi);
+            if(clsObserved(mid, rHat, nllMin)>alpha) lo = mid; else hi = mid;
+        }
+        result.observed = 0.5*(lo+hi);
+    }
+
+    //a priori expected significance: Asimov dataset of r=1 with the nominal nuisances
+    if(significance){
+        std::vector<double> sbData, theta = zero;
+        yieldValues(1, zero, sbData);
+        double r0 = 0;
+        double q0 = 2*(fit(sbData, zero, r0, true, theta) - nll(sbData, zero, 1, zero));
+        result.significance = sqrt(std::max(0., q0));
+    }
+    result.nFits = nFits_;
+    return true;
+}
+
+//
+void AsymptoticLimits::print(FILE* pFile, const Result_t& result)
+{
+    fprintf(pFile, "\n -- AsymptoticLimits (in-process) -- \n");
+    if(!result.valid){ fprintf(pFile, "No limit computed\n"); return; }
+    if(result.observed>=0) fprintf(pFile, "Observed Limit: r < %.4f\n", result.observed);
+    const char* labels[5] = {" 2.5", "16.0", "50.0", "84.0", "97.5"};
+    for(int i=0; i<5; i++) fprintf(pFile, "Expected %s%%: r < %.4f\n", labels[i], result.expected[i]);
+    if(result.significance>=0) fprintf(pFile, "Significance: %f\n", result.significance);
+    fprintf(pFile, "(%i fits)\n", result.nFits);
+}
@@ -1,9 +1,16 @@
 #include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryHandler.h"
 
+#include "TBranch.h"
+#include "TLeaf.h"
+#include "RVersion.h"
+
+#include <algorithm>
+
 using namespace std;
 
 //
-DataEvtSummaryHandler::DataEvtSummaryHandler()
+DataEvtSummaryHandler::DataEvtSummaryHandler():
+    t_(0), skimT_(0)
 {
 }
 
@@ -126,6 +133,7 @@ bool DataEvtSummaryHandler::initTree(TTree *t)
     t_->Branch("mn_passIdLoose",   evSummary_.mn_passIdLoose,  "mn_passIdLoose[mn]/O");
     t_->Branch("mn_passSoftMuon",   evSummary_.mn_passSoftMuon,  "mn_passSoftMuon[mn]/O");
     t_->Branch("mn_passIso",   evSummary_.mn_passIso,  "mn_passIso[mn]/O");
+    t_->Branch("mn_passIsoBoosted",   evSummary_.mn_passIsoBoosted,  "mn_passIsoBoosted[mn]/O");
 
     t_->Branch("mn_nMatches",                   evSummary_.mn_nMatches,                     "mn_nMatches[mn]/F");
     t_->Branch("mn_nMatchedStations",           evSummary_.mn_nMatchedStations,             "mn_nMatchedStations[mn]/F");
@@ -446,6 +454,7 @@ bool DataEvtSummaryHandler::attachToTree(TTree *t)
     t_->SetBranchAddress("mn_passIdLoose",  evSummary_.mn_passIdLoose);
     t_->SetBranchAddress("mn_passSoftMuon",  evSummary_.mn_passSoftMuon);
     t_->SetBranchAddress("mn_passIso",  evSummary_.mn_passIso);
+    t_->SetBranchAddress("mn_passIsoBoosted",  evSummary_.mn_passIsoBoosted);
     
     t_->SetBranchAddress("mn_nMatches",                   evSummary_.mn_nMatches);
     t_->SetBranchAddress("mn_nMatchedStations",           evSummary_.mn_nMatchedStations);
@@ -668,6 +677,104 @@ bool DataEvtSummaryHandler::attachToTree(TTree *t)
 }
 
 
+//
+// compression settings are encoded by ROOT as 100*algorithm + level
+// presets: "fast"    for intermediate skims (LZ4, or low level ZLIB on older ROOT)
+//          "archive" for long term storage  (ZSTD, or LZMA on older ROOT)
+//          "zlib"/"lzma" to force an algorithm, "default" keeps the file settings
+//
+int DataEvtSummaryHandler::getCompressionSettings(std::string preset, int level)
+{
+    if(preset=="fast"){
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,10,0)
+        return 400 + (level>=0 ? level : 4);
+#else
+        return 100 + (level>=0 ? level : 1);
+#endif
+    }else if(preset=="archive"){
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,20,0)
+        return 500 + (level>=0 ? level : 5);
+#else
+        return 200 + (level>=0 ? level : 8);
+#endif
+    }else if(preset=="zlib"){
+        return 100 + (level>=0 ? level : 5);
+    }else if(preset=="lzma"){
+        return 200 + (level>=0 ? level : 8);
+    }else if(preset!="default"){
+        printf("Unknown compression preset '%s', keep the default file settings\n", preset.c_str());
+    }
+    return -1;
+}
+
+//
+std::string DataEvtSummaryHandler::getBranchGroup(const std::string& branchName)
+{
+    const std::string& n = branchName;
+    if(n=="npdfs" || n=="pdfWeights" || n=="nalphaS" || n=="alphaSWeights" || n.find("weight_")==0) return "weights";
+    if(n.find("mc")==0 || n.find("nmc")==0) return "mc";
+    if(n=="mn" || n.find("mn_")==0)   return "muon";
+    if(n=="en" || n.find("en_")==0)   return "electron";
+    if(n=="ta" || n.find("ta_")==0)   return "tau";
+    if(n=="jet" || n.find("jet_")==0) return "jet";
+    if(n=="sv" || n.find("sv_")==0)   return "sv";
+    if(n=="fjet" || n.find("fjet_")==0) return "fjet";
+    if(n.find("met")!=std::string::npos || n.find("flag_")==0) return "met";
+    return "event";
+}
+
+//
+void DataEvtSummaryHandler::configureOutput(int compressionSettings, Int_t basketSize, Long64_t autoFlush)
+{
+    if(!t_) return;
+
+    if(autoFlush!=0) t_->SetAutoFlush(autoFlush);
+
+    TObjArray* branches = t_->GetListOfBranches();
+    for(int i=0; i<branches->GetEntriesFast(); i++){
+        TBranch* b = (TBranch*)branches->At(i);
+        if(compressionSettings>=0) b->SetCompressionSettings(compressionSettings);
+        if(basketSize<=0) continue;
+
+        //scalars only need small baskets, the large per-event arrays (LHE weights, gen particles) much bigger ones
+        TLeaf* leaf = (TLeaf*)b->GetListOfLeaves()->At(0);
+        bool isArray = leaf && (leaf->GetLeafCount()!=0 || leaf->GetLenStatic()>1);
+        std::string group = getBranchGroup(b->GetName());
+        Int_t size = basketSize;
+        if(!isArray)                              size = std::max(basketSize/4, 4000);
+        else if(group=="weights" || group=="mc")  size = 8*basketSize;
+        else if(group=="fjet")                    size = 2*basketSize;
+        b->SetBasketSize(size);
+    }
+}
+
+//
+void DataEvtSummaryHandler::printBranchGroupSizes()
+{
+    if(!t_) return;
+
+    std::map<std::string, Long64_t> totBytes, zipBytes;
+    std::map<std::string, int> nBranches;
+    Long64_t allTot=0, allZip=0;
+    TObjArray* branches = t_->GetListOfBranches();
+    for(int i=0; i<branches->GetEntriesFast(); i++){
+        TBranch* b = (TBranch*)branches->At(i);
+        std::string group = getBranchGroup(b->GetName());
+        totBytes[group] += b->GetTotBytes("*");
+        zipBytes[group] += b->GetZipBytes("*");
+        nBranches[group]++;
+        allTot += b->GetTotBytes("*");
+        allZip += b->GetZipBytes("*");
+    }
+
+    printf("Summary tree : %lld entries, %lld bytes written (%lld uncompressed)\n", t_->GetEntries(), allZip, allTot);
+    printf("%-10s %8s %14s %14s %7s %8s\n", "group", "branches", "uncompressed", "written", "ratio", "fraction");
+    for(std::map<std::string, Long64_t>::iterator it=zipBytes.begin(); it!=zipBytes.end(); it++){
+        printf("%-10s %8i %14lld %14lld %7.2f %7.2f%%\n", it->first.c_str(), nBranches[it->first], totBytes[it->first], it->second,
+               it->second>0 ? (double)totBytes[it->first]/it->second : 0.0, allZip>0 ? 100.0*it->second/allZip : 0.0);
+    }
+}
+
 //
 void DataEvtSummaryHandler::resetStruct()
 {
@@ -717,6 +824,41 @@ void DataEvtSummaryHandler::fillTree()
     if(t_) t_->Fill();
 }
 
+//
+TTree *DataEvtSummaryHandler::initSkimTree(const std::vector<std::string>& keepGroups, bool copyAll)
+{
+    if(!t_) return 0;
+
+    //dropped groups are disabled only while the structure (or the full tree) is cloned, the event group
+    //(run/lumi/event...) is always kept
+    std::vector<std::string> dropped;
+    if(!keepGroups.empty()){
+        TObjArray* branches = t_->GetListOfBranches();
+        for(int i=0; i<branches->GetEntriesFast(); i++){
+            TBranch* b = (TBranch*)branches->At(i);
+            std::string group = getBranchGroup(b->GetName());
+            if(group=="event" || std::find(keepGroups.begin(), keepGroups.end(), group)!=keepGroups.end()) continue;
+            if(!t_->GetBranchStatus(b->GetName())) continue;
+            t_->SetBranchStatus(b->GetName(), 0);
+            dropped.push_back(b->GetName());
+        }
+    }
+
+    //copy the compressed baskets directly when no event selection is applied,
+    //otherwise the clone shares the branch addresses of the input tree, so fillSkimTree copies the entry loaded by getEntry
+    skimT_ = copyAll ? t_->CloneTree(-1, "fast") : t_->CloneTree(0);
+
+    //the analysis still reads the dropped groups from the input tree
+    for(size_t i=0; i<dropped.size(); i++) t_->SetBranchStatus(dropped[i].c_str(), 1);
+    return skimT_;
+}
+
+//
+void DataEvtSummaryHandler::fillSkimTree()
+{
+    if(skimT_) skimT_->Fill();
+}
+
 //
 DataEvtSummaryHandler::~DataEvtSummaryHandler()
 {
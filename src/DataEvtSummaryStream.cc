@@ -0,0 +1,272 @@
+#include "UserCode/bsmhiggs_fwk/interface/DataEvtSummaryStream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+//layout of the shared memory segment: this header followed by nSlots records
+struct DataEvtSummaryStreamHeader_t {
+    sem_t freeSlots;
+    sem_t usedSlots;
+    unsigned int nSlots;
+    size_t recordSize;
+    pid_t producerPid;
+    volatile pid_t consumerPid;
+    volatile int ready;
+    volatile int consumerDone;
+    volatile unsigned long long nWritten;
+};
+
+//keep the records aligned on a cache line
+static size_t slotsOffset() { return ((sizeof(DataEvtSummaryStreamHeader_t)+63)/64)*64; }
+
+static std::string shmName(const std::string& name) { return (name.size() && name[0]=='/') ? name : "/"+name; }
+
+//true if the segment exists and its producer is dead (a segment still being created is never stale)
+static bool isStale(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0600);
+    if(fd<0) return false;
+    struct stat st;
+    bool stale = false;
+    if(fstat(fd, &st)==0 && (size_t)st.st_size>=sizeof(DataEvtSummaryStreamHeader_t)) {
+        void* mem = mmap(NULL, sizeof(DataEvtSummaryStreamHeader_t), PROT_READ, MAP_SHARED, fd, 0);
+        if(mem!=MAP_FAILED) {
+            const DataEvtSummaryStreamHeader_t* header = (const DataEvtSummaryStreamHeader_t*)mem;
+            stale = header->ready && header->producerPid>0 && kill(header->producerPid, 0)!=0 && errno==ESRCH;
+            munmap(mem, sizeof(DataEvtSummaryStreamHeader_t));
+        }
+    }
+    ::close(fd);
+    return stale;
+}
+
+//
+DataEvtSummaryStream::DataEvtSummaryStream():
+    isProducer_(false), closed_(false), consumerDetached_(false), attachTimeout_(600), attachTimedOut_(false), size_(0), header_(NULL), slots_(NULL), nProcessed_(0)
+{
+}
+
+//
+DataEvtSummaryStream::~DataEvtSummaryStream()
+{
+    if(isProducer_ && header_) {
+        close();
+        //a job shorter than the ring never blocks on it and can be done before the consumer attached: wait for the
+        //consumer for up to attachTimeout seconds, then for it to read what is left in the ring
+        if(header_->consumerPid==0 && !attachTimedOut_) {
+            printf("DataEvtSummaryStream: waiting for a consumer to attach to %s\n", name_.c_str());
+            for(int itry=0; header_->consumerPid==0 && (attachTimeout_<0 || itry<attachTimeout_*10); itry++) usleep(100000);
+        }
+        __sync_synchronize();
+        pid_t consumer = header_->consumerPid;
+        if(consumer!=0) {
+            int nFree = 0;
+            while(!header_->consumerDone && sem_getvalue(&header_->freeSlots, &nFree)==0 && nFree<(int)header_->nSlots) {
+                if(kill(consumer, 0)!=0 && errno==ESRCH) break;
+                usleep(100000);
+            }
+        }
+        //the consumer unlinks the segment once attached, only clean up if nobody ever showed up
+        else {
+            printf("DataEvtSummaryStream: no consumer attached to %s, %llu events dropped\n", name_.c_str(), nProcessed_);
+            shm_unlink(name_.c_str());
+        }
+    }
+    if(!isProducer_) detach();
+    release();
+}
+
+//
+void DataEvtSummaryStream::release()
+{
+    if(header_) munmap((void*)header_, size_);
+    header_ = NULL;
+    slots_  = NULL;
+}
+
+//
+bool DataEvtSummaryStream::create(const std::string& name, unsigned int nSlots, int attachTimeout)
+{
+    if(header_ || nSlots==0) return false;
+    name_ = shmName(name);
+    size_ = slotsOffset() + nSlots*sizeof(DataEvtSummary_t);
+
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    //a segment with the same name is only reclaimed if the producer that created it is gone
+    if(fd<0 && errno==EEXIST && isStale(name_)) {
+        printf("DataEvtSummaryStream: removing the stale ring %s\n", name_.c_str());
+        shm_unlink(name_.c_str());
+        fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if(fd<0 && errno==EEXIST) { printf("DataEvtSummaryStream: %s is in use by a running job, choose another stream name\n", name_.c_str()); return false; }
+    if(fd<0) { printf("DataEvtSummaryStream: can not create %s (%s)\n", name_.c_str(), strerror(errno)); return false; }
+    if(ftruncate(fd, size_)!=0) {
+        printf("DataEvtSummaryStream: can not allocate %lu bytes for %s (%s)\n", (unsigned long)size_, name_.c_str(), strerror(errno));
+        ::close(fd); shm_unlink(name_.c_str()); return false;
+    }
+    void* mem = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mem==MAP_FAILED) { printf("DataEvtSummaryStream: can not map %s (%s)\n", name_.c_str(), strerror(errno)); shm_unlink(name_.c_str()); return false; }
+
+    header_ = (DataEvtSummaryStreamHeader_t*)mem;
+    slots_  = (DataEvtSummary_t*)((char*)mem + slotsOffset());
+    header_->nSlots      = nSlots;
+    header_->recordSize  = sizeof(DataEvtSummary_t);
+    header_->producerPid = getpid();
+    header_->consumerPid = 0;
+    header_->consumerDone= 0;
+    header_->nWritten    = 0;
+    if(sem_init(&header_->freeSlots, 1, nSlots)!=0 || sem_init(&header_->usedSlots, 1, 0)!=0) {
+        printf("DataEvtSummaryStream: can not initialize semaphores for %s (%s)\n", name_.c_str(), strerror(errno));
+        release(); shm_unlink(name_.c_str()); return false;
+    }
+    __sync_synchronize();
+    header_->ready = 1;
+
+    isProducer_ = true;
+    closed_     = false;
+    consumerDetached_ = false;
+    attachTimeout_    = attachTimeout;
+    attachTimedOut_   = false;
+    printf("DataEvtSummaryStream: streaming events through %s (%u slots, %.1f MB)\n", name_.c_str(), nSlots, size_/1048576.);
+    return true;
+}
+
+//
+bool DataEvtSummaryStream::attach(const std::string& name, int timeout)
+{
+    if(header_) return false;
+    name_ = shmName(name);
+
+    //wait for the producer to create and initialize the ring
+    int fd = -1;
+    for(int itry=0; itry<=timeout; itry++) {
+        fd = shm_open(name_.c_str(), O_RDWR, 0600);
+        if(fd>=0) {
+            struct stat st;
+            if(fstat(fd, &st)==0 && (size_t)st.st_size>slotsOffset()) break;
+            ::close(fd); fd = -1;
+        }
+        if(itry==0) printf("DataEvtSummaryStream: waiting for a producer on %s\n", name_.c_str());
+        sleep(1);
+    }
+    if(fd<0) { printf("DataEvtSummaryStream: no producer found on %s after %d s\n", name_.c_str(), timeout); return false; }
+
+    struct stat st;
+    fstat(fd, &st);
+    size_ = st.st_size;
+    void* mem = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(mem==MAP_FAILED) { printf("DataEvtSummaryStream: can not map %s (%s)\n", name_.c_str(), strerror(errno)); return false; }
+    header_ = (DataEvtSummaryStreamHeader_t*)mem;
+    slots_  = (DataEvtSummary_t*)((char*)mem + slotsOffset());
+
+    for(int itry=0; !header_->ready && itry<timeout*100; itry++) usleep(10000);
+    __sync_synchronize();
+    if(!header_->ready || header_->recordSize!=sizeof(DataEvtSummary_t)) {
+        printf("DataEvtSummaryStream: %s is not compatible with this build (record size %lu vs %lu)\n",
+               name_.c_str(), (unsigned long)header_->recordSize, (unsigned long)sizeof(DataEvtSummary_t));
+        release();
+        return false;
+    }
+    header_->consumerPid = getpid();
+
+    //the mapping stays valid, this only makes sure nothing is left behind in /dev/shm
+    shm_unlink(name_.c_str());
+    isProducer_ = false;
+    printf("DataEvtSummaryStream: reading events from %s (%u slots)\n", name_.c_str(), header_->nSlots);
+    return true;
+}
+
+//
+bool DataEvtSummaryStream::waitSlot(sem_t* sem)
+{
+    int waited(0);
+    while(true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 30;
+        if(sem_timedwait(sem, &deadline)==0) return true;
+        if(errno==EINTR) continue;
+        if(errno!=ETIMEDOUT) { printf("DataEvtSummaryStream: %s\n", strerror(errno)); return false; }
+        waited += 30;
+
+        //timed out: give up if the other end of the ring died (the consumer pid is only known once it attached)
+        pid_t peer = isProducer_ ? header_->consumerPid : header_->producerPid;
+        if(peer>0 && kill(peer, 0)!=0 && errno==ESRCH) {
+            printf("DataEvtSummaryStream: process %d on the other end of %s is gone\n", (int)peer, name_.c_str());
+            return false;
+        }
+        if(peer==0) {
+            if(attachTimeout_>=0 && waited>=attachTimeout_) {
+                printf("DataEvtSummaryStream: no consumer attached to %s after %d s, giving up\n", name_.c_str(), waited);
+                attachTimedOut_ = true;
+                return false;
+            }
+            printf("DataEvtSummaryStream: ring %s is full, waiting for a consumer to attach\n", name_.c_str());
+        }
+    }
+}
+
+//
+bool DataEvtSummaryStream::push(const DataEvtSummary_t& ev)
+{
+    if(!header_ || !isProducer_ || closed_) return false;
+    if(!header_->consumerDone && !waitSlot(&header_->freeSlots)) return false;
+    //the consumer stopped reading (e.g. it reached its last event): stop streaming, this is not an error
+    __sync_synchronize();
+    if(header_->consumerDone) {
+        printf("DataEvtSummaryStream: consumer of %s detached after %llu events, no more events will be streamed\n", name_.c_str(), nProcessed_);
+        consumerDetached_ = true;
+        closed_ = true;
+        return false;
+    }
+    memcpy(slots_ + (header_->nWritten % header_->nSlots), &ev, sizeof(DataEvtSummary_t));
+    header_->nWritten = header_->nWritten + 1;
+    sem_post(&header_->usedSlots);
+    nProcessed_++;
+    return true;
+}
+
+//
+void DataEvtSummaryStream::close()
+{
+    if(!header_ || !isProducer_ || closed_) return;
+    //an extra post without a new record marks the end of the stream
+    closed_ = true;
+    sem_post(&header_->usedSlots);
+}
+
+//
+bool DataEvtSummaryStream::pop(DataEvtSummary_t& ev)
+{
+    if(!header_ || isProducer_ || closed_) return false;
+    if(!waitSlot(&header_->usedSlots) || nProcessed_==header_->nWritten) {
+        closed_ = true;
+        return false;
+    }
+    memcpy(&ev, slots_ + (nProcessed_ % header_->nSlots), sizeof(DataEvtSummary_t));
+    nProcessed_++;
+    sem_post(&header_->freeSlots);
+    return true;
+}
+
+//
+void DataEvtSummaryStream::detach()
+{
+    if(!header_ || isProducer_ || header_->consumerDone) return;
+    closed_ = true;
+    header_->consumerDone = 1;
+    __sync_synchronize();
+    //wake up the producer in case it is waiting for a free slot
+    sem_post(&header_->freeSlots);
+}
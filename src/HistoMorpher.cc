@@ -0,0 +1,252 @@
+#include "UserCode/bsmhiggs_fwk/interface/HistoMorpher.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <set>
+#include <algorithm>
+
+#include "TH1.h"
+#include "TH1F.h"
+#include "TAxis.h"
+
+using namespace std;
+
+static void getEdges(TAxis* axis, std::vector<double>& edges)
+{
+    int nb = axis->GetNbins();
+    edges.resize(nb+1);
+    for(int i=0; i<nb; i++) edges[i] = axis->GetBinLowEdge(i+1);
+    edges[nb] = axis->GetBinUpEdge(nb);
+}
+
+//cumulative distribution of the bins 1..nb, normalized to 1 (edge i is the upper edge of bin i); the value of the
+//last edge is repeated once, as the walk reads one point beyond the last edge
+static void getCdf(TH1* hist, int nb, std::vector<double>& sigdis)
+{
+    sigdis.assign(nb+2, 0.);
+    for(int i=1; i<nb+1; i++) sigdis[i] = hist->GetBinContent(i);
+    double total = 0;
+    for(int i=0; i<nb+1; i++) total += sigdis[i];
+    for(int i=1; i<nb+1; i++) sigdis[i] = sigdis[i]/total + sigdis[i-1];
+    sigdis[nb+1] = sigdis[nb];
+}
+
+//sum of all the bins, under and overflow included (as TArray::GetSum used by th1fmorph)
+static double getSum(TH1* hist)
+{
+    double sum = 0;
+    for(int i=0; i<=hist->GetNbinsX()+1; i++) sum += hist->GetBinContent(i);
+    return sum;
+}
+
+//
+bool HistoMorpher::sameAxes(TH1* hist1, TH1* hist2) const
+{
+    std::vector<double> edges1, edges2;
+    getEdges(hist1->GetXaxis(), edges1);
+    getEdges(hist2->GetXaxis(), edges2);
+    return binning_ && edges1==binning_->edges1 && edges2==binning_->edges2;
+}
+
+//
+HistoMorpher::HistoMorpher(TH1* hist1, TH1* hist2, double par1, double par2, const HistoMorpher* binningFrom):
+    valid_(false), empty_(true), isFloat_(false), par1_(par1), par2_(par2)
+{
+    if(!hist1) { printf("ERROR! HistoMorpher: first input histogram doesn't exist.\n"); return; }
+    if(!hist2) { printf("ERROR! HistoMorpher: second input histogram doesn't exist.\n"); return; }
+    valid_ = true;
+    isFloat_ = dynamic_cast<TH1F*>(hist1)!=NULL;
+
+    //output binning: union of the edges of the two inputs, together with the width of the bin of input 2 at each edge
+    if(binningFrom && binningFrom->binning_) {
+        binning_ = binningFrom->binning_;
+        if(!sameAxes(hist1, hist2)) binning_.reset();
+    }
+    if(!binning_) {
+        std::shared_ptr<Binning_t> binning(new Binning_t);
+        getEdges(hist1->GetXaxis(), binning->edges1);
+        getEdges(hist2->GetXaxis(), binning->edges2);
+        std::set<double> bedgesn_tmp(binning->edges1.begin(), binning->edges1.end());
+        bedgesn_tmp.insert(binning->edges2.begin(), binning->edges2.end());
+        binning->edges.assign(bedgesn_tmp.begin(), bedgesn_tmp.end());
+        TAxis* axis2 = hist2->GetXaxis();
+        binning->dx2.resize(binning->edges.size());
+        for(unsigned int i=0; i<binning->edges.size(); i++) binning->dx2[i] = axis2->GetBinWidth(axis2->FindBin(binning->edges[i]));
+        binning_ = binning;
+    }
+    const std::vector<double>& edges1 = binning_->edges1;
+    const std::vector<double>& edges2 = binning_->edges2;
+    int nb1 = edges1.size()-1;
+    int nb2 = edges2.size()-1;
+    int nbn = binning_->edges.size()-1;
+    xdisn_  .assign(2+nb1+nb2, 0.);
+    sigdisn_.assign(2+nb1+nb2, 0.);
+    sigdisf_.assign(nbn+1, 0.);
+
+    empty_ = getSum(hist1)<=0 || getSum(hist2)<=0;
+    if(empty_) return;
+
+    std::vector<double> sigdis1, sigdis2;
+    getCdf(hist1, nb1, sigdis1);
+    getCdf(hist2, nb2, sigdis2);
+
+    //walk along the edges of both cdfs ordered by increasing probability, from the first non-zero point (ix1, ix2) to
+    //the first point having the total probability (ix1l, ix2l), and record the pairs of positions with the same
+    //probability: they are independent of the interpolation point
+    int ix1l = nb1;
+    int ix2l = nb2;
+    while(sigdis1[ix1l-1] >= sigdis1[ix1l]) ix1l = ix1l - 1;
+    while(sigdis2[ix2l-1] >= sigdis2[ix2l]) ix2l = ix2l - 1;
+
+    int ix1 = -1;
+    do { ix1 = ix1 + 1; } while(sigdis1[ix1+1] <= sigdis1[0]);
+    int ix2 = -1;
+    do { ix2 = ix2 + 1; } while(sigdis2[ix2+1] <= sigdis2[0]);
+
+    double x1 = edges1[ix1];
+    double x2 = edges2[ix2];
+    x1_.push_back(x1); x2_.push_back(x2); y_.push_back(0);
+
+    double yprev = -1;
+    double y = 0;
+    while((ix1 < ix1l) | (ix2 < ix2l)) {
+        int i12type = -1;
+        if((sigdis1[ix1+1] <= sigdis2[ix2+1] || ix2 == ix2l) && ix1 < ix1l) {
+            ix1 = ix1 + 1;
+            while(sigdis1[ix1+1] <= sigdis1[ix1] && ix1 < ix1l) ix1 = ix1 + 1;
+            i12type = 1;
+        } else if(ix2 < ix2l) {
+            ix2 = ix2 + 1;
+            while(sigdis2[ix2+1] <= sigdis2[ix2] && ix2 < ix2l) ix2 = ix2 + 1;
+            i12type = 2;
+        }
+        if(i12type == 1) {
+            x1 = edges1[ix1];
+            y = sigdis1[ix1];
+            double x20 = edges2[ix2], x21 = edges2[std::min(ix2+1, nb2)];
+            double y20 = sigdis2[ix2], y21 = sigdis2[ix2+1];
+            x2 = (y21 > y20) ? x20 + (x21-x20)*(y-y20)/(y21-y20) : x20;
+        } else {
+            x2 = edges2[ix2];
+            y = sigdis2[ix2];
+            double x10 = edges1[ix1], x11 = edges1[std::min(ix1+1, nb1)];
+            double y10 = sigdis1[ix1], y11 = sigdis1[ix1+1];
+            x1 = (y11 > y10) ? x10 + (x11-x10)*(y-y10)/(y11-y10) : x10;
+        }
+        if(y > yprev) {
+            yprev = y;
+            x1_.push_back(x1); x2_.push_back(x2); y_.push_back(y);
+        }
+    }
+}
+
+//
+void HistoMorpher::morph(double parinterp, double norm, double* out)
+{
+    if(!valid_) return;
+    const std::vector<double>& bedgesn = binning_->edges;
+    const std::vector<double>& dx2 = binning_->dx2;
+    int nbn = bedgesn.size()-1;
+
+    double wt1, wt2;
+    if(par2_ != par1_) {
+        wt1 = 1. - (parinterp-par1_)/(par2_-par1_);
+        wt2 = 1. + (parinterp-par2_)/(par2_-par1_);
+    } else {
+        wt1 = 0.5;
+        wt2 = 0.5;
+    }
+    if(wt1 < 0 || wt1 > 1. || wt2 < 0. || wt2 > 1. || fabs(1-(wt1+wt2)) > 1.0e-4) {
+        printf("Warning! HistoMorpher: This is an extrapolation!! Weights are %g and %g (sum=%g)\n", wt1, wt2, wt1+wt2);
+    }
+    if(empty_) {
+        printf("Warning! HistoMorpher: empty input histogram, empty interpolated histogram returned\n");
+        for(int ix=0; ix<nbn; ix++) out[ix] = 0;
+        return;
+    }
+
+    //interpolated cdf
+    int nx3 = y_.size()-1;
+    double* xdisn = &xdisn_[0];
+    double* sigdisn = &sigdisn_[0];
+    double* sigdisf = &sigdisf_[0];
+    for(int i=0; i<=nx3; i++) { xdisn[i] = wt1*x1_[i] + wt2*x2_[i]; sigdisn[i] = y_[i]; }
+
+    //projection on the output edges: the bins after the last point and before the first one are set first
+    double x = bedgesn[nbn];
+    int ix = nbn;
+    while(x >= xdisn[nx3]) {
+        sigdisf[ix] = sigdisn[nx3];
+        ix = ix-1;
+        if(ix<0) break;
+        x = bedgesn[ix];
+    }
+    int ixl = ix + 1;
+
+    ix = 0;
+    x = bedgesn[ix+1];
+    while(x <= xdisn[0]) {
+        sigdisf[ix] = sigdisn[0];
+        ix = ix+1;
+        if(ix>=nbn) break;
+        x = bedgesn[ix+1];
+    }
+    int ixf = ix;
+
+    int ix3 = 0;
+    double y;
+    for(ix=ixf; ix<ixl; ix++) {
+        x = bedgesn[ix];
+        if(x < xdisn[0]) {
+            y = 0;
+        } else if(x > xdisn[nx3]) {
+            y = 1.;
+        } else {
+            while(xdisn[ix3+1] <= x && ix3 < 2*nbn) ix3 = ix3 + 1;
+            if(xdisn[ix3+1]-x > 1.1*dx2[ix]) {       //empty bin treatment
+                y = sigdisn[ix3+1];
+            } else if(xdisn[ix3+1] > xdisn[ix3]) {  //normal bins
+                y = sigdisn[ix3] + (sigdisn[ix3+1]-sigdisn[ix3])*(x-xdisn[ix3])/(xdisn[ix3+1]-xdisn[ix3]);
+            } else {
+                y = 0;
+                printf("Warning - HistoMorpher: Zero slope solving x(y)\n");
+            }
+        }
+        sigdisf[ix] = y;
+    }
+
+    //differentiate the interpolated cdf
+    for(ix=nbn-1; ix>-1; ix--) {
+        out[ix] = (sigdisf[ix+1]-sigdisf[ix])*norm;
+        if(isFloat_) out[ix] = (float)out[ix];  //th1fmorph returns a TH1F for TH1F inputs
+    }
+}
+
+//
+void HistoMorpher::addTo(TH1* h, double parinterp, double norm)
+{
+    if(!valid_ || !h) return;
+    int nbn = nBins();
+    content_.resize(nbn);
+    morph(parinterp, norm, nbn ? &content_[0] : NULL);
+
+    std::vector<double> hedges;
+    getEdges(h->GetXaxis(), hedges);
+    if(hedges!=binning_->edges) {
+        //different binning, let Add deal with it
+        TH1* tmp = isFloat_ ? (TH1*)new TH1F("HistoMorpherTmp", "", nbn, &binning_->edges[0]) : (TH1*)new TH1D("HistoMorpherTmp", "", nbn, &binning_->edges[0]);
+        tmp->SetDirectory(0);
+        for(int ix=0; ix<nbn; ix++) tmp->SetBinContent(ix+1, content_[ix]);
+        h->Add(tmp, 1);
+        delete tmp;
+        return;
+    }
+
+    //the temporary histogram of th1fmorph has no sum of weights squared: its errors are sqrt(|content|)
+    bool hasSumw2 = h->GetSumw2N()>0;
+    for(int ix=0; ix<nbn; ix++) {
+        double err = h->GetBinError(ix+1);
+        h->SetBinContent(ix+1, h->GetBinContent(ix+1) + content_[ix]);
+        if(hasSumw2) h->SetBinError(ix+1, sqrt(err*err + fabs(content_[ix])));
+    }
+}
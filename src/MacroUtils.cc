@@ -2,6 +2,8 @@
 #include "TH1F.h"
 #include "TSystem.h"
 
+#include <algorithm>
+
 namespace utils
 {
   namespace cmssw
@@ -28,27 +30,25 @@ namespace utils
       return new FactorizedJetCorrector(corSteps);
     }
     
+     // FIXME: These are the 8 TeV values.
+     static const double jerEtaEdges[] = {0.0, 0.5, 0.8, 1.1, 1.3, 1.7, 1.9, 2.1, 2.3, 2.5, 2.8, 3.0, 3.2, 5.0};
+     static const double jerPtSF    [] = {1.109, 1.138, 1.114, 1.123, 1.084, 1.082, 1.140, 1.067, 1.177, 1.364, 1.857, 1.328, 1.16 };
+     static const double jerPtSFErr [] = {0.008, 0.013, 0.013, 0.024, 0.011, 0.035, 0.047, 0.053, 0.041, 0.039, 0.071, 0.022, 0.029};
+     static const size_t nJerEtaBins = sizeof(jerPtSF)/sizeof(double);
+
+     void getJERScaleFactor(double absEta, double& ptSF, double& ptSF_err){
+         ptSF=1.0; ptSF_err=0.06;
+         if(!(absEta>=jerEtaEdges[0] && absEta<jerEtaEdges[nJerEtaBins])) return;
+         size_t bin = std::upper_bound(jerEtaEdges, jerEtaEdges+nJerEtaBins+1, absEta) - jerEtaEdges - 1;
+         ptSF=jerPtSF[bin]; ptSF_err=jerPtSFErr[bin];
+     }
+
      std::vector<double> smearJER(double pt, double eta, double genPt){
          std::vector<double> toReturn(3,pt);
          if(genPt<=0) return toReturn;
          
-         // FIXME: These are the 8 TeV values.
-         //
-         eta=fabs(eta);
-         double ptSF(1.0), ptSF_err(0.06);
-         if(eta<0.5)                  { ptSF=1.109; ptSF_err=0.008; }
-         else if(eta>=0.5 && eta<0.8) { ptSF=1.138; ptSF_err=0.013; }
-         else if(eta>=0.8 && eta<1.1) { ptSF=1.114; ptSF_err=0.013; }
-         else if(eta>=1.1 && eta<1.3) { ptSF=1.123; ptSF_err=0.024; }
-         else if(eta>=1.3 && eta<1.7) { ptSF=1.084; ptSF_err=0.011; }
-         else if(eta>=1.7 && eta<1.9) { ptSF=1.082; ptSF_err=0.035; }
-         else if(eta>=1.9 && eta<2.1) { ptSF=1.140; ptSF_err=0.047; }
-         else if(eta>=2.1 && eta<2.3) { ptSF=1.067; ptSF_err=0.053; }
-         else if(eta>=2.3 && eta<2.5) { ptSF=1.177; ptSF_err=0.041; }
-         else if(eta>=2.5 && eta<2.8) { ptSF=1.364; ptSF_err=0.039; }
-         else if(eta>=2.8 && eta<3.0) { ptSF=1.857; ptSF_err=0.071; }
-         else if(eta>=3.0 && eta<3.2) { ptSF=1.328; ptSF_err=0.022; }
-         else if(eta>=3.2 && eta<5.0) { ptSF=1.16 ; ptSF_err=0.029; }
+         double ptSF, ptSF_err;
+         getJERScaleFactor(fabs(eta), ptSF, ptSF_err);
          toReturn[0]=TMath::Max(0.,((genPt+ptSF*(pt-genPt)))/pt);
          toReturn[1]=TMath::Max(0.,((genPt+(ptSF+ptSF_err)*(pt-genPt)))/pt);
          toReturn[2]=TMath::Max(0.,((genPt+(ptSF-ptSF_err)*(pt-genPt)))/pt);
@@ -66,66 +66,89 @@ namespace utils
          return toRet;
      }
      
-     void updateJEC(pat::JetCollection& jets, FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc, float rho, int nvtx,bool isMC){
-         for(size_t ijet=0; ijet<jets.size(); ijet++){
-             pat::Jet& jet = jets[ijet];
-             
-             //correct JES
-             LorentzVector rawJet = jet.correctedP4("Uncorrected");
-
-             //double toRawSF=jet.correctedJet("Uncorrected").pt()/jet.pt();
-             //LorentzVector rawJet(jet*toRawSF);
-             jesCor->setJetEta(rawJet.eta());
-             jesCor->setJetPt(rawJet.pt());
-             jesCor->setJetA(jet.jetArea());
+     void correctJets(size_t n, const float* rawPt, const float* eta, const float* area, const float* genPt, float rho, int nvtx,
+                      FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc,
+                      float* jecSF, float* jerSF, float* jerUp, float* jerDown, float* jesUp, float* jesDown){
+         //JES: the corrector keeps its parameter binning internally, only the per jet inputs change
+         for(size_t i=0; i<n; i++){
+             jesCor->setJetEta(eta[i]);
+             jesCor->setJetPt(rawPt[i]);
+             jesCor->setJetA(area[i]);
              jesCor->setRho(rho);
              jesCor->setNPV(nvtx);
-             jet.setP4(rawJet*jesCor->getCorrection());
-
-             //smear JER
-             //double newJERSF(1.0);
-             if(isMC){
-                 const reco::GenJet* genJet=jet.genJet();
-                 if(genJet){
-                   double genjetpt( genJet ? genJet->pt(): 0.);                    
-                    std::vector<double> smearJER=utils::cmssw::smearJER(jet.pt(),jet.eta(),genjetpt);
-                    jet.setP4(jet.p4()*smearJER[0]);
-                
-                    //printf("jet pt=%f gen pt = %f smearing %f %f %f\n", jet.pt(), genjetpt, smearJER[0], smearJER[1], smearJER[2]);
-                    // //set the JER up/down alternatives
-										if(smearJER[0]==0) {
-        							jet.addUserFloat("jerup", smearJER[1]);  //kept for backward compatibility
-                    	jet.addUserFloat("jerdown", smearJER[2] ); //kept for backward compatibility
-                    	jet.addUserFloat("_res_jup", smearJER[1]);
-                    	jet.addUserFloat("_res_jdown", smearJER[2] );
-                 		}
-                 		else{
-										  jet.addUserFloat("jerup", smearJER[1]/smearJER[0]);  //kept for backward compatibility 
-										  jet.addUserFloat("jerdown", smearJER[2]/smearJER[0] ); //kept for backward compatibility 
-										  jet.addUserFloat("_res_jup", smearJER[1]/smearJER[0]); 
-										  jet.addUserFloat("_res_jdown", smearJER[2]/smearJER[0] ); 
-                 		}
-                 }else{
-                   jet.addUserFloat("jerup", 1.0); //kept for backward compatibility
-                   jet.addUserFloat("jerdown", 1.0);  //kept for backward compatibility
-                   jet.addUserFloat("_res_jup", 1.0);
-                   jet.addUserFloat("_res_jdown", 1.0 );
-                 }
+             jecSF[i] = jesCor->getCorrection();
+         }
+
+         //JER: same eta binning for all jets, look the bin up once per jet and reuse it for the three variations
+         if(jerSF){
+             for(size_t i=0; i<n; i++){
+                 jerSF[i]=1.0; if(jerUp)jerUp[i]=1.0; if(jerDown)jerDown[i]=1.0;
+                 if(genPt==NULL || genPt[i]<=0) continue;
+                 double ptSF, ptSF_err;
+                 getJERScaleFactor(fabs(eta[i]), ptSF, ptSF_err);
+                 double pt = rawPt[i]*jecSF[i];
+                 double nominal = TMath::Max(0.,((genPt[i]+ptSF*(pt-genPt[i])))/pt);
+                 double up      = TMath::Max(0.,((genPt[i]+(ptSF+ptSF_err)*(pt-genPt[i])))/pt);
+                 double down    = TMath::Max(0.,((genPt[i]+(ptSF-ptSF_err)*(pt-genPt[i])))/pt);
+                 jerSF[i] = nominal;
+                 if(jerUp)  jerUp  [i] = nominal==0 ? up   : up/nominal;
+                 if(jerDown)jerDown[i] = nominal==0 ? down : down/nominal;
              }
+         }
 
-             if(isMC){
-               ////set the JES up/down pT alternatives
-               std::vector<float> ptUnc=utils::cmssw::smearJES(jet.pt(),jet.eta(), totalJESUnc);
-               jet.addUserFloat("jesup",    ptUnc[0] );  //kept for backward compatibility
-               jet.addUserFloat("jesdown",  ptUnc[1] );  //kept for backward compatibility
-               jet.addUserFloat("_scale_jup",    ptUnc[0] );
-               jet.addUserFloat("_scale_jdown",  ptUnc[1] );
+         //JES uncertainty, evaluated on the smeared jet
+         if(jesUp || jesDown){
+             for(size_t i=0; i<n; i++){
+                 totalJESUnc->setJetEta(eta[i]);
+                 totalJESUnc->setJetPt(rawPt[i]*jecSF[i]*(jerSF?jerSF[i]:1.0));
+                 double relShift=fabs(totalJESUnc->getUncertainty(true));
+                 if(jesUp)  jesUp  [i] = 1.0+relShift;
+                 if(jesDown)jesDown[i] = 1.0-relShift;
              }
+         }
+     }
+
+     void updateJEC(pat::JetCollection& jets, FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc, float rho, int nvtx,bool isMC){
+         size_t n = jets.size();
+         if(n==0) return;
+
+         //gather the inputs as arrays
+         std::vector<float> rawPt(n), eta(n), area(n), genPt(n, 0.);
+         std::vector<LorentzVector> rawP4(n);
+         for(size_t ijet=0; ijet<n; ijet++){
+             pat::Jet& jet = jets[ijet];
+             rawP4[ijet] = jet.correctedP4("Uncorrected");
+             rawPt[ijet] = rawP4[ijet].pt();
+             eta  [ijet] = rawP4[ijet].eta();
+             area [ijet] = jet.jetArea();
+             const reco::GenJet* genJet = isMC ? jet.genJet() : NULL;
+             if(genJet) genPt[ijet] = genJet->pt();
+         }
+
+         std::vector<float> jecSF(n), jerSF(n), jerUp(n), jerDown(n), jesUp(n), jesDown(n);
+         if(isMC) correctJets(n, &rawPt[0], &eta[0], &area[0], &genPt[0], rho, nvtx, jesCor, totalJESUnc, &jecSF[0], &jerSF[0], &jerUp[0], &jerDown[0], &jesUp[0], &jesDown[0]);
+         else     correctJets(n, &rawPt[0], &eta[0], &area[0], NULL,      rho, nvtx, jesCor, totalJESUnc, &jecSF[0]);
+
+         for(size_t ijet=0; ijet<n; ijet++){
+             pat::Jet& jet = jets[ijet];
+             jet.setP4(rawP4[ijet]*jecSF[ijet]);
+             if(!isMC) continue;
+
+             //smear JER and set the up/down alternatives (1.0 if there is no matched gen jet)
+             jet.setP4(jet.p4()*jerSF[ijet]);
+             jet.addUserFloat("jerup",      jerUp  [ijet]);  //kept for backward compatibility
+             jet.addUserFloat("jerdown",    jerDown[ijet]);  //kept for backward compatibility
+             jet.addUserFloat("_res_jup",   jerUp  [ijet]);
+             jet.addUserFloat("_res_jdown", jerDown[ijet]);
+
+             //set the JES up/down pT alternatives
+             jet.addUserFloat("jesup",        jesUp  [ijet]);  //kept for backward compatibility
+             jet.addUserFloat("jesdown",      jesDown[ijet]);  //kept for backward compatibility
+             jet.addUserFloat("_scale_jup",   jesUp  [ijet]);
+             jet.addUserFloat("_scale_jdown", jesDown[ijet]);
 
              // FIXME: this is not to be re-set. Check that this is a desired non-feature.
              // i.e. check that the uncorrectedJet remains the same even when the corrected momentum is changed by this routine.
-             //to get the raw jet again
-             //jets[ijet].setVal("torawsf",1./(newJECSF*newJERSF));
          }
      }
 
@@ -235,21 +258,8 @@ namespace utils
       if(genPt<=0) return toReturn;
       
       //
-      eta=fabs(eta);
-      double ptSF(1.0), ptSF_err(0.06);
-      if(eta<0.5)                  { ptSF=1.109; ptSF_err=0.008; }
-      else if(eta>=0.5 && eta<0.8) { ptSF=1.138; ptSF_err=0.013; }
-      else if(eta>=0.8 && eta<1.1) { ptSF=1.114; ptSF_err=0.013; }
-      else if(eta>=1.1 && eta<1.3) { ptSF=1.123; ptSF_err=0.024; }
-      else if(eta>=1.3 && eta<1.7) { ptSF=1.084; ptSF_err=0.011; }
-      else if(eta>=1.7 && eta<1.9) { ptSF=1.082; ptSF_err=0.035; }
-      else if(eta>=1.9 && eta<2.1) { ptSF=1.140; ptSF_err=0.047; }
-      else if(eta>=2.1 && eta<2.3) { ptSF=1.067; ptSF_err=0.053; }
-      else if(eta>=2.3 && eta<2.5) { ptSF=1.177; ptSF_err=0.041; }
-      else if(eta>=2.5 && eta<2.8) { ptSF=1.364; ptSF_err=0.039; }
-      else if(eta>=2.8 && eta<3.0) { ptSF=1.857; ptSF_err=0.071; }
-      else if(eta>=3.0 && eta<3.2) { ptSF=1.328; ptSF_err=0.022; }
-      else if(eta>=3.2 && eta<5.0) { ptSF=1.16 ; ptSF_err=0.029; } 
+      double ptSF, ptSF_err;
+      getJERScaleFactor(fabs(eta), ptSF, ptSF_err);
 
       toReturn[0]=TMath::Max(0.,((genPt+ptSF*(pt-genPt)))/pt);
       toReturn[1]=TMath::Max(0.,((genPt+(ptSF+ptSF_err)*(pt-genPt)))/pt);
@@ -2,6 +2,8 @@
 
 #include "DataFormats/METReco/interface/HcalNoiseSummary.h"
 
+#include <algorithm>
+
 namespace patUtils
 {
 
@@ -31,71 +33,134 @@ namespace patUtils
      return gainSeedSC;
   }
 
-  float makeTkIsoCloseBySafe( float coneSize, float initialValue, const pat::Muon &theMuon, pat::MuonCollection muons){
+  PFCandidateIsolation::PFCandidateIsolation(const pat::PackedCandidateCollection& cands, float cellSize, float maxEta):
+    cands_(cands), maxEta_(maxEta)
+  {
+    nEta_ = std::max(1, (int)ceil(2*maxEta/cellSize));
+    nPhi_ = std::max(1, (int)ceil(2*M_PI/cellSize));
+    cellEta_ = 2*maxEta/nEta_;
+    cellPhi_ = 2*M_PI/nPhi_;
+
+    //cache the kinematics (packed candidates unpack them on access) and count the candidates per cell
+    unsigned int n = cands.size();
+    eta_.resize(n); phi_.resize(n); pt_.resize(n); absPdgId_.resize(n);
+    std::vector<unsigned int> cellOf(n);
+    cellStart_.assign(nEta_*nPhi_+1, 0);
+    for(unsigned int i=0; i<n; i++){
+      const pat::PackedCandidate& c = cands[i];
+      eta_[i] = c.eta();  phi_[i] = c.phi();  pt_[i] = c.pt();  absPdgId_[i] = abs(c.pdgId());
+      cellOf[i] = etaCell(eta_[i])*nPhi_ + phiCell(phi_[i]);
+      cellStart_[cellOf[i]+1]++;
+    }
+    for(unsigned int c=1; c<cellStart_.size(); c++) cellStart_[c] += cellStart_[c-1];
+
+    //fill the cells keeping the original candidate order within each cell
+    cellCands_.resize(n);
+    std::vector<unsigned int> fill(cellStart_.begin(), cellStart_.end()-1);
+    for(unsigned int i=0; i<n; i++) cellCands_[fill[cellOf[i]]++] = i;
+  }
+
+  int PFCandidateIsolation::etaCell(double eta) const {
+    int c = (int)floor((eta+maxEta_)/cellEta_);
+    return std::min(std::max(c, 0), nEta_-1);
+  }
+
+  int PFCandidateIsolation::phiCell(double phi) const {
+    int c = (int)floor((phi+M_PI)/cellPhi_);
+    return ((c%nPhi_)+nPhi_)%nPhi_;
+  }
+
+  void PFCandidateIsolation::getNeighbours(double eta, double phi, float coneSize, std::vector<unsigned int>& out, int absPdgId) const {
+    out.clear();
+    double cone2 = coneSize*coneSize;
+    const double margin = 1E-5;  //protect against rounding at the cell edges
+    int etaMin = etaCell(eta-coneSize-margin), etaMax = etaCell(eta+coneSize+margin);
+    int dPhi = (int)ceil((coneSize+margin)/cellPhi_);
+    int phiC = phiCell(phi);
+    int phiMin = phiC-dPhi, phiMax = phiC+dPhi;
+    if(phiMax-phiMin+1>=nPhi_){ phiMin=0; phiMax=nPhi_-1; }  //the cone covers the full phi range
+    for(int ie=etaMin; ie<=etaMax; ie++){
+      for(int ip=phiMin; ip<=phiMax; ip++){
+        int cell = ie*nPhi_ + ((ip%nPhi_)+nPhi_)%nPhi_;
+        for(unsigned int k=cellStart_[cell]; k<cellStart_[cell+1]; k++){
+          unsigned int i = cellCands_[k];
+          if(absPdgId!=0 && absPdgId_[i]!=absPdgId) continue;
+          if(deltaR2(eta, phi, eta_[i], phi_[i])<=cone2) out.push_back(i);
+        }
+      }
+    }
+    std::sort(out.begin(), out.end());  //same order as a plain loop over the collection
+  }
+
+  float PFCandidateIsolation::coneSum(double eta, double phi, float coneSize, int absPdgId, float threshold, float vetoCone) const {
+    std::vector<unsigned int> neighbours;
+    getNeighbours(eta, phi, coneSize, neighbours, absPdgId);
+    float sum = 0;
+    for(unsigned int k=0; k<neighbours.size(); k++){
+      unsigned int i = neighbours[k];
+      if(pt_[i]<threshold) continue;
+      if(vetoCone>0 && deltaR2(eta, phi, eta_[i], phi_[i])<vetoCone*vetoCone) continue;
+      sum += pt_[i];
+    }
+    return sum;
+  }
+
+  float makeTkIsoCloseBySafe( float coneSize, float initialValue, const pat::Muon &theMuon, const pat::MuonCollection& muons){
     float returnValue = initialValue;
     for (unsigned int i=0 ; i<muons.size() ; i++){
-       pat::Muon &otherMu = muons.at(i);
+       const pat::Muon &otherMu = muons.at(i);
        float theDeltaR2 = deltaR2(theMuon, otherMu);
        if (theDeltaR2==0) continue; //it is the same muon
+       if (theDeltaR2>=(coneSize*coneSize)) continue; //only muons inside the cone matter, check this before the (more expensive) id
        bool tkHighPt = otherMu.isTrackerMuon() && otherMu.track().isNonnull() && otherMu.numberOfMatchedStations() > 1 && (otherMu.muonBestTrack()->ptError()/otherMu.muonBestTrack()->pt()) < 0.3 && otherMu.innerTrack()->hitPattern().numberOfValidPixelHits() > 0 && otherMu.innerTrack()->hitPattern().trackerLayersWithMeasurement()>5;
        if (!(tkHighPt)) continue; //remove the other muon only if passes the tkHighpt id
-       if (theDeltaR2<(coneSize*coneSize)) returnValue = returnValue - otherMu.innerTrack()->pt();
+       returnValue = returnValue - otherMu.innerTrack()->pt();
     }
     return returnValue;
   }
-  float computePFphotonIsolation(std::vector<pat::PackedCandidate> thePFparticles, float coneSize, float threshold, const pat::Muon &theMuon, pat::MuonCollection muons, reco::Vertex& vertex){
+
+  float computePFphotonIsolation(const std::vector<pat::PackedCandidate>& thePFparticles, float coneSize, float threshold, const pat::Muon &theMuon, const pat::MuonCollection& muons, reco::Vertex& vertex){
+    PFCandidateIsolation pfIso(thePFparticles);
+    return computePFphotonIsolation(pfIso, coneSize, threshold, theMuon, muons, vertex);
+  }
+
+  float computePFphotonIsolation(const PFCandidateIsolation& pfIso, float coneSize, float threshold, const pat::Muon &theMuon, const pat::MuonCollection& muons, reco::Vertex& vertex){
     std::vector<unsigned int> listOfFSRphoton;
+    std::vector<unsigned int> photons;
     for (unsigned int j = 0; j < muons.size(); ++j) {
-      std::vector<unsigned int> listOfFSRphotonForThisMuon;
       const reco::Muon &otherMu = muons.at(j);
       if (!(muon::isLooseMuon(otherMu))) continue;
       float dxy = otherMu.innerTrack()->dxy(vertex.position());
       float dz = otherMu.innerTrack()->dz(vertex.position());
       if (!(fabs(dxy)<0.5)) continue;
       if (!(fabs(dz)<1)) continue;
-      for (unsigned int itePat=0 ; itePat<thePFparticles.size(); itePat++){
-        pat::PackedCandidate aPat = thePFparticles.at(itePat);
-        if (!(fabs(aPat.pdgId())==22)) continue;
-        float deltaR = sqrt(deltaR2(aPat,otherMu));
-        float estimator = deltaR/(aPat.pt()*aPat.pt());
-        if ((estimator<0.012)&&(deltaR<0.5)) listOfFSRphotonForThisMuon.push_back(itePat);
-      }
-      if (listOfFSRphotonForThisMuon.size()>1){
-        int minIte=-1;
-        float minEstimator=100;
-        for (unsigned int m=0;m<listOfFSRphotonForThisMuon.size(); m++){
-          pat::PackedCandidate aPat = thePFparticles.at(listOfFSRphotonForThisMuon.at(m));
-          float deltaR = sqrt(deltaR2(aPat,otherMu));
-          float estimator = deltaR/(aPat.pt()*aPat.pt());
-          if (estimator<minEstimator){
-            minEstimator=estimator;
-            minIte = m;
-          }
+
+      //FSR photon candidate of this muon: the one with the smallest deltaR/pt^2 (below 0.012) within deltaR<0.5
+      int minIte=-1;
+      float minEstimator=0.012;
+      pfIso.getNeighbours(otherMu.eta(), otherMu.phi(), 0.5, photons, 22);
+      for (unsigned int m=0; m<photons.size(); m++){
+        unsigned int itePat = photons[m];
+        float deltaR = sqrt(deltaR2(pfIso.eta(itePat), pfIso.phi(itePat), otherMu.eta(), otherMu.phi()));
+        if (!(deltaR<0.5)) continue;
+        float estimator = deltaR/(pfIso.pt(itePat)*pfIso.pt(itePat));
+        if (estimator<minEstimator){
+          minEstimator=estimator;
+          minIte = itePat;
         }
-        //cout << "at this point " << minEstimator << " " << minIte << endl;
-        listOfFSRphoton.push_back(listOfFSRphotonForThisMuon.at(minIte));
-      }
-      else if (listOfFSRphotonForThisMuon.size()==1){
-        listOfFSRphoton.push_back(listOfFSRphotonForThisMuon.at(0));
       }
+      if (minIte>=0) listOfFSRphoton.push_back(minIte);
     }
-    float thePFvalue = 0;
-    for (unsigned int itePat=0 ; itePat<thePFparticles.size(); itePat++){
-      pat::PackedCandidate aPat = thePFparticles.at(itePat);
-      if (!(fabs(aPat.pdgId())==22)) continue;
-      bool isAnFSRPhoton=false;
-
-      float deltaR = deltaR2(aPat,theMuon);
-
-      if (deltaR>(coneSize*coneSize)) continue;
 
-      for (unsigned int m=0 ; m<listOfFSRphoton.size() ; m++){
-        if (itePat==listOfFSRphoton.at(m)) isAnFSRPhoton=true;
-      }
-      if (isAnFSRPhoton) continue;
+    float thePFvalue = 0;
+    pfIso.getNeighbours(theMuon.eta(), theMuon.phi(), coneSize, photons, 22);
+    for (unsigned int m=0; m<photons.size(); m++){
+      unsigned int itePat = photons[m];
+      if (std::find(listOfFSRphoton.begin(), listOfFSRphoton.end(), itePat)!=listOfFSRphoton.end()) continue;
+      float deltaR = deltaR2(pfIso.eta(itePat), pfIso.phi(itePat), theMuon.eta(), theMuon.phi());
       if (deltaR<(0.01*0.01)) continue;
-      if (aPat.pt()<threshold) continue;
-      thePFvalue=thePFvalue+aPat.pt();
+      if (pfIso.pt(itePat)<threshold) continue;
+      thePFvalue=thePFvalue+pfIso.pt(itePat);
     }
     return thePFvalue;
   }
@@ -784,7 +849,12 @@ namespace patUtils
     return false;
   }
 
-  bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, std::vector<pat::PackedCandidate> thePats, pat::MuonCollection muons, reco::Vertex& vertex ){
+  bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, const std::vector<pat::PackedCandidate>& thePats, pat::MuonCollection& muons, reco::Vertex& vertex ){
+    PFCandidateIsolation pfIso(thePats);
+    return passIso(mu, IsoLevel, cutVersion, pfIso, muons, vertex);
+  }
+
+  bool passIso(pat::Muon& mu, int IsoLevel, int cutVersion, const PFCandidateIsolation& pfIso, pat::MuonCollection& muons, reco::Vertex& vertex ){
   //https://twiki.cern.ch/twiki/bin/view/CMSPublic/SWGuideMuonId#Muon_Isolation
   float  chIso   = mu.pfIsolationR04().sumChargedHadronPt;
   float  nhIso   = mu.pfIsolationR04().sumNeutralHadronEt;
@@ -795,18 +865,22 @@ namespace patUtils
   float  nhIso03   = mu.pfIsolationR03().sumNeutralHadronEt;
   //float  gIso03    = mu.pfIsolationR03().sumPhotonEt;
   float  puchIso03 = mu.pfIsolationR03().sumPUPt;
-  float gIso03H4l = computePFphotonIsolation(thePats, 0.3, 0., mu, muons, vertex);
+  //the PF based quantities are only computed for the working points that use them
+  bool needH4lIso    = cutVersion==CutVersion::Moriond17Cut && IsoLevel==llvvMuonIso::H4lWP;
+  bool needCloseByIso = cutVersion==CutVersion::Moriond17Cut && (IsoLevel==llvvMuonIso::TightBoosted || IsoLevel==llvvMuonIso::TightAndTkRelatBoosted);
+  float gIso03H4l = needH4lIso ? computePFphotonIsolation(pfIso, 0.3, 0., mu, muons, vertex) : 0.;
   float  relIso03  = (chIso03 + TMath::Max(0.,nhIso03+gIso03H4l-0.5*puchIso03)) / mu.pt();
   float  trkrelIso = mu.isolationR03().sumPt/mu.pt(); // no PU correction
 
-  float trkrelIsoCloseByCleanned =  makeTkIsoCloseBySafe( 0.3, mu.isolationR03().sumPt, mu, muons)/mu.pt();
+  float trkrelIsoCloseByCleanned =  needCloseByIso ? makeTkIsoCloseBySafe( 0.3, mu.isolationR03().sumPt, mu, muons)/mu.pt() : trkrelIso;
 
 
   float chHadPtToRemove=0;
   float ntHadPtToRemove=0;
   float pfPhotonToRemove=0;
+  std::vector<unsigned int> inCone;
   ///checkMuonInCone
-  for (unsigned int j = 0; j < muons.size(); ++j) {
+  for (unsigned int j = 0; needCloseByIso && j < muons.size(); ++j) {
       pat::Muon &otherMu = muons.at(j);
       if (deltaR2(mu, otherMu)==0) continue;
       if (!(patUtils::passId(otherMu, vertex, patUtils::llvvMuonId::tkHighPT, patUtils::CutVersion::ICHEP16Cut))) continue;
@@ -822,8 +896,9 @@ namespace patUtils
           int iteParticle = -1;
           int iteParticleMain = -1;*/
 
-          for (unsigned int itePat=0 ; itePat<thePats.size(); itePat++){
-            pat::PackedCandidate aPat = thePats.at(itePat);
+          pfIso.getNeighbours(otherMu.eta(), otherMu.phi(), 0.4, inCone);
+          for (unsigned int k=0 ; k<inCone.size(); k++){
+            const pat::PackedCandidate& aPat = pfIso.candidates()[inCone[k]];
             if (fabs(aPat.pdgId())==13) continue;
             float deltaR = deltaR2(aPat,otherMu);
             float deltaRMu = deltaR2(aPat,mu);
@@ -0,0 +1,263 @@
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <map>
+#include <algorithm>
+
+#include "TDirectory.h"
+#include "TH1D.h"
+
+using namespace std;
+
+namespace profUtils
+{
+   bool enabled = false;
+
+   //per-event times are histogrammed in 10 logarithmic bins per decade between 100ns and 100s
+   static const int    nTimeBins   = 90;
+   static const double minTimeLog  = -7.0;
+   static const double binsPerDecade = 10.0;
+
+   struct Stage_t{
+      string name;
+      double total;                    //seconds
+      unsigned long long calls;
+      double inEvent;                  //time spent in the stage during the current event
+      double maxPerEvent;
+      double sumPerEvent;
+      unsigned long long nEvents;      //events in which the stage was active
+      std::vector<unsigned long long> perEvent;
+      Stage_t(const string& name_):name(name_),total(0),calls(0),inEvent(0),maxPerEvent(0),sumPerEvent(0),nEvents(0),perEvent(nTimeBins+2,0){}
+   };
+
+   struct MemorySample_t{ string label; double time; double rss; double peak; };
+
+   //function-local statics, so that stage() can be used from static initializers of other translation units
+   static std::vector<Stage_t>& stages(){ static std::vector<Stage_t> s; return s; }
+
+   static string jobName_;
+   static std::vector<int> stack_;
+   static double lastSwitch_ = 0;
+   static double startTime_ = 0;
+   static double startCpu_ = 0;
+   static bool inEvent_ = false;
+   static unsigned long long nEvents_ = 0;
+   static std::map<string, double> counters_;
+   static std::vector<MemorySample_t> memory_;
+   static std::vector<int> touched_;  //stages active during the current event
+
+   static double now(){
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + 1E-9*ts.tv_nsec;
+   }
+
+   static double cpuTime(){
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_utime.tv_sec + 1E-6*usage.ru_utime.tv_usec + usage.ru_stime.tv_sec + 1E-6*usage.ru_stime.tv_usec;
+   }
+
+   static int timeBin(double t){
+      if(t<=0)return 0;
+      int bin = 1 + (int)floor((log10(t)-minTimeLog)*binsPerDecade);
+      if(bin<0)bin=0;
+      if(bin>nTimeBins+1)bin=nTimeBins+1;
+      return bin;
+   }
+
+   //upper edge of a bin, used as estimate for the quantiles
+   static double binUpEdge(int bin){ return pow(10., minTimeLog + bin/binsPerDecade); }
+
+   //give the time since the last switch to the current stage
+   static void attribute(double t){
+      if(!stack_.empty()){
+         Stage_t& s = stages()[stack_.back()];
+         s.total += t - lastSwitch_;
+         if(inEvent_){
+            if(s.inEvent==0)touched_.push_back(stack_.back());
+            s.inEvent += t - lastSwitch_;
+         }
+      }
+      lastSwitch_ = t;
+   }
+
+   void enable(const std::string& jobName){
+      if(enabled)return;
+      enabled = true;
+      jobName_ = jobName;
+      startTime_ = now();
+      startCpu_ = cpuTime();
+      lastSwitch_ = startTime_;
+   }
+
+   int stage(const std::string& name){
+      std::vector<Stage_t>& s = stages();
+      for(unsigned int i=0;i<s.size();i++){ if(s[i].name==name)return i; }
+      s.push_back(Stage_t(name));
+      return s.size()-1;
+   }
+
+   void enterImpl(int id){
+      attribute(now());
+      stack_.push_back(id);
+      stages()[id].calls++;
+   }
+
+   void leaveImpl(){
+      if(stack_.empty())return;
+      attribute(now());
+      stack_.pop_back();
+   }
+
+   void markImpl(int id){
+      attribute(now());
+      if(stack_.empty()){ stack_.push_back(id); }else{ stack_.back() = id; }
+      stages()[id].calls++;
+   }
+
+   void beginEventImpl(){
+      if(inEvent_)endEventImpl();
+      attribute(now());
+      inEvent_ = true;
+   }
+
+   void endEventImpl(){
+      if(!inEvent_)return;
+      attribute(now());
+      std::vector<Stage_t>& s = stages();
+      for(unsigned int i=0;i<touched_.size();i++){
+         Stage_t& st = s[touched_[i]];
+         st.perEvent[timeBin(st.inEvent)]++;
+         st.sumPerEvent += st.inEvent;
+         if(st.inEvent>st.maxPerEvent)st.maxPerEvent = st.inEvent;
+         st.nEvents++;
+         st.inEvent = 0;
+      }
+      touched_.clear();
+      inEvent_ = false;
+      nEvents_++;
+   }
+
+   void count(const std::string& name, double value){
+      if(!enabled)return;
+      counters_[name] += value;
+   }
+
+   double getMemoryMB(const char* field){
+      FILE* pFile = fopen("/proc/self/status", "r");
+      if(!pFile)return -1;
+      char line[256]; double kB = -1;
+      size_t len = strlen(field);
+      while(fgets(line, sizeof(line), pFile)){
+         if(strncmp(line, field, len)==0 && line[len]==':'){ sscanf(line+len+1, "%lf", &kB); break; }
+      }
+      fclose(pFile);
+      return kB/1024.;
+   }
+
+   void sampleMemory(const std::string& label){
+      if(!enabled)return;
+      MemorySample_t sample = {label, now()-startTime_, getMemoryMB("VmRSS"), getMemoryMB("VmHWM")};
+      memory_.push_back(sample);
+   }
+
+   static double quantile(const Stage_t& s, double q){
+      unsigned long long target = (unsigned long long)ceil(q*s.nEvents), sum = 0;
+      for(int b=0;b<nTimeBins+2;b++){ sum += s.perEvent[b]; if(sum>=target && sum>0)return std::min(binUpEdge(b), s.maxPerEvent); }
+      return s.maxPerEvent;
+   }
+
+   //escape the characters that are not allowed in a JSON string
+   static string jsonString(const string& in){
+      string out = "\"";
+      for(unsigned int i=0;i<in.size();i++){
+         if(in[i]=='"' || in[i]=='\\'){ out += '\\'; out += in[i]; }
+         else if((unsigned char)in[i]<0x20){ char buf[8]; sprintf(buf, "\\u%04x", in[i]); out += buf; }
+         else out += in[i];
+      }
+      return out + "\"";
+   }
+
+   void writeSummary(const std::string& jsonFile, TDirectory* dir){
+      if(!enabled)return;
+      if(inEvent_)endEventImpl();
+      while(!stack_.empty())leaveImpl();
+      sampleMemory("end of job");
+      double wallTime = now() - startTime_;
+      double cpu = cpuTime() - startCpu_;
+      std::vector<Stage_t>& s = stages();
+
+      double tracked = 0;
+      for(unsigned int i=0;i<s.size();i++)tracked += s[i].total;
+
+      FILE* pFile = fopen(jsonFile.c_str(), "w");
+      if(!pFile){ printf("profUtils: can not write the profiling summary to %s\n", jsonFile.c_str()); }
+      else{
+         fprintf(pFile, "{\n");
+         fprintf(pFile, "  \"job\": %s,\n", jsonString(jobName_).c_str());
+         fprintf(pFile, "  \"wallTime\": %.6f,\n", wallTime);
+         fprintf(pFile, "  \"cpuTime\": %.6f,\n", cpu);
+         fprintf(pFile, "  \"untrackedTime\": %.6f,\n", std::max(0., wallTime-tracked));
+         fprintf(pFile, "  \"events\": %llu,\n", nEvents_);
+         fprintf(pFile, "  \"eventsPerSecond\": %.3f,\n", wallTime>0 ? nEvents_/wallTime : 0.);
+         fprintf(pFile, "  \"peakRSSMB\": %.1f,\n", getMemoryMB("VmHWM"));
+         fprintf(pFile, "  \"stages\": [");
+         bool first = true;
+         for(unsigned int i=0;i<s.size();i++){
+            if(s[i].calls==0)continue;
+            fprintf(pFile, "%s\n    {\"name\": %s, \"total\": %.6f, \"fraction\": %.4f, \"calls\": %llu", first?"":",", jsonString(s[i].name).c_str(), s[i].total, wallTime>0 ? s[i].total/wallTime : 0., s[i].calls);
+            if(s[i].nEvents>0){
+               fprintf(pFile, ", \"perEvent\": {\"events\": %llu, \"mean\": %.3e, \"p50\": %.3e, \"p90\": %.3e, \"p99\": %.3e, \"max\": %.3e}",
+                       s[i].nEvents, s[i].sumPerEvent/s[i].nEvents, quantile(s[i],0.5), quantile(s[i],0.9), quantile(s[i],0.99), s[i].maxPerEvent);
+            }
+            fprintf(pFile, "}");
+            first = false;
+         }
+         fprintf(pFile, "\n  ],\n");
+         fprintf(pFile, "  \"counters\": {");
+         for(std::map<string, double>::iterator it=counters_.begin(); it!=counters_.end(); it++){
+            fprintf(pFile, "%s\n    %s: %.6g", it==counters_.begin()?"":",", jsonString(it->first).c_str(), it->second);
+         }
+         fprintf(pFile, "\n  },\n");
+         fprintf(pFile, "  \"memory\": [");
+         for(unsigned int m=0;m<memory_.size();m++){
+            fprintf(pFile, "%s\n    {\"label\": %s, \"time\": %.3f, \"rssMB\": %.1f, \"peakMB\": %.1f}", m?",":"", jsonString(memory_[m].label).c_str(), memory_[m].time, memory_[m].rss, memory_[m].peak);
+         }
+         fprintf(pFile, "\n  ]\n}\n");
+         fclose(pFile);
+         printf("Profiling summary (%.1f s, %llu events, %.1f events/s) saved in %s\n", wallTime, nEvents_, wallTime>0 ? nEvents_/wallTime : 0., jsonFile.c_str());
+      }
+
+      if(dir){
+         TDirectory* current = gDirectory;
+         TDirectory* pdir = dir->mkdir("profiling");
+         if(pdir){
+            pdir->cd();
+            std::vector<double> edges(nTimeBins+1);
+            for(int b=0;b<=nTimeBins;b++)edges[b] = binUpEdge(b);
+            TH1D* totals = new TH1D("stageTotals", ";stage;time (s)", std::max(1,(int)s.size()), 0, std::max(1,(int)s.size()));
+            for(unsigned int i=0;i<s.size();i++){
+               totals->GetXaxis()->SetBinLabel(i+1, s[i].name.c_str());
+               totals->SetBinContent(i+1, s[i].total);
+               if(s[i].nEvents==0)continue;
+               string name = "perEvent_" + s[i].name;
+               for(unsigned int c=0;c<name.size();c++){ if(!isalnum(name[c]))name[c]='_'; }
+               TH1D* h = new TH1D(name.c_str(), (s[i].name+";time per event (s);events").c_str(), nTimeBins, &edges[0]);
+               for(int b=0;b<nTimeBins+2;b++)h->SetBinContent(b, s[i].perEvent[b]);
+               h->SetEntries(s[i].nEvents);
+               h->Write();
+               delete h;
+            }
+            totals->Write();
+            delete totals;
+         }
+         if(current)current->cd();
+      }
+   }
+}
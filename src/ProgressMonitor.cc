@@ -0,0 +1,146 @@
+#include "UserCode/bsmhiggs_fwk/interface/ProgressMonitor.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "TFile.h"
+
+using namespace std;
+
+static double monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+//bytes read so far by all the TFiles of the process (local files as well as remote access)
+static double bytesRead() { return (double)TFile::GetFileBytesRead(); }
+
+static std::string formatDuration(double t)
+{
+    char buf[64];
+    long s = (long)(t+0.5);
+    if(s>=3600) sprintf(buf, "%ldh%02ldm%02lds", s/3600, (s%3600)/60, s%60);
+    else if(s>=60) sprintf(buf, "%ldm%02lds", s/60, s%60);
+    else sprintf(buf, "%lds", s);
+    return buf;
+}
+
+//
+ProgressMonitor::ProgressMonitor(const std::string& name, long long total, const std::string& unit, const std::string& statusFile, double interval):
+    name_(name), unit_(unit), statusFile_(statusFile), interval_(interval>0 ? interval : 30), total_(total), done_(0), countdown_(1), step_(1),
+    lastDone_(0), finished_(false)
+{
+    startTime_  = monotonicTime();
+    lastReport_ = startTime_;
+    lastCheck_  = startTime_;
+    lastCheckDone_ = 0;
+    startBytes_ = bytesRead();
+    lastBytes_  = startBytes_;
+    if(statusFile_!="") writeStatus("running", startTime_, 0, 0, -1, profUtils::getMemoryMB("VmRSS"));
+}
+
+//
+ProgressMonitor::~ProgressMonitor()
+{
+    //a job leaving its loop through an error path never called finish()
+    if(!finished_ && statusFile_!="") writeStatus("failed", monotonicTime(), 0, 0, -1, profUtils::getMemoryMB("VmRSS"));
+}
+
+//
+void ProgressMonitor::setCommand(int argc, char* argv[])
+{
+    command_ = "";
+    for(int i=0; i<argc; i++) { if(i) command_ += " "; command_ += argv[i]; }
+}
+
+//
+void ProgressMonitor::check()
+{
+    double now = monotonicTime();
+    //aim at one clock check every ~0.2s given the rate since the previous check, growing the step at
+    //most by a factor 2 per check so that a sudden slowdown is still noticed in time
+    if(now-lastCheck_<0.05) {
+        step_ *= 2;
+    } else {
+        double rate = (done_-lastCheckDone_)/(now-lastCheck_);
+        step_ = std::max(1LL, std::min((long long)(0.2*rate), 2*step_));
+        lastCheck_ = now;
+        lastCheckDone_ = done_;
+    }
+    countdown_ = step_;
+    if(now-lastReport_>=interval_) report("running");
+}
+
+//
+void ProgressMonitor::report(const char* state)
+{
+    double now = monotonicTime();
+    double elapsed = std::max(1E-6, now-startTime_);
+    double dt = std::max(1E-6, now-lastReport_);
+    double bytes = bytesRead();
+    bool isFinal = (state[0]!='r');
+
+    //the current rates are computed over the last interval, the ETA uses the average rate of the job
+    double rate   = isFinal ? done_/elapsed : (done_-lastDone_)/dt;
+    double mbRate = (isFinal ? bytes-startBytes_ : bytes-lastBytes_)/(isFinal ? elapsed : dt)/1048576.;
+    double avgRate = done_/elapsed;
+    double eta = (total_>0 && avgRate>0 && !isFinal) ? std::max(0LL, total_-done_)/avgRate : -1;
+    double rss = profUtils::getMemoryMB("VmRSS");
+
+    char progress[128];
+    if(total_>0) sprintf(progress, "%lld/%lld %s (%.1f%%)", done_, total_, unit_.c_str(), 100.0*done_/total_);
+    else sprintf(progress, "%lld %s", done_, unit_.c_str());
+    printf("%s %s: %s, %.1f %s/s", isFinal ? "Done" : "Progress", name_.c_str(), progress, rate, unit_.c_str());
+    if(bytes>startBytes_) printf(", %.2f MB/s", mbRate);
+    if(eta>=0) printf(", ETA %s", formatDuration(eta).c_str());
+    if(isFinal) printf(", %s", formatDuration(elapsed).c_str());
+    printf(", RSS %.1f MB\n", rss);
+    fflush(stdout);
+
+    if(statusFile_!="") writeStatus(state, now, rate, mbRate, eta, rss);
+    lastReport_ = now;
+    lastDone_   = done_;
+    lastBytes_  = bytes;
+}
+
+//
+void ProgressMonitor::writeStatus(const char* state, double now, double rate, double mbRate, double eta, double rss)
+{
+    std::string tmpFile = statusFile_ + ".tmp";
+    FILE* pFile = fopen(tmpFile.c_str(), "w");
+    if(!pFile) { printf("ProgressMonitor: can not write %s, status file disabled\n", tmpFile.c_str()); statusFile_ = ""; return; }
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+    fprintf(pFile, "name = %s\n", name_.c_str());
+    fprintf(pFile, "command = %s\n", command_.c_str());
+    fprintf(pFile, "host = %s\n", host);
+    fprintf(pFile, "pid = %d\n", (int)getpid());
+    fprintf(pFile, "state = %s\n", state);
+    fprintf(pFile, "unit = %s\n", unit_.c_str());
+    fprintf(pFile, "done = %lld\n", done_);
+    fprintf(pFile, "total = %lld\n", total_);
+    fprintf(pFile, "fraction = %.4f\n", total_>0 ? (double)done_/total_ : -1.);
+    fprintf(pFile, "rate = %.3f\n", rate);
+    fprintf(pFile, "mbPerSecond = %.3f\n", mbRate);
+    fprintf(pFile, "eta = %.0f\n", eta);
+    fprintf(pFile, "elapsed = %.1f\n", now-startTime_);
+    fprintf(pFile, "rssMB = %.1f\n", rss);
+    fprintf(pFile, "interval = %.1f\n", interval_);
+    //wall clock time of this update, compared by the scripts to their own clock to detect stuck jobs
+    fprintf(pFile, "updated = %ld\n", (long)time(NULL));
+    fclose(pFile);
+    if(rename(tmpFile.c_str(), statusFile_.c_str())!=0) printf("ProgressMonitor: can not update %s\n", statusFile_.c_str());
+}
+
+//
+void ProgressMonitor::finish(bool ok)
+{
+    if(finished_) return;
+    finished_ = true;
+    report(ok ? "done" : "failed");
+}
@@ -1,4 +1,7 @@
 #include "UserCode/bsmhiggs_fwk/interface/SmartSelectionMonitor.h"
+#include "UserCode/bsmhiggs_fwk/interface/ProfilingUtils.h"
+
+static const int fillStage = profUtils::stage("histogram filling");
 
 
 // add new histogram
@@ -21,6 +24,7 @@ TH1 * SmartSelectionMonitor::addHistogram(TH1 *h){
 // takes care of filling an histogram
 bool SmartSelectionMonitor::fillHisto(TString name, TString tag, double val, double weight, bool useBinWidth)
 {
+  profUtils::ScopedTimer timer(fillStage);
   TH1 *h = getHisto(name,tag);
   if(h==0) return false;
   if(useBinWidth){ int ibin =h->FindBin(val); double width = h->GetBinWidth(ibin);   weight /= width;  }
@@ -42,6 +46,7 @@ bool SmartSelectionMonitor::fillHisto(TString name, std::vector<TString> tags, d
 // takes care of filling a 2d histogram
 bool SmartSelectionMonitor::fillHisto(TString name, TString tag, double valx, double valy, double weight, bool useBinWidth)
 {
+  profUtils::ScopedTimer timer(fillStage);
   TH2 *h = (TH2 *)getHisto(name,tag);
   if(h==0) return false;
   if(useBinWidth){ int ibin =h->FindBin(valx,valy); double width = h->GetBinWidth(ibin); weight /= width; }
@@ -169,8 +169,8 @@ TH1_t *th1fmorph_(const char *chname,
 
   Value_t *dist1=hist1->GetArray(); 
   Value_t *dist2=hist2->GetArray();
-  Double_t *sigdis1 = new Double_t[1+nb1];
-  Double_t *sigdis2 = new Double_t[1+nb2];
+  Double_t *sigdis1 = new Double_t[2+nb1];
+  Double_t *sigdis2 = new Double_t[2+nb2];
   Double_t *sigdisn = new Double_t[2+nb1+nb2];
   Double_t *xdisn = new Double_t[2+nb1+nb2];
   Double_t *sigdisf = new Double_t[nbn+1];
@@ -214,6 +214,9 @@ TH1_t *th1fmorph_(const char *chname,
   for(Int_t i=1;i<nb2+1;i++) {
     sigdis2[i] = sigdis2[i]/total + sigdis2[i-1];
   }
+  // The walk below may look one point past the last edge, pad the cdf's
+  // with their final value so that read is well defined.
+  sigdis1[nb1+1] = sigdis1[nb1]; sigdis2[nb2+1] = sigdis2[nb2];
 
   // *
   // *......We are going to step through all the edges of both input
@@ -397,7 +400,7 @@ TH1_t *th1fmorph_(const char *chname,
     sigdisf[ix] = sigdisn[nx3];
     if (idebug >= 2) cout << "   Setting final bins" << ix << " " << x 
                           << " " << sigdisf[ix] << endl;
-    ix = ix-1;
+    ix = ix-1; if(ix<0) break;
     x = bedgesn[ix];
   }
   Int_t ixl = ix + 1;
@@ -418,7 +421,7 @@ TH1_t *th1fmorph_(const char *chname,
     sigdisf[ix] = sigdisn[0];
     if (idebug >= 1) cout << "   Setting initial bins " << ix << " " << x 
                           << " " << xdisn[1] << " " << sigdisf[ix] << endl;
-    ix = ix+1;
+    ix = ix+1; if(ix>=nbn) break;
     x = bedgesn[ix+1];
   }
   Int_t ixf = ix;
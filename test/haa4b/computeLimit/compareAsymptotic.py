@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+# Compare the in-process asymptotic limits (AsymptoticLimits, computeLimit --asymptotic) with combine -M Asymptotic on
+# the same card. Needs a CMSSW area with HiggsAnalysis/CombinedLimit, unless the combine log is given (--combineLog).
+#
+#  reference cards of this directory (the in-process values are printed by testAsymptoticLimits):
+#     testAsymptoticLimits counting > inproc.log; python compareAsymptotic.py --card asymptoticReference_counting.dat --log inproc.log
+#     testAsymptoticLimits lnN      > inproc.log; python compareAsymptotic.py --card asymptoticReference_lnN.dat --log inproc.log
+#     testAsymptoticLimits haa4b    > inproc.log; python compareAsymptotic.py --card asymptoticReference_haa4b.dat --log inproc.log
+#  the reference limits asserted by testAsymptoticLimits (asymptoticReference_<card>.log) are replaced by the ones of combine with
+#     python compareAsymptotic.py --card asymptoticReference_lnN.dat --log inproc.log --record asymptoticReference_lnN.log
+#  output directory of computeLimit --asymptotic (AsymptoticLimits.log and card_combined.dat, made by combineCards.sh if missing):
+#     python compareAsymptotic.py --dir 0400
+#
+# The expected limits are compared in the 2.5, 16, 50, 84 and 97.5% quantiles (and the observed one if both have it);
+# the exit code is 1 if one of them differs by more than the tolerance.
+import os,sys
+import getopt
+import commands
+
+def help() :
+   print '\n\033[92m compareAsymptotic.py \033[0m \n'
+   print '  --card <card>         datacard given to combine'
+   print '  --log <file>          in-process results (AsymptoticLimits.log or output of testAsymptoticLimits)'
+   print '  --dir <dir>           output directory of computeLimit --asymptotic, same as --card <dir>/card_combined.dat --log <dir>/AsymptoticLimits.log'
+   print '  --combineLog <file>   use this combine output instead of running combine'
+   print '  --mass <m>            mass given to combine (default 125)'
+   print '  --tolerance <x>       maximal relative difference (default 0.02)'
+   print '  --record <file>       write the combine output to this file (reference limits of testAsymptoticLimits)'
+   print '  --help                this help'
+
+#limits found in the lines of a combine-like output, in the first block or in the one after a line naming the card
+def readLimits(lines, card=''):
+   start = 0
+   if(card!=''):
+      for i in range(len(lines)):
+         if(lines[i].strip()==os.path.basename(card)): start = i; break
+   limits = {}
+   for line in lines[start:]:
+      if(line.find('r <')<0): continue
+      if(line.startswith('Expected')): key = line.split(':')[0].replace('Expected','').strip()
+      elif(line.startswith('Observed')): key = 'observed'
+      else: continue
+      if(key in limits): break  #next block
+      limits[key] = float(line.split('r <')[1].split()[0])
+   return limits
+
+card = ''
+log = ''
+combineLog = ''
+record = ''
+mass = 125
+tolerance = 0.02
+try:
+   opts, args = getopt.getopt(sys.argv[1:], 'h', ['help', 'card=', 'log=', 'dir=', 'combineLog=', 'mass=', 'tolerance=', 'record='])
+except getopt.GetoptError as err:
+   print str(err)
+   help()
+   sys.exit(2)
+for o,a in opts:
+   if o in ('-h', '--help'): help(); sys.exit(0)
+   elif o == '--card': card = a
+   elif o == '--log': log = a
+   elif o == '--dir': card = a+'/card_combined.dat'; log = a+'/AsymptoticLimits.log'
+   elif o == '--combineLog': combineLog = a
+   elif o == '--mass': mass = int(a)
+   elif o == '--tolerance': tolerance = float(a)
+   elif o == '--record': record = a
+
+if(card=='' or log==''):
+   help()
+   sys.exit(2)
+
+if(not os.path.isfile(card) and os.path.isfile(os.path.dirname(card)+'/combineCards.sh')):
+   os.system('cd '+os.path.dirname(card)+' && sh combineCards.sh')
+
+inproc = readLimits(open(log).readlines(), card)
+if(combineLog!=''):
+   combine = readLimits(open(combineLog).readlines())
+else:
+   status, output = commands.getstatusoutput('combine -M Asymptotic -m %i %s' % (mass, card))
+   if(status!=0):
+      print output
+      print 'combine failed on %s' % card
+      sys.exit(2)
+   combine = readLimits(output.split('\n'))
+   if(record!=''):
+      recordFile = open(record, 'w')
+      recordFile.write('# Reference limits of %s for test/testAsymptoticLimits.cc: output of combine -M Asymptotic -m %i\n' % (os.path.basename(card), mass))
+      recordFile.write(output+'\n')
+      recordFile.close()
+      print 'combine output written to %s' % record
+
+if(len(inproc)==0 or len(combine)==0):
+   print 'No limit found in %s' % (log if len(inproc)==0 else 'the combine output')
+   sys.exit(2)
+
+print '%-10s %12s %12s %10s' % ('limit', 'in-process', 'combine', 'rel. diff')
+nFailed = 0
+for key in ['2.5%', '16.0%', '50.0%', '84.0%', '97.5%', 'observed']:
+   if(key not in inproc or key not in combine): continue
+   diff = (inproc[key]-combine[key])/combine[key] if combine[key]!=0 else 0
+   flag = ''
+   if(abs(diff)>tolerance): flag = '  <-- above tolerance'; nFailed += 1
+   print '%-10s %12.4f %12.4f %+9.2f%%%s' % (key, inproc[key], combine[key], 100*diff, flag)
+
+if(nFailed>0):
+   print '%i limits differ by more than %g%%' % (nFailed, 100*tolerance)
+   sys.exit(1)
+print 'in-process limits agree with combine within %g%%' % (100*tolerance)
@@ -34,6 +34,8 @@ jsonPath='$CMSSW_BASE/src/UserCode/bsmhiggs_fwk/test/haa4b/samples_full2016_GGH.
 inUrl='$CMSSW_BASE/src/UserCode/bsmhiggs_fwk/test/haa4b/plotter.root'
 BESTDISCOVERYOPTIM=True #Set to True for best discovery optimization, Set to False for best limit optimization
 ASYMTOTICLIMIT=True #Set to True to compute asymptotic limits (faster) instead of toy based hybrid-new limits
+FASTSCAN=False #Set to True to scan the cuts (phase 1) with the asymptotic limits computed inside computeLimit instead of combine (pre-screening only, final limits still use combine)
+OPTIMWORKERS=8 #with FASTSCAN, the whole cut index x mass grid is ranked by a single computeLimit job using this number of processes
 BINS = ["eq0jets","geq1jets","vbf","eq0jets,geq1jets,vbf"] # list individual analysis bins to consider as well as combined bins (separated with a coma but without space)
 
 MASS = [ 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1500, 2000, 2500, 3000]
@@ -183,7 +185,32 @@ for signalSuffix in signalSuffixVec :
    ##   OPTIMIZATION LOOP                           ##
    ###################################################
 
-   if( phase == 1 ):
+   if( phase == 1 and FASTSCAN ):
+      print '# SCAN ALL POSSIBLE CUTS IN A SINGLE JOB  for ' + DataCardsDir + '#\n'
+      LaunchOnCondor.SendCluster_Create(FarmDirectory, JobName + "_"+signalSuffix+binSuffix+OUTName[iConf])
+      shapeCutMin_ = 0
+      shapeCutMax_ = 9999
+      #all the points of the grid are evaluated by one computeLimit call (the input file is read once), which writes the table of phase 2
+      #and the datacards of the best cut index of each mass
+      BATCH = open(OUT+'batch_optim.txt',"w")
+      i = 1
+      while (i<cutsH.GetXaxis().GetNbins()+1):
+         for m in MASS:
+            BATCH.writelines('H'+ str(m) + '_' + OUTName[iConf] + '_' + str(i) + ' --m ' + str(m) + ' --index ' + str(i) + '\n')
+         i = i+1
+      BATCH.close()
+      SCRIPT = open(OUT+'script_optim.sh',"w")
+      SCRIPT.writelines('cd ' + CMSSW_BASE + '/src;\n')
+      SCRIPT.writelines("export SCRAM_ARCH="+os.getenv("SCRAM_ARCH","slc6_amd64_gcc491")+";\n")
+      SCRIPT.writelines("eval `scram r -sh`;\n")
+      SCRIPT.writelines('mkdir -p ' + OUT + 'OPTIM;\n')
+      SCRIPT.writelines('cd ' + OUT + 'OPTIM;\n')
+      SCRIPT.writelines("computeLimit --batch " + OUT+'batch_optim.txt' + " --optim " + OUT+"/OPTIM"+signalSuffix+".txt" + (" --optimSignificance" if BESTDISCOVERYOPTIM else "") + " --batchWorkers " + str(OPTIMWORKERS) + " --in " + inUrl + " --syst " + " --json " + jsonUrl + " --shapeMin " + str(shapeCutMin_) + " --shapeMax " + str(shapeCutMax_) + " " + LandSArg + " --bins " + BIN[iConf] + " ;\n")
+      SCRIPT.close()
+      LaunchOnCondor.SendCluster_Push(["BASH", 'sh ' + OUT+'script_optim.sh'])
+      LaunchOnCondor.SendCluster_Submit()
+
+   elif( phase == 1 ):
       print '# RUN LIMITS FOR ALL POSSIBLE CUTS  for ' + DataCardsDir + '#\n'
       LaunchOnCondor.SendCluster_Create(FarmDirectory, JobName + "_"+signalSuffix+binSuffix+OUTName[iConf])
 
@@ -198,10 +225,15 @@ for signalSuffix in signalSuffixVec :
           SCRIPT.writelines("eval `scram r -sh`;\n")
           SCRIPT.writelines('cd -;\n')     
           for j in range(0, 1): #always run 1points per jobs
+             #all the mass points of this cut index are produced by a single computeLimit call (the input file is read once)
+             BATCH = open(OUT+'batch_'+str(i)+'_'+str(shapeCutMin_)+'_'+str(shapeCutMax_)+'.txt',"w")
+             for m in MASS:
+                BATCH.writelines('H'+ str(m) + '_' + OUTName[iConf] + '_' + str(i) + ' --m ' + str(m) + ' --index ' + str(i) + '\n')
+             BATCH.close()
+             SCRIPT.writelines("computeLimit --batch " + OUT+'batch_'+str(i)+'_'+str(shapeCutMin_)+'_'+str(shapeCutMax_)+'.txt' + " --in " + inUrl + " --syst " + " --json " + jsonUrl + " --shapeMin " + str(shapeCutMin_) + " --shapeMax " + str(shapeCutMax_) + " " + LandSArg + " --bins " + BIN[iConf] + " ;\n")
              for m in MASS:
                 cardsdir = 'H'+ str(m) + '_' + OUTName[iConf] + '_' + str(i);
-                SCRIPT.writelines('mkdir -p ' + cardsdir+';\ncd ' + cardsdir+';\n')
-                SCRIPT.writelines("computeLimit --m " + str(m) + " --in " + inUrl + " --syst " + " --index " + str(i)     + " --json " + jsonUrl + " --shapeMin " + str(shapeCutMin_) + " --shapeMax " + str(shapeCutMax_) + " " + LandSArg + " --bins " + BIN[iConf] + " ;\n")
+                SCRIPT.writelines('cd ' + cardsdir+';\n')
                 SCRIPT.writelines("sh combineCards.sh;\n")
                 SCRIPT.writelines("combine -M Asymptotic -m " +  str(m) + " --run expected card_combined.dat > LIMIT.log;\n") #limit computation
                 SCRIPT.writelines("combine -M ProfileLikelihood  -m " +  str(m) + " --significance -t -1 --expectSignal=1 card_combined.dat  > SIGN.log;\n") #apriori significance computation
@@ -220,6 +252,9 @@ for signalSuffix in signalSuffixVec :
    ###################################################
    ##   WRAPPING UP RESULTS                         ##
    ###################################################
+   elif(phase == 2 and FASTSCAN):
+      print("file "+OUT+"/OPTIM"+signalSuffix+".txt was written by computeLimit in phase 1: it contains all selection points ordered by exp limit (or significance)")
+
    elif(phase == 2):
       print '# SCANNING ALL SETS OF CUTS  for ' + DataCardsDir + ' (you may want to go for a coffee...)#\n'
       fileName = OUT + "/OPTIM"+signalSuffix
@@ -0,0 +1,153 @@
+//
+// Check of AsymptoticLimits on the reference cards of test/haa4b/computeLimit (asymptoticReference_*.dat):
+//  - counting: one bin without nuisance, the expected limit at the quantile q solves qA(r) = 2[r s - b ln(1+r s/b)] =
+//    (Z(alpha q) + Z(1-q))^2 with Z the upper quantile of the normal distribution, and the a priori significance is
+//    sqrt(2[(s+b) ln(1+s/b) - s]); they are required to agree within 0.1%
+//  - lnN and haa4b: the card is read (lnN uncertainties only) and the limits are required to agree within 1% with the
+//    reference limits in asymptoticReference_<card>.log, in the format of combine (see the header of these files for
+//    their origin, compareAsymptotic.py --record replaces them by the output of combine)
+// The results are printed in the format of combine, so that compareAsymptotic.py can compare them with combine on the
+// same card. Run with: scram b runtests (or directly: testAsymptoticLimits [counting|lnN|haa4b] [directory of the cards])
+//
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+#include "Math/QuantFuncMathCore.h"
+
+#include "UserCode/bsmhiggs_fwk/interface/AsymptoticLimits.h"
+
+//same model as asymptoticReference_counting.dat
+void buildCounting(AsymptoticLimits& model, double s, double b)
+{
+    int bin = model.addBin(b);
+    model.addYield(bin, s, true);
+    model.addYield(bin, b, false);
+}
+
+//model of a text datacard with lnN uncertainties only (kappa or kappaDown/kappaUp), false if it can not be read
+bool readCard(const std::string& path, AsymptoticLimits& model)
+{
+    std::ifstream card(path.c_str());
+    if(!card.good()) { printf("can not open %s\n", path.c_str()); return false; }
+    std::vector<std::string> bins, yieldBins, yieldProcs;
+    std::vector<int> yields, procIndex;
+    std::string line;
+    while(std::getline(card, line)) {
+        if(line.find('#')!=std::string::npos) line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string key, word;
+        if(!(words >> key) || key[0]=='-' || key=="imax" || key=="jmax" || key=="kmax") continue;
+        std::vector<std::string> values;
+        while(words >> word) values.push_back(word);
+        if(key=="bin" && bins.empty()) bins = values;
+        else if(key=="observation") { for(unsigned int i=0; i<values.size(); i++) model.addBin(atof(values[i].c_str())); }
+        else if(key=="bin") yieldBins = values;
+        else if(key=="process" && yieldProcs.empty()) yieldProcs = values;
+        else if(key=="process") { for(unsigned int i=0; i<values.size(); i++) procIndex.push_back(atoi(values[i].c_str())); }
+        else if(key=="rate") {
+            if(values.size()!=yieldBins.size() || procIndex.size()!=yieldBins.size()) { printf("%s: malformed process lines\n", path.c_str()); return false; }
+            for(unsigned int i=0; i<values.size(); i++) {
+                int bin = -1;
+                for(unsigned int j=0; j<bins.size(); j++) { if(bins[j]==yieldBins[i]) bin = j; }
+                yields.push_back(model.addYield(bin, atof(values[i].c_str()), procIndex[i]<=0));
+            }
+        }
+        else if(values.size()==yields.size()+1 && values[0]=="lnN") {
+            for(unsigned int i=0; i<yields.size(); i++) {
+                const std::string& kappa = values[i+1];
+                if(kappa=="-") continue;
+                size_t slash = kappa.find('/');
+                if(slash==std::string::npos) { double k = atof(kappa.c_str()); model.addEffect(yields[i], key, k, 1/k); }
+                else model.addEffect(yields[i], key, atof(kappa.substr(slash+1).c_str()), atof(kappa.substr(0, slash).c_str()));
+            }
+        }
+        else { printf("%s: unsupported line '%s'\n", path.c_str(), line.c_str()); return false; }
+    }
+    return model.nBins()>0 && !yields.empty();
+}
+
+//limits in the format of combine (Observed Limit: r < x, Expected  2.5%: r < x, ...), false if one is missing
+bool readReference(const std::string& path, double& observed, double expected[5])
+{
+    FILE* pFile = fopen(path.c_str(), "r");
+    if(!pFile) { printf("can not open %s\n", path.c_str()); return false; }
+    const char* labels[5] = {"2.5%", "16.0%", "50.0%", "84.0%", "97.5%"};
+    int found = 0;
+    char line[1024];
+    while(fgets(line, sizeof(line), pFile)) {
+        const char* limit = strstr(line, "r < ");
+        if(!limit || line[0]=='#') continue;
+        if(!strncmp(line, "Observed", 8)) { observed = atof(limit+4); found |= 1<<5; continue; }
+        for(int i=0; i<5; i++) { if(!strncmp(line, "Expected", 8) && strstr(line, labels[i])) { expected[i] = atof(limit+4); found |= 1<<i; } }
+    }
+    fclose(pFile);
+    if(found!=0x3F) printf("%s: some limits are missing\n", path.c_str());
+    return found==0x3F;
+}
+
+bool agree(const char* what, double value, double reference, double tolerance)
+{
+    bool ok = fabs(value-reference) <= tolerance*fabs(reference);
+    printf("%-20s %10.5f  reference %10.5f  %s\n", what, value, reference, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+//limits of a card compared with its reference log
+int checkCard(const std::string& dir, const char* card, double tolerance)
+{
+    std::string base = dir+"/asymptoticReference_"+card;
+    AsymptoticLimits model;
+    double observed, expected[5];
+    if(!readCard(base+".dat", model) || !readReference(base+".log", observed, expected)) return 1;
+    AsymptoticLimits::Result_t result;
+    if(!model.compute(result, true, false)) { printf("%s: no limit computed\n", card); return 1; }
+    printf("asymptoticReference_%s.dat", card);
+    AsymptoticLimits::print(stdout, result);
+
+    int nFailures = 0;
+    const char* labels[5] = {"expected  2.5%", "expected 16.0%", "expected 50.0%", "expected 84.0%", "expected 97.5%"};
+    for(int i=0; i<5; i++) { if(!agree(labels[i], result.expected[i], expected[i], tolerance)) nFailures++; }
+    if(!agree("observed", result.observed, observed, tolerance)) nFailures++;
+    return nFailures;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* card = argc>1 ? argv[1] : "";
+    std::string dir = argc>2 ? argv[2] : "";
+    if(dir=="") { const char* base = getenv("CMSSW_BASE"); dir = std::string(base ? base : ".")+"/src/UserCode/bsmhiggs_fwk/test/haa4b/computeLimit"; }
+    int nFailures = 0;
+
+    if(!strcmp(card, "") || !strcmp(card, "counting")) {
+        const double s = 5, b = 20, alpha = 0.05;  //same model as asymptoticReference_counting.dat
+        AsymptoticLimits model;
+        buildCounting(model, s, b);
+        AsymptoticLimits::Result_t result;
+        if(!model.compute(result, true, true)) { printf("counting: no limit computed\n"); return 1; }
+        printf("asymptoticReference_counting.dat");
+        AsymptoticLimits::print(stdout, result);
+
+        //qA is increasing in r, the crossings are found by bisection
+        const double quantiles[5] = {0.025, 0.16, 0.5, 0.84, 0.975};
+        const char* labels[5] = {"expected  2.5%", "expected 16.0%", "expected 50.0%", "expected 84.0%", "expected 97.5%"};
+        for(int i=0; i<5; i++) {
+            double z = ROOT::Math::normal_quantile_c(alpha*quantiles[i], 1.) + ROOT::Math::normal_quantile(quantiles[i], 1.), lo = 0, hi = 100;
+            for(int j=0; j<200; j++) { double r = 0.5*(lo+hi); if(sqrt(2*(r*s - b*log(1+r*s/b)))<z) lo = r; else hi = r; }
+            if(!agree(labels[i], result.expected[i], 0.5*(lo+hi), 1E-3)) nFailures++;
+        }
+        if(!agree("observed", result.observed, result.expected[2], 1E-3)) nFailures++;  //the data are the background expectation
+        if(!agree("significance", result.significance, sqrt(2*((s+b)*log(1+s/b) - s)), 1E-3)) nFailures++;
+    }
+
+    if(!strcmp(card, "") || !strcmp(card, "lnN"))   nFailures += checkCard(dir, "lnN", 1E-2);
+    if(!strcmp(card, "") || !strcmp(card, "haa4b")) nFailures += checkCard(dir, "haa4b", 1E-2);
+
+    if(nFailures) printf("%d disagreements with the references\n", nFailures);
+    return nFailures ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+//
+// Regression test of HistoMorpher against th1fmorph: random pairs of templates (same and different binnings,
+// variable bins, empty bins, empty inputs, par1==par2, extrapolation) are morphed with both and the contents of
+// the output bins, as well as the errors after addTo(), are required to agree.
+// Run with: scram b runtests (or directly: testHistoMorpher [nPairs])
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "TH1D.h"
+#include "TRandom3.h"
+
+#include "UserCode/bsmhiggs_fwk/interface/th1fmorph.h"
+#include "UserCode/bsmhiggs_fwk/interface/HistoMorpher.h"
+
+TRandom3 rnd(4357);
+
+//template with n bins in [x0,x1] (random variable bins if var), a fraction fEmpty of the bins is left empty
+TH1D* makeTemplate(const char* name, int n, double x0, double x1, bool var, double fEmpty)
+{
+    TH1D* h;
+    if(var) {
+        std::vector<double> edges(n+1, x0);
+        for(int i=1; i<=n; i++) edges[i] = edges[i-1] + (x1-x0)/n*(0.2+1.6*rnd.Uniform());
+        h = new TH1D(name, "", n, &edges[0]);
+    }
+    else h = new TH1D(name, "", n, x0, x1);
+    h->SetDirectory(0);
+    for(int i=1; i<=n; i++) h->SetBinContent(i, rnd.Uniform()<fEmpty ? 0 : 100*rnd.Uniform());
+    return h;
+}
+
+int main(int argc, char* argv[])
+{
+    int nPairs = argc>1 ? atoi(argv[1]) : 5000;
+    int nTests(0), nFailures(0);
+    double maxDiff(0);
+
+    for(int t=0; t<nPairs; t++) {
+        bool sameBinning = (t%3==0), var = (t%4==1);
+        int n1 = 1 + rnd.Integer(30), n2 = sameBinning ? n1 : 1 + rnd.Integer(30);
+        double x0 = 10*rnd.Uniform(), x1 = x0 + 5 + 50*rnd.Uniform();
+        double fEmpty = (t%5)*0.2;
+
+        TH1D* h1 = makeTemplate("h1", n1, x0, x1, var, fEmpty);
+        TH1D* h2 = (sameBinning && !var) ? makeTemplate("h2", n1, x0, x1, false, fEmpty)
+                                         : makeTemplate("h2", n2, x0+3*rnd.Uniform(), x1+3*rnd.Uniform(), var, fEmpty);
+        if(t%50==0) h2->Reset();
+        double par1 = 100 + 100*rnd.Uniform(), par2 = par1 + (t%17==0 ? 0 : 50);
+
+        HistoMorpher morpher(h1, h2, par1, par2);
+        for(int k=0; k<3; k++) {
+            //the last point is an extrapolation
+            double par = par1 + (par2-par1)*(k==2 ? 1.3 : rnd.Uniform()), norm = 1 + 10*rnd.Uniform();
+            double tolerance = 1e-12*(1+norm);
+            TH1D* ref = th1fmorph("ref", "ref", h1, h2, par1, par2, par, norm, 0);
+            ref->SetDirectory(0);
+            nTests++;
+
+            if(ref->GetNbinsX()!=morpher.nBins()) {
+                printf("pair %d: %d output bins instead of %d\n", t, morpher.nBins(), ref->GetNbinsX());
+                nFailures++; delete ref; continue;
+            }
+            std::vector<double> out(morpher.nBins());
+            morpher.morph(par, norm, &out[0]);
+            for(int i=0; i<morpher.nBins(); i++) {
+                double diff = fabs(out[i]-ref->GetBinContent(i+1));
+                if(diff>maxDiff) maxDiff = diff;
+                if(diff>tolerance) { printf("pair %d, par %g: bin %d is %g instead of %g\n", t, par, i+1, out[i], ref->GetBinContent(i+1)); nFailures++; break; }
+            }
+
+            //addTo must match h->Add(th1fmorph(...)), errors included
+            if(!morpher.isEmpty()) {
+                TH1D* sumRef = new TH1D("sumRef", "", morpher.nBins(), &morpher.edges()[0]); sumRef->SetDirectory(0);
+                TH1D* sum    = new TH1D("sum",    "", morpher.nBins(), &morpher.edges()[0]); sum->SetDirectory(0);
+                for(int i=0; i<=morpher.nBins()+1; i++) {
+                    double v = rnd.Uniform();
+                    sumRef->SetBinContent(i, v); sumRef->SetBinError(i, v/3);
+                    sum->SetBinContent(i, v);    sum->SetBinError(i, v/3);
+                }
+                sumRef->Add(ref, 1);
+                morpher.addTo(sum, par, norm);
+                for(int i=0; i<=morpher.nBins()+1; i++) {
+                    if(fabs(sum->GetBinContent(i)-sumRef->GetBinContent(i))>tolerance || fabs(sum->GetBinError(i)-sumRef->GetBinError(i))>1e-9) {
+                        printf("pair %d, par %g: addTo differs in bin %d\n", t, par, i); nFailures++; break;
+                    }
+                }
+                delete sumRef; delete sum;
+            }
+            delete ref;
+        }
+
+        //a morpher sharing the binning of another one gives the same result
+        HistoMorpher shared(h1, h2, par1, par2, &morpher);
+        std::vector<double> out1(morpher.nBins()), out2(shared.nBins());
+        morpher.morph(par1+1, 2, &out1[0]);
+        shared.morph(par1+1, 2, &out2[0]);
+        if(out1!=out2) { printf("pair %d: shared binning differs\n", t); nFailures++; }
+
+        delete h1; delete h2;
+    }
+
+    printf("HistoMorpher vs th1fmorph: %d tests on %d pairs, %d failures, max difference %g\n", nTests, nPairs, nFailures, maxDiff);
+    return nFailures ? 1 : 0;
+}
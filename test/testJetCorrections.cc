@@ -0,0 +1,157 @@
+//
+// Check of utils::cmssw::correctJets against the per-jet path it replaced in updateJEC: the same random jets (raw
+// p4, area, matched gen pt or none) are corrected with both and the corrected pt/energy, the JER smearing factor and
+// the JER/JES up/down variations are required to agree. Both paths are timed on the same jets.
+// The per-jet path is kept here as it was in updateJEC, including the if-chain of JER scale factors, so that the
+// shared eta-binned table of getJERScaleFactor is checked as well.
+// Run with: scram b runtests (or directly: testJetCorrections [jecDir] [nJets] [nRepeat])
+// jecDir defaults to the Summer16 MC corrections of data/jec
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "TRandom3.h"
+#include "TStopwatch.h"
+#include "TString.h"
+#include "TSystem.h"
+
+#include "UserCode/bsmhiggs_fwk/interface/MacroUtils.h"
+
+//JER smearing as it was before the table was shared (8 TeV values)
+std::vector<double> perJetSmearJER(double pt, double eta, double genPt)
+{
+    std::vector<double> toReturn(3,pt);
+    if(genPt<=0) return toReturn;
+
+    eta=fabs(eta);
+    double ptSF(1.0), ptSF_err(0.06);
+    if(eta<0.5)                  { ptSF=1.109; ptSF_err=0.008; }
+    else if(eta>=0.5 && eta<0.8) { ptSF=1.138; ptSF_err=0.013; }
+    else if(eta>=0.8 && eta<1.1) { ptSF=1.114; ptSF_err=0.013; }
+    else if(eta>=1.1 && eta<1.3) { ptSF=1.123; ptSF_err=0.024; }
+    else if(eta>=1.3 && eta<1.7) { ptSF=1.084; ptSF_err=0.011; }
+    else if(eta>=1.7 && eta<1.9) { ptSF=1.082; ptSF_err=0.035; }
+    else if(eta>=1.9 && eta<2.1) { ptSF=1.140; ptSF_err=0.047; }
+    else if(eta>=2.1 && eta<2.3) { ptSF=1.067; ptSF_err=0.053; }
+    else if(eta>=2.3 && eta<2.5) { ptSF=1.177; ptSF_err=0.041; }
+    else if(eta>=2.5 && eta<2.8) { ptSF=1.364; ptSF_err=0.039; }
+    else if(eta>=2.8 && eta<3.0) { ptSF=1.857; ptSF_err=0.071; }
+    else if(eta>=3.0 && eta<3.2) { ptSF=1.328; ptSF_err=0.022; }
+    else if(eta>=3.2 && eta<5.0) { ptSF=1.16 ; ptSF_err=0.029; }
+    toReturn[0]=TMath::Max(0.,((genPt+ptSF*(pt-genPt)))/pt);
+    toReturn[1]=TMath::Max(0.,((genPt+(ptSF+ptSF_err)*(pt-genPt)))/pt);
+    toReturn[2]=TMath::Max(0.,((genPt+(ptSF-ptSF_err)*(pt-genPt)))/pt);
+    return toReturn;
+}
+
+//corrected jet and its userFloats as set by the per-jet updateJEC
+struct Corrected_t { LorentzVector p4; double jerSF, jerUp, jerDown, jesUp, jesDown; };
+
+void perJetUpdateJEC(const std::vector<LorentzVector>& rawJets, const std::vector<float>& area, const std::vector<float>& genPt,
+                     FactorizedJetCorrector *jesCor, JetCorrectionUncertainty *totalJESUnc, float rho, int nvtx, std::vector<Corrected_t>& out)
+{
+    for(size_t ijet=0; ijet<rawJets.size(); ijet++){
+        const LorentzVector& rawJet = rawJets[ijet];
+        Corrected_t& jet = out[ijet];
+
+        //correct JES
+        jesCor->setJetEta(rawJet.eta());
+        jesCor->setJetPt(rawJet.pt());
+        jesCor->setJetA(area[ijet]);
+        jesCor->setRho(rho);
+        jesCor->setNPV(nvtx);
+        jet.p4 = rawJet*jesCor->getCorrection();
+
+        //smear JER
+        jet.jerSF = 1.0; jet.jerUp = 1.0; jet.jerDown = 1.0;
+        if(genPt[ijet]>0){
+            std::vector<double> smearJER=perJetSmearJER(jet.p4.pt(),jet.p4.eta(),genPt[ijet]);
+            jet.p4 = jet.p4*smearJER[0];
+            jet.jerSF = smearJER[0];
+            jet.jerUp   = smearJER[0]==0 ? smearJER[1] : smearJER[1]/smearJER[0];
+            jet.jerDown = smearJER[0]==0 ? smearJER[2] : smearJER[2]/smearJER[0];
+        }
+
+        //JES up/down pT alternatives
+        std::vector<float> ptUnc=utils::cmssw::smearJES(jet.p4.pt(),jet.p4.eta(), totalJESUnc);
+        jet.jesUp   = ptUnc[0];
+        jet.jesDown = ptUnc[1];
+    }
+}
+
+int nFailures = 0;
+
+//relative agreement, the batch path keeps its factors in float
+void agree(const char* what, size_t ijet, double value, double reference)
+{
+    if(fabs(value-reference) <= 1E-5*TMath::Max(1.,fabs(reference))) return;
+    if(nFailures<20) printf("jet %3lu %-8s %12.6f  per-jet %12.6f  FAILED\n", (unsigned long)ijet, what, value, reference);
+    nFailures++;
+}
+
+int main(int argc, char* argv[])
+{
+    TString jecDir = argc>1 ? argv[1] : "${CMSSW_BASE}/src/UserCode/bsmhiggs_fwk/data/jec/25ns/Summer16_80X/Summer16_23Sep2016V4_MC/";
+    size_t nJets  = argc>2 ? atoi(argv[2]) : 200;
+    int nRepeat   = argc>3 ? atoi(argv[3]) : 1000;
+    gSystem->ExpandPathName(jecDir);
+
+    FactorizedJetCorrector *jesCor = utils::cmssw::getJetCorrector(jecDir, true);
+    JetCorrectionUncertainty *totalJESUnc = new JetCorrectionUncertainty((jecDir+"/MC_Uncertainty_AK4PFchs.txt").Data());
+
+    //random jets over the full acceptance of the JER table (and beyond), 70% with a matched gen jet
+    TRandom3 rnd(4357);
+    const float rho = 18.5;
+    const int nvtx = 21;
+    std::vector<LorentzVector> rawJets(nJets);
+    std::vector<float> rawPt(nJets), eta(nJets), area(nJets), genPt(nJets, 0.);
+    for(size_t i=0; i<nJets; i++){
+        rawPt[i] = 15 + rnd.Exp(60);
+        eta  [i] = rnd.Uniform(-5.1, 5.1);
+        area [i] = rnd.Gaus(0.5, 0.05);
+        if(rnd.Uniform()<0.7) genPt[i] = rawPt[i]*rnd.Gaus(1.1, 0.15);
+        float mass = rawPt[i]*rnd.Uniform(0.05, 0.2);
+        double pz = rawPt[i]*sinh(eta[i]), phi = rnd.Uniform(-M_PI, M_PI);
+        rawJets[i] = LorentzVector(rawPt[i]*cos(phi), rawPt[i]*sin(phi), pz, sqrt(rawPt[i]*rawPt[i]+pz*pz+mass*mass));
+        eta  [i] = rawJets[i].eta();  //the batch path takes the eta of the raw p4, as updateJEC does
+    }
+
+    //per-jet path
+    std::vector<Corrected_t> ref(nJets);
+    TStopwatch perJetTimer;
+    for(int r=0; r<nRepeat; r++) perJetUpdateJEC(rawJets, area, genPt, jesCor, totalJESUnc, rho, nvtx, ref);
+    perJetTimer.Stop();
+
+    //batch path, the p4 is updated as in updateJEC
+    std::vector<float> jecSF(nJets), jerSF(nJets), jerUp(nJets), jerDown(nJets), jesUp(nJets), jesDown(nJets);
+    std::vector<LorentzVector> corrected(nJets);
+    TStopwatch batchTimer;
+    for(int r=0; r<nRepeat; r++){
+        utils::cmssw::correctJets(nJets, &rawPt[0], &eta[0], &area[0], &genPt[0], rho, nvtx, jesCor, totalJESUnc,
+                                  &jecSF[0], &jerSF[0], &jerUp[0], &jerDown[0], &jesUp[0], &jesDown[0]);
+        for(size_t i=0; i<nJets; i++) corrected[i] = rawJets[i]*(jecSF[i]*jerSF[i]);
+    }
+    batchTimer.Stop();
+
+    for(size_t i=0; i<nJets; i++){
+        agree("pt",      i, corrected[i].pt(), ref[i].p4.pt());
+        agree("energy",  i, corrected[i].E(),  ref[i].p4.E());
+        agree("jerSF",   i, jerSF  [i], ref[i].jerSF);
+        agree("jerup",   i, jerUp  [i], ref[i].jerUp);
+        agree("jerdown", i, jerDown[i], ref[i].jerDown);
+        agree("jesup",   i, jesUp  [i], ref[i].jesUp);
+        agree("jesdown", i, jesDown[i], ref[i].jesDown);
+    }
+
+    double nCorrected = double(nJets)*nRepeat;
+    printf("%lu jets x %d events\n", (unsigned long)nJets, nRepeat);
+    printf("per-jet path : %8.3f s cpu  %8.1f ns/jet\n", perJetTimer.CpuTime(), 1E9*perJetTimer.CpuTime()/nCorrected);
+    printf("correctJets  : %8.3f s cpu  %8.1f ns/jet\n", batchTimer.CpuTime(),  1E9*batchTimer.CpuTime()/nCorrected);
+
+    delete jesCor;
+    delete totalJESUnc;
+    if(nFailures) printf("%d disagreements with the per-jet path\n", nFailures);
+    return nFailures ? 1 : 0;
+}